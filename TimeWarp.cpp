@@ -9,323 +9,5308 @@
 #include "TimeWarp.hpp"
 #include <CoreSocket.hpp>
 #include <mutex>
+#include <condition_variable>
 #include <thread>
 #include <map>
 #include <memory>
 #include <atomic>
+#include <chrono>
+#include <set>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+#include <cmath>
 #include <string.h>
 #include <map>
 
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#define SHUT_RDWR SD_BOTH
+#else
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// The unix:// and shm:// transports are available on POSIX systems.  Readers
+// of a shared-memory endpoint sleep on a futex on Linux and poll elsewhere.
+#ifndef _WIN32
+#define TIMEWARP_USE_LOCAL_TRANSPORTS
+#endif
+
+// Offset journals are memory-mapped files, which are used on POSIX systems.
+#ifndef _WIN32
+#define TIMEWARP_USE_JOURNAL
+#endif
+
+// The event-loop server mode multiplexes its sockets using epoll, which is
+// only available on Linux.
+#ifdef __linux__
+#define TIMEWARP_USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <climits>
+#endif
+
 // Versioned magic-cookie string to send and receive at connection initialization.
 static std::string MagicCookie = "aqt::TimeWarp::Connection v01.00.00";
 
 // Op codes for commands between the client and server
 static const int64_t OP_SET_TIME = 1;
+static const int64_t OP_SET_SCHEDULE = 2;	///< Value is a count of (time, offset) records that follow
+static const int64_t OP_REQUEST_ACK = 3;	///< Value is a sequence number; acknowledge the next OP_SET_TIME
+static const int64_t OP_ACK = 4;			///< Server to client; see below
+static const int64_t OP_CAPS = 5;			///< Value is a set of CAP_ bits; see below
+static const int64_t OP_SET_TIME_DELTA = 6;	///< Protocol version 2 only: value is added to the previous offset
+static const int64_t OP_SCHEDULE_ENTRY = 7;	///< Protocol version 2 only: one (time, offset) entry of a schedule
+static const int64_t OP_GET = 8;			///< Value is a request number; answered by OP_OFFSET
+static const int64_t OP_SUBSCRIBE = 9;		///< Value is 1 to hear about every offset, 0 to stop
+static const int64_t OP_OFFSET = 10;		///< Server to client; see below
+static const int64_t OP_RAMP = 11;			///< Value is a target offset; followed by (microseconds, curve)
+static const int64_t OP_CHANNEL = 12;		///< Value is the channel that later OP_SET_TIMEs on the connection are for
+static const int64_t OP_PING = 13;			///< Value is the client's wall clock; answered by OP_PONG
+static const int64_t OP_PONG = 14;			///< Server to client; see below
+
+// Capabilities negotiated when a connection is opened.  A server that speaks
+// protocol version 2 follows its magic cookie with an OP_CAPS record listing
+// what it supports.  A client that wants some of them answers with an OP_CAPS
+// record after its own cookie listing the ones it will use, and both switch
+// to them for everything after that record.  Older peers never send OP_CAPS,
+// so each side falls back to version 1 with them.  OP_CAPS records are always
+// in the version 1 format.
+static const int64_t CAP_COMPACT = 1;		///< Protocol version 2 framing, below
+static const int64_t CAP_DELTA = 2;			///< OP_SET_TIME_DELTA may be sent
+static const int64_t CAP_CHANNELS = 4;		///< OP_CHANNEL may be sent
+static const int64_t CAP_CLOCK = 8;			///< OP_PING may be sent
+static const size_t CAPS_SIZE = 2 * sizeof(int64_t);
+
+// How long a client waits after the server's magic cookie for its OP_CAPS
+// record before deciding that the server only speaks version 1.
+static const int NEGOTIATION_TIMEOUT_US = 100000;
+
+// In protocol version 1, each command is a 64-bit op code followed by a 64-bit
+// value, both in network byte order.  In version 2, each is a frame of a
+// one-byte op code, the payload length as a varint and the payload, which
+// holds zigzag varints: the value, or for OP_SCHEDULE_ENTRY the time and the
+// offset.  An OP_SET_SCHEDULE frame is followed by its entries.  Receivers
+// ignore payload bytes they don't understand and skip frames whose op code
+// they don't know, so later versions can add to both.
+static const size_t MAX_FRAME_PAYLOAD = 65536;
+
+// The server acknowledges an offset after its callback returns by sending four
+// 64-bit values in network byte order: OP_ACK, the sequence number from the
+// request, and the server's monotonic clock in nanoseconds when the offset
+// was received and when the callback returned.
+static const size_t ACK_SIZE = 4 * sizeof(int64_t);
+
+// The server reports its current offset, in answer to OP_GET or to a client
+// that has sent OP_SUBSCRIBE, with a record the same size as an acknowledgement:
+// OP_OFFSET, the request number from OP_GET (0 for subscriptions), the number
+// of offsets the server has delivered to its callback counting this one (0 if
+// it has none, in which case the offset is meaningless) and the offset.
+
+// The server answers OP_PING with another record of that size: OP_PONG, the
+// value from the ping, and the server's wall clock in microseconds when the
+// ping arrived and when the answer was sent.
+
+// Number of answered pings a client keeps to estimate the server's clock.
+static const size_t CLOCK_SAMPLES = 8;
+
+// Number of acknowledgements a client keeps for WaitForAck().
+static const size_t ACK_HISTORY = 1024;
+
+// Number of error messages a server keeps for GetErrorMessages().
+static const size_t SERVER_ERROR_HISTORY = 256;
+
+// Furthest in the past or future, in microseconds, that a schedule entry's
+// time may be from the server's wall clock; entries beyond this are clamped
+// so that converting them to the steady clock cannot overflow.
+static const int64_t MAX_SCHEDULE_DELAY_US = 365LL * 24 * 60 * 60 * 1000000;
+
+// Multicast datagrams are five 64-bit values in network byte order: this
+// cookie ("TWMC" and a version), the publisher's sequence number (starting
+// at 1), an op code, its value, and the TCP port on which the publisher
+// answers requests for datagrams that were missed (0 if it does not).
+static const int64_t MULTICAST_COOKIE = 0x54574D4300000001LL;
+static const size_t MULTICAST_DATAGRAM_SIZE = 5 * sizeof(int64_t);
+
+// Number of recent datagrams a multicast publisher keeps to answer requests
+// from subscribers that missed some.
+static const size_t MULTICAST_HISTORY = 1024;
 
 using namespace atl::TimeWarp;
 using namespace atl::CoreSocket;
 
-class atl::TimeWarp::TimeWarpServer::TimeWarpServerPrivate {
+// A descriptor that can be waited on along with sockets and that another
+// thread can signal to wake up the waiters, so that threads can block without
+// a timeout and still be told promptly when to quit.  The signal stays set
+// until it is drained, so it wakes every thread waiting on it.
+class WakeupSignal {
 public:
-	// Mutex for all subthreads to use to avoid race conditions when
-	// accessing data structures.
-	std::mutex					m_mutex;
+	WakeupSignal()
+	{
+#if defined(__linux__)
+		m_read = m_write = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#elif defined(_WIN32)
+		// Windows can only wait on sockets, so use a UDP socket that sends to itself.
+		m_read = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if (m_read != BAD_SOCKET) {
+			struct sockaddr_in addr;
+			memset(&addr, 0, sizeof(addr));
+			addr.sin_family = AF_INET;
+			addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			int addrLen = sizeof(addr);
+			u_long nonBlocking = 1;
+			if (bind(m_read, reinterpret_cast<struct sockaddr*>(&addr), addrLen) != 0 ||
+				getsockname(m_read, reinterpret_cast<struct sockaddr*>(&addr), &addrLen) != 0 ||
+				connect(m_read, reinterpret_cast<struct sockaddr*>(&addr), addrLen) != 0 ||
+				ioctlsocket(m_read, FIONBIO, &nonBlocking) != 0) {
+				closesocket(m_read);
+				m_read = BAD_SOCKET;
+			}
+		}
+		m_write = m_read;
+#else
+		int fds[2];
+		if (pipe(fds) == 0) {
+			fcntl(fds[0], F_SETFL, O_NONBLOCK);
+			fcntl(fds[1], F_SETFL, O_NONBLOCK);
+			m_read = fds[0];
+			m_write = fds[1];
+		}
+#endif
+	}
 
-	TimeWarpServerCallback		m_callback = nullptr;
-	void*						m_userData = nullptr;
-	std::vector<std::string>	m_errors;
+	~WakeupSignal()
+	{
+		if (m_read == BAD_SOCKET) { return; }
+#if defined(_WIN32)
+		closesocket(m_read);
+#else
+		close(m_read);
+		if (m_write != m_read) { close(m_write); }
+#endif
+	}
 
-	SOCKET						m_listen = BAD_SOCKET;
-	std::thread					m_listenThread;
+	/// @brief Descriptor that becomes readable when the signal is set.
+	SOCKET Fd() const { return m_read; }
 
-	// This structure keeps track of threads and the sockets that they should
-	// be listening on.  Each thread is responsible for closing its own socket
-	// before it exits.  There is a map from std::size to the infos to make it
-	// easy for a thread to look up its entry and still allow each deletion
-	// without changing the placement (as would happen in a vector).
-	struct AcceptInfo {
-		AcceptInfo(std::shared_ptr<std::thread> t, SOCKET s) : m_thread(t), m_sock(s), m_done(false) {};
-		std::shared_ptr<std::thread>	m_thread;
-		SOCKET							m_sock;
-		std::atomic<bool>				m_done;
-	};
-	std::map<size_t, std::shared_ptr<AcceptInfo> > m_acceptThreads;
-	size_t				m_nextMapEntry = 0;
+	/// @brief Set the signal, waking anyone waiting on it.
+	void Signal()
+	{
+		if (m_write == BAD_SOCKET) { return; }
+#if defined(__linux__)
+		uint64_t one = 1;
+		ssize_t ret = write(m_write, &one, sizeof(one));
+		(void)ret;
+#elif defined(_WIN32)
+		char c = 0;
+		send(m_write, &c, 1, 0);
+#else
+		char c = 0;
+		ssize_t ret = write(m_write, &c, 1);
+		(void)ret;
+#endif
+	}
+
+	/// @brief Clear the signal.
+	void Drain()
+	{
+		if (m_read == BAD_SOCKET) { return; }
+		char buf[64];
+#if defined(_WIN32)
+		while (recv(m_read, buf, sizeof(buf), 0) > 0) {}
+#else
+		while (read(m_read, buf, sizeof(buf)) > 0) {}
+#endif
+	}
 
-	volatile bool				m_quit = false;		///< Time to shut down?
+private:
+	SOCKET m_read = BAD_SOCKET;
+	SOCKET m_write = BAD_SOCKET;
 };
 
-TimeWarpServer::TimeWarpServer(TimeWarpServerCallback callback, void* userData,
-	uint16_t port, std::string cardIP)
+/// @brief Wait until at least one of a small set of sockets is readable.
+/// @param [in] socks Sockets to wait on, at most eight of them.
+/// @param [in] count Number of entries in socks.
+/// @param [in] timeoutMs Milliseconds to wait; negative waits forever.
+/// @return Bitmask with bit i set if socks[i] is readable (or closed), 0 on
+///         timeout or interruption, -1 on error.
+static int wait_readable(const SOCKET* socks, size_t count, int timeoutMs)
 {
-	m_private.reset(new TimeWarpServerPrivate());
+#ifdef _WIN32
+	WSAPOLLFD fds[8];
+#else
+	struct pollfd fds[8];
+#endif
+	if (count > 8) { return -1; }
+	for (size_t i = 0; i < count; i++) {
+		fds[i].fd = socks[i];
+		fds[i].events = POLLIN;
+		fds[i].revents = 0;
+	}
+#ifdef _WIN32
+	int ret = WSAPoll(fds, static_cast<ULONG>(count), timeoutMs);
+#else
+	int ret = poll(fds, static_cast<nfds_t>(count), timeoutMs);
+	if (ret < 0 && errno == EINTR) { return 0; }
+#endif
+	if (ret < 0) { return -1; }
+	int mask = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+			mask |= (1 << i);
+		}
+	}
+	return mask;
+}
 
-	// Check and store the paramters
-	if (!callback) {
-		m_private->m_errors.push_back("Null callback handler passed to constructor");
-		return;
+/// @brief Read a fixed number of bytes from a blocking socket, giving up if
+///        they do not all arrive in time.  Unlike select(), this works for
+///        descriptors of any number, which a process with many connections has.
+/// @param [in] timeoutMs Milliseconds to wait for all of the bytes.
+/// @return Number of bytes read, which is less than len on timeout, or -1 if
+///         the socket failed or was closed.
+static int read_timeout(SOCKET s, char* buf, size_t len, int timeoutMs)
+{
+	size_t numRead = 0;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+	while (numRead < len) {
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+			deadline - std::chrono::steady_clock::now()).count();
+		int ready = wait_readable(&s, 1, left > 0 ? static_cast<int>(left) : 0);
+		if (ready < 0) { return -1; }
+		if (ready == 0) {
+			if (left <= 0) { break; }
+			continue;
+		}
+		int got = recv(s, buf + numRead, static_cast<int>(len - numRead), 0);
+		if (got <= 0) {
+#ifndef _WIN32
+			if (got < 0 && errno == EINTR) { continue; }
+#endif
+			return -1;
+		}
+		numRead += got;
 	}
-	m_private->m_callback = callback;
-	m_private->m_userData = userData;
+	return static_cast<int>(numRead);
+}
 
-	// Open the socket that we're going to listen on for new connections.
-	const char* cardIPChar = nullptr;
-	if (cardIP.size() > 0) {
-		cardIPChar = cardIP.c_str();
+/// @brief Make a socket blocking or non-blocking.
+/// @return True on success, false on failure.
+static bool set_nonblocking(SOCKET s, bool nonBlocking)
+{
+#ifdef _WIN32
+	u_long mode = nonBlocking ? 1 : 0;
+	return ioctlsocket(s, FIONBIO, &mode) == 0;
+#else
+	int flags = fcntl(s, F_GETFL, 0);
+	if (flags == -1) { return false; }
+	flags = nonBlocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+	return fcntl(s, F_SETFL, flags) == 0;
+#endif
+}
+
+/// @brief Open a TCP socket bound to a port with SO_REUSEPORT set, so that
+///        several sockets can listen on the same port.
+/// @param [in,out] port Port to bind to; if 0, filled in with the one chosen.
+/// @param [in] cardIP Address of the interface to bind to, nullptr for all.
+/// @return The socket, or BAD_SOCKET if it could not be opened or the
+///         platform does not have SO_REUSEPORT.
+static SOCKET open_reuseport_socket(uint16_t* port, const char* cardIP)
+{
+#ifdef SO_REUSEPORT
+	SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (s == BAD_SOCKET) { return BAD_SOCKET; }
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(*port);
+	socklen_t addrLen = sizeof(addr);
+	int one = 1;
+	if ((cardIP && inet_pton(AF_INET, cardIP, &addr.sin_addr) != 1) ||
+			setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+			setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0 ||
+			bind(s, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 ||
+			getsockname(s, reinterpret_cast<struct sockaddr*>(&addr), &addrLen) != 0) {
+		close(s);
+		return BAD_SOCKET;
 	}
-	m_private->m_listen = CoreSocket::open_tcp_socket(&port, cardIPChar);
-	if (m_private->m_listen == BAD_SOCKET) {
-		m_private->m_errors.push_back("Could not open socket " + std::to_string(port) +
-			" for listening");
-		return;
+	*port = ntohs(addr.sin_port);
+	return s;
+#else
+	return BAD_SOCKET;
+#endif
+}
+
+#ifdef _WIN32
+typedef WSAPOLLFD PollFd;
+#else
+typedef struct pollfd PollFd;
+#endif
+
+/// @brief Wait for events on any number of sockets.
+/// @param [in,out] fds Sockets and the events to wait for; revents is filled in.
+/// @param [in] timeoutMs Milliseconds to wait; negative waits forever.
+/// @return Number of sockets with events, 0 on timeout or interruption, -1 on error.
+static int poll_sockets(PollFd* fds, size_t count, int timeoutMs)
+{
+#ifdef _WIN32
+	return WSAPoll(fds, static_cast<ULONG>(count), timeoutMs);
+#else
+	int ret = poll(fds, static_cast<nfds_t>(count), timeoutMs);
+	if (ret < 0 && errno == EINTR) { return 0; }
+	return ret;
+#endif
+}
+
+/// @brief Find out what to do after a call on a non-blocking socket failed.
+/// @return 1 to try again right away, 0 to try again once the socket is
+///         ready, -1 if the socket has failed.
+static int socket_retry()
+{
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK ? 0 : -1;
+#else
+	if (errno == EINTR) { return 1; }
+	return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+#endif
+}
+
+/// @brief Nanoseconds on the monotonic clock, for timestamps that are only
+///        compared with others from the same host.
+static int64_t monotonic_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// @brief Wall-clock time in microseconds since the Unix epoch, as used for
+///        schedules and clock synchronization.
+static int64_t wall_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/// @brief Write all of a buffer to a socket, which may be non-blocking.  Where
+///        the platform allows, each send is non-blocking even if the socket is
+///        not, so that the timeout holds either way.
+/// @param [in] timeoutMs How long to wait for room in the socket each time it
+///             fills up before giving up; 0 to give up as soon as it is full.
+/// @return True on success, false on error or timeout.
+static bool write_all(SOCKET s, const char* data, size_t len, int timeoutMs)
+{
+#ifdef MSG_NOSIGNAL
+	const int flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+#elif defined(MSG_DONTWAIT)
+	const int flags = MSG_DONTWAIT;
+#else
+	const int flags = 0;
+#endif
+	while (len > 0) {
+		int ret = send(s, data, static_cast<int>(len), flags);
+		if (ret >= 0) {
+			data += ret;
+			len -= ret;
+			continue;
+		}
+#ifdef _WIN32
+		if (WSAGetLastError() != WSAEWOULDBLOCK) { return false; }
+		WSAPOLLFD fd;
+		fd.fd = s;
+		fd.events = POLLOUT;
+		fd.revents = 0;
+		if (WSAPoll(&fd, 1, timeoutMs) <= 0) { return false; }
+#else
+		if (errno == EINTR) { continue; }
+		if (errno != EAGAIN && errno != EWOULDBLOCK) { return false; }
+		struct pollfd fd;
+		fd.fd = s;
+		fd.events = POLLOUT;
+		fd.revents = 0;
+		if (poll(&fd, 1, timeoutMs) <= 0) { return false; }
+#endif
+	}
+	return true;
+}
+
+/// @brief Where a client connects or a server listens, parsed from a URI.
+struct Endpoint {
+	enum Transport { TCP, UNIX, SHM };
+	Transport	m_transport = TCP;
+	std::string	m_host;		///< For TCP
+	int			m_port = -1;	///< For TCP, -1 if the URI does not give one
+	std::string	m_path;		///< Socket path for UNIX, segment name for SHM
+};
+
+/// @brief Parse "tcp://host[:port]", "unix:///path/to/socket" or "shm://name".
+///        Anything without a scheme is taken to be a TCP host name.
+/// @return True on success, false if the URI is malformed.
+static bool parse_endpoint(const std::string& uri, Endpoint& e)
+{
+	size_t colon = uri.find("://");
+	if (colon == std::string::npos) {
+		e.m_transport = Endpoint::TCP;
+		e.m_host = uri;
+		return true;
+	}
+	std::string scheme = uri.substr(0, colon);
+	std::string rest = uri.substr(colon + 3);
+	if (scheme == "tcp") {
+		e.m_transport = Endpoint::TCP;
+		size_t portAt = rest.rfind(':');
+		if (portAt != std::string::npos) {
+			e.m_port = std::atoi(rest.c_str() + portAt + 1);
+			if (e.m_port <= 0 || e.m_port > 65535) { return false; }
+			rest = rest.substr(0, portAt);
+		}
+		e.m_host = rest;
+		return !rest.empty();
+	}
+	if (scheme == "unix") {
+		e.m_transport = Endpoint::UNIX;
+		e.m_path = rest;
+		return !rest.empty();
+	}
+	if (scheme == "shm") {
+		e.m_transport = Endpoint::SHM;
+		e.m_path = rest;
+		return !rest.empty() && rest.find('/') == std::string::npos;
+	}
+	return false;
+}
+
+#ifdef TIMEWARP_USE_LOCAL_TRANSPORTS
+/// @brief Open a Unix-domain stream socket, either listening at or connected to a path.
+/// @return The socket, or BAD_SOCKET (with error filled in) on failure.
+static SOCKET open_unix_socket(const std::string& path, bool listening, std::string& error)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path)) {
+		error = "Unix socket path too long: " + path;
+		return BAD_SOCKET;
+	}
+	memcpy(addr.sun_path, path.c_str(), path.size());
+
+	SOCKET s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == BAD_SOCKET) {
+		error = "Could not open Unix socket";
+		return BAD_SOCKET;
+	}
+	if (listening) {
+		// Remove any socket left behind by a server that did not shut down cleanly.
+		unlink(path.c_str());
+		if (bind(s, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 ||
+				listen(s, SOMAXCONN) != 0) {
+			error = "Could not listen on Unix socket " + path;
+			close(s);
+			return BAD_SOCKET;
+		}
+	} else if (connect(s, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+		error = "Could not connect to Unix socket " + path;
+		close(s);
+		return BAD_SOCKET;
+	}
+	return s;
+}
+
+/// @brief Let the other hyperthread run while spinning.
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+// A shared-memory endpoint holds only the latest offset.  Writers in any
+// process take turns using a seqlock: each moves m_seq from even to odd,
+// stores the offset and moves m_seq on to the next even number.  The one
+// reader (the server) retries until it sees the same even m_seq before and
+// after reading the offset.  Writers also bump m_futex after each write and
+// wake the reader if it has said that it is sleeping on it.
+static const uint64_t SHM_MAGIC = 0x545753484D000001ULL;		///< "TWSHM" and a version
+struct ShmLayout {
+	uint64_t				m_magic;
+	std::atomic<uint64_t>	m_seq;
+	std::atomic<int64_t>	m_offset;
+	std::atomic<uint32_t>	m_futex;
+	std::atomic<uint32_t>	m_sleeping;
+	std::atomic<uint32_t>	m_closed;	///< The server has gone away
+};
+
+class ShmChannel {
+public:
+	~ShmChannel()
+	{
+		if (m_shm) {
+			munmap(m_shm, sizeof(ShmLayout));
+		}
+		if (m_owner) {
+			shm_unlink(m_name.c_str());
+		}
+	}
+
+	/// @brief Create the segment, replacing any left behind.  Done by the server.
+	bool Create(const std::string& name, std::string& error)
+	{
+		m_name = "/timewarp." + name;
+		shm_unlink(m_name.c_str());
+		int fd = shm_open(m_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0660);
+		if (fd < 0 || ftruncate(fd, sizeof(ShmLayout)) != 0) {
+			if (fd >= 0) { close(fd); }
+			error = "Could not create shared memory " + m_name;
+			return false;
+		}
+		m_owner = true;
+		if (!Map(fd, error)) { return false; }
+		m_shm->m_magic = SHM_MAGIC;
+		return true;
+	}
+
+	/// @brief Attach to a segment created by a server.  Done by clients.
+	bool Open(const std::string& name, std::string& error)
+	{
+		m_name = "/timewarp." + name;
+		int fd = shm_open(m_name.c_str(), O_RDWR, 0);
+		if (fd < 0) {
+			error = "Could not open shared memory " + m_name;
+			return false;
+		}
+		if (!Map(fd, error)) { return false; }
+		if (m_shm->m_magic != SHM_MAGIC) {
+			error = "Bad magic number in shared memory " + m_name;
+			return false;
+		}
+		return true;
+	}
+
+	/// @brief Publish a new offset.
+	/// @return False if the server has gone away.
+	bool Write(int64_t offset)
+	{
+		uint64_t seq = m_shm->m_seq.load(std::memory_order_relaxed);
+		while ((seq & 1) || !m_shm->m_seq.compare_exchange_weak(seq, seq + 1,
+				std::memory_order_acquire, std::memory_order_relaxed)) {
+			cpu_relax();
+			seq = m_shm->m_seq.load(std::memory_order_relaxed);
+		}
+		m_shm->m_offset.store(offset, std::memory_order_relaxed);
+		m_shm->m_seq.store(seq + 2, std::memory_order_seq_cst);
+		m_shm->m_futex.fetch_add(1, std::memory_order_seq_cst);
+		if (m_shm->m_sleeping.load(std::memory_order_seq_cst)) {
+#ifdef __linux__
+			syscall(SYS_futex, &m_shm->m_futex, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+		}
+		return !m_shm->m_closed.load(std::memory_order_relaxed);
+	}
+
+	/// @brief Wait for an offset written after the one with sequence lastSeq.
+	///        Spins for a while first, so that a busy reader sees new offsets
+	///        without waiting to be woken.
+	/// @return True with the new offset, false once Close() has been called.
+	bool Read(uint64_t& lastSeq, int64_t& offset, std::chrono::microseconds spin)
+	{
+		auto spinUntil = std::chrono::steady_clock::now() + spin;
+		for (unsigned i = 1; ; i++) {
+			if (m_shm->m_closed.load(std::memory_order_relaxed)) {
+				return false;
+			}
+			uint64_t seq = m_shm->m_seq.load(std::memory_order_acquire);
+			if (!(seq & 1) && seq != lastSeq) {
+				int64_t value = m_shm->m_offset.load(std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (m_shm->m_seq.load(std::memory_order_relaxed) == seq) {
+					lastSeq = seq;
+					offset = value;
+					return true;
+				}
+				continue;
+			}
+			if ((i % 64) != 0 || std::chrono::steady_clock::now() < spinUntil) {
+				cpu_relax();
+				continue;
+			}
+
+			// Say that we're going to sleep and look once more, so that a writer
+			// either sees the flag or we see its offset.
+			uint32_t futex = m_shm->m_futex.load(std::memory_order_seq_cst);
+			m_shm->m_sleeping.store(1, std::memory_order_seq_cst);
+			if (m_shm->m_seq.load(std::memory_order_seq_cst) == lastSeq &&
+					!m_shm->m_closed.load(std::memory_order_seq_cst)) {
+#ifdef __linux__
+				struct timespec timeout = { 0, 100000000 };
+				syscall(SYS_futex, &m_shm->m_futex, FUTEX_WAIT, futex, &timeout, nullptr, 0);
+#else
+				std::this_thread::sleep_for(std::chrono::microseconds(200));
+#endif
+			}
+			m_shm->m_sleeping.store(0, std::memory_order_relaxed);
+			spinUntil = std::chrono::steady_clock::now() + spin;
+		}
+	}
+
+	/// @brief Tell the reader and writers that the server is going away.
+	void Close()
+	{
+		m_shm->m_closed.store(1, std::memory_order_seq_cst);
+		m_shm->m_futex.fetch_add(1, std::memory_order_seq_cst);
+#ifdef __linux__
+		syscall(SYS_futex, &m_shm->m_futex, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+	}
+
+private:
+	bool Map(int fd, std::string& error)
+	{
+		void* mem = mmap(nullptr, sizeof(ShmLayout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mem == MAP_FAILED) {
+			error = "Could not map shared memory " + m_name;
+			return false;
+		}
+		m_shm = static_cast<ShmLayout*>(mem);
+		return true;
+	}
+
+	ShmLayout*	m_shm = nullptr;
+	std::string	m_name;
+	bool		m_owner = false;
+};
+#endif
+
+// An offset journal is a file holding a JournalHeader followed by one
+// JournalRecord for each offset the server has queued for its callback, in
+// host byte order.  The file is mapped into memory and grown as needed, and
+// m_count is only advanced once the records before it have been written, so
+// a process that stops at any point leaves a journal that can be read.
+static const uint64_t JOURNAL_MAGIC = 0x54574A524E000001ULL;	///< "TWJRN" and a version
+struct JournalHeader {
+	uint64_t				m_magic;
+	uint64_t				m_recordSize;
+	std::atomic<uint64_t>	m_count;
+	uint64_t				m_reserved[5];
+};
+struct JournalRecord {
+	int64_t		m_wallTime;		///< wall_us() when the offset was queued
+	uint64_t	m_connection;
+	uint32_t	m_kind;			///< TimeWarpUpdateKind
+	uint32_t	m_channel;
+	int64_t		m_offset;
+};
+
+#ifdef TIMEWARP_USE_JOURNAL
+class Journal {
+public:
+	~Journal()
+	{
+		if (m_header) {
+			size_t used = sizeof(JournalHeader) + Count() * sizeof(JournalRecord);
+			munmap(m_header, m_size);
+
+			// Give back the room that was mapped ahead of the last record.
+			if (!m_readOnly && ftruncate(m_fd, used) != 0) {
+				// It is just left at the end of the file.
+			}
+		}
+		if (m_fd >= 0) {
+			close(m_fd);
+		}
+	}
+
+	/// @brief Open a journal, creating it if it does not exist and writing is
+	///        allowed.  Records already in it are left in place.
+	bool Open(const std::string& path, bool readOnly, std::string& error)
+	{
+		m_readOnly = readOnly;
+		m_fd = readOnly ? open(path.c_str(), O_RDONLY) : open(path.c_str(), O_RDWR | O_CREAT, 0664);
+		struct stat st;
+		if (m_fd < 0 || fstat(m_fd, &st) != 0) {
+			error = "Could not open journal " + path;
+			return false;
+		}
+		size_t size = static_cast<size_t>(st.st_size);
+		if (size == 0 && !readOnly) {
+			JournalHeader header{};
+			header.m_magic = JOURNAL_MAGIC;
+			header.m_recordSize = sizeof(JournalRecord);
+			if (write(m_fd, &header, sizeof(header)) != static_cast<ssize_t>(sizeof(header))) {
+				error = "Could not write journal " + path;
+				return false;
+			}
+			size = sizeof(header);
+		}
+		if (size < sizeof(JournalHeader) || !Map(size)) {
+			error = "Could not map journal " + path;
+			return false;
+		}
+		if (m_header->m_magic != JOURNAL_MAGIC || m_header->m_recordSize != sizeof(JournalRecord)) {
+			error = "Bad journal " + path;
+			return false;
+		}
+		if (!readOnly) {
+			m_header->m_count.store(Count());
+		}
+		return true;
+	}
+
+	/// @brief Number of records in the journal, and the records themselves.
+	///        A server may have added records beyond the part of the file
+	///        that a reader has mapped; those are left out.
+	uint64_t Count() const
+	{
+		return std::min<uint64_t>(m_header->m_count.load(std::memory_order_acquire),
+			(m_size - sizeof(JournalHeader)) / sizeof(JournalRecord));
+	}
+	const JournalRecord* Records() const
+	{
+		return reinterpret_cast<const JournalRecord*>(m_header + 1);
+	}
+
+	/// @brief Add records to the end of the journal, growing it if needed.
+	/// @return False if the journal could not be grown.
+	bool Append(const JournalRecord* records, size_t count)
+	{
+		uint64_t have = m_header->m_count.load(std::memory_order_relaxed);
+		size_t need = sizeof(JournalHeader) + (have + count) * sizeof(JournalRecord);
+		if (need > m_size) {
+			size_t size = std::max<size_t>(need, std::max<size_t>(2 * m_size, 1 << 20));
+			munmap(m_header, m_size);
+			m_header = nullptr;
+			if (ftruncate(m_fd, size) != 0 || !Map(size)) {
+				return false;
+			}
+		}
+		memcpy(reinterpret_cast<JournalRecord*>(m_header + 1) + have, records,
+			count * sizeof(JournalRecord));
+		m_header->m_count.store(have + count, std::memory_order_release);
+		return true;
+	}
+
+private:
+	bool Map(size_t size)
+	{
+		void* mem = mmap(nullptr, size, m_readOnly ? PROT_READ : PROT_READ | PROT_WRITE,
+			MAP_SHARED, m_fd, 0);
+		if (mem == MAP_FAILED) {
+			return false;
+		}
+		m_header = static_cast<JournalHeader*>(mem);
+		m_size = size;
+		return true;
+	}
+
+	int				m_fd = -1;
+	bool			m_readOnly = false;
+	JournalHeader*	m_header = nullptr;
+	size_t			m_size = 0;
+};
+#endif
+
+/// @brief Ask a multicast publisher for offsets that we missed.
+/// @param [in] host Address of the publisher.
+/// @param [in] port Port that the publisher answers requests on.
+/// @param [in] fromSeq First sequence number wanted; 0 to ask for only the latest.
+/// @param [out] out (sequence, offset) pairs that the publisher still had.
+/// @return True on success, false if the publisher could not be reached.
+static bool fetch_multicast_history(const std::string& host, int port, int64_t fromSeq,
+	std::vector<std::pair<int64_t, int64_t> >& out)
+{
+	SOCKET s;
+	if (!atl::CoreSocket::connect_tcp_to(host.c_str(), port, nullptr, &s)) {
+		return false;
+	}
+	bool ret = false;
+	int64_t req = atl::CoreSocket::hton(fromSeq);
+	int64_t count;
+	struct timeval timeout = { 0, 250000 };
+	if (sizeof(req) == atl::CoreSocket::noint_block_write(s, reinterpret_cast<char*>(&req), sizeof(req)) &&
+		sizeof(count) == atl::CoreSocket::noint_block_read_timeout(s, reinterpret_cast<char*>(&count),
+			sizeof(count), &timeout)) {
+		count = atl::CoreSocket::ntoh(count);
+		if (count >= 0 && count <= static_cast<int64_t>(MULTICAST_HISTORY)) {
+			std::vector<int64_t> pairs(2 * static_cast<size_t>(count));
+			size_t len = pairs.size() * sizeof(int64_t);
+			timeout = { 0, 250000 };
+			if (len == 0 || static_cast<int>(len) == atl::CoreSocket::noint_block_read_timeout(s,
+					reinterpret_cast<char*>(pairs.data()), len, &timeout)) {
+				for (size_t i = 0; i < pairs.size(); i += 2) {
+					out.push_back(std::make_pair(atl::CoreSocket::ntoh(pairs[i]), atl::CoreSocket::ntoh(pairs[i + 1])));
+				}
+				ret = true;
+			}
+		}
+	}
+	atl::CoreSocket::close_socket(s);
+	return ret;
+}
+
+// Varint and zigzag encoding for protocol version 2.  Varints hold seven bits
+// per byte, least significant first, with the top bit set on all but the last.
+// Zigzag maps signed values to unsigned ones so that small negative values are
+// short too.
+static const size_t MAX_VARINT_SIZE = 10;
+
+static inline uint64_t zigzag(int64_t v)
+{
+	return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+	return static_cast<int64_t>((v >> 1) ^ (~(v & 1) + 1));
+}
+
+static inline size_t put_varint(uint64_t v, char* out)
+{
+	size_t n = 0;
+	while (v >= 0x80) {
+		out[n++] = static_cast<char>((v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	out[n++] = static_cast<char>(v);
+	return n;
+}
+
+static inline size_t varint_size(uint64_t v)
+{
+	size_t n = 1;
+	while (v >= 0x80) {
+		v >>= 7;
+		n++;
+	}
+	return n;
+}
+
+/// @brief Read a varint, advancing p past it.
+/// @return 1 on success, 0 if the data ends first (p is unchanged), -1 if it
+///         is too long to be a varint.
+static inline int get_varint(const char*& p, const char* end, uint64_t& v)
+{
+	v = 0;
+	const char* q = p;
+	for (size_t i = 0; i < MAX_VARINT_SIZE; i++) {
+		if (q == end) { return 0; }
+		uint8_t b = static_cast<uint8_t>(*q++);
+		v |= static_cast<uint64_t>(b & 0x7f) << (7 * i);
+		if (!(b & 0x80)) {
+			p = q;
+			return 1;
+		}
+	}
+	return -1;
+}
+
+// Splits a stream of bytes into commands, holding on to any partial command
+// until the rest of it arrives.  Streams start out as fixed-size version 1
+// records and switch to version 2 frames when told to; see above.
+class RecordAssembler {
+public:
+	static const size_t RECORD_SIZE = 2 * sizeof(int64_t);
+
+	/// @brief Treat everything after the current record as version 2 frames.
+	void SetCompact() { m_compact = true; }
+	bool Compact() const { return m_compact; }
+
+	/// @brief Number of frames skipped because their op code was unknown
+	///        since the last call.
+	uint64_t TakeSkipped()
+	{
+		uint64_t ret = m_skipped;
+		m_skipped = 0;
+		return ret;
+	}
+
+	/// @brief Description of the last malformed frame, or null if none.
+	const char* Error() const { return m_error; }
+
+	/// @brief Add bytes from the stream, calling handler(op, value) for each
+	///        complete command.  Schedule entries are passed as (time, offset)
+	///        and delta-encoded offsets as the full offset, so the handler sees
+	///        the same thing whichever version was sent.  The handler returns
+	///        false to stop processing.
+	/// @return False if the handler asked to stop or a frame was malformed.
+	template <class Handler>
+	bool Consume(const char* data, size_t len, Handler handler)
+	{
+		while (len > 0 && !m_compact) {
+			size_t chunk = RECORD_SIZE - m_have;
+			if (chunk > len) { chunk = len; }
+			memcpy(&m_partial[m_have], data, chunk);
+			m_have += chunk;
+			data += chunk;
+			len -= chunk;
+			if (m_have == RECORD_SIZE) {
+				int64_t op, value;
+				memcpy(&op, &m_partial[0], sizeof(op));
+				memcpy(&value, &m_partial[sizeof(op)], sizeof(value));
+				m_have = 0;
+				if (!handler(atl::CoreSocket::ntoh(op), atl::CoreSocket::ntoh(value))) {
+					return false;
+				}
+			}
+		}
+		if (len == 0) {
+			return true;
+		}
+
+		// Work from the bytes left over from last time, if there are any, and
+		// keep whatever is left over this time.
+		const char* p = data;
+		const char* end = data + len;
+		if (!m_pending.empty()) {
+			m_pending.insert(m_pending.end(), data, end);
+			p = m_pending.data();
+			end = p + m_pending.size();
+		}
+		while (p < end) {
+			const char* frame = p++;
+			uint64_t length;
+			int got = get_varint(p, end, length);
+			if (got < 0 || length > MAX_FRAME_PAYLOAD) {
+				m_error = "Bad frame length from client";
+				return false;
+			}
+			if (got == 0 || static_cast<uint64_t>(end - p) < length) {
+				p = frame;
+				break;
+			}
+			const char* payload = p;
+			p += length;
+			if (!HandleFrame(static_cast<uint8_t>(*frame), payload, p, handler)) {
+				return false;
+			}
+		}
+		if (!m_pending.empty()) {
+			m_pending.erase(m_pending.begin(), m_pending.begin() + (p - m_pending.data()));
+		} else {
+			m_pending.assign(p, end);
+		}
+		return true;
+	}
+
+private:
+	char				m_partial[RECORD_SIZE];
+	size_t				m_have = 0;
+	bool				m_compact = false;
+	std::vector<char>	m_pending;			///< Partial version 2 frame
+	int64_t				m_previous = 0;		///< Last offset, for OP_SET_TIME_DELTA
+	uint64_t			m_skipped = 0;
+	const char*			m_error = nullptr;
+
+	template <class Handler>
+	bool HandleFrame(uint8_t op, const char* p, const char* end, Handler& handler)
+	{
+		uint64_t a, b, c;
+		switch (op) {
+		case OP_SET_TIME:
+		case OP_SET_TIME_DELTA:
+			if (get_varint(p, end, a) != 1) { break; }
+			m_previous = (op == OP_SET_TIME) ? unzigzag(a) :
+				static_cast<int64_t>(static_cast<uint64_t>(m_previous) + static_cast<uint64_t>(unzigzag(a)));
+			return handler(OP_SET_TIME, m_previous);
+
+		case OP_SET_SCHEDULE:
+		case OP_REQUEST_ACK:
+		case OP_GET:
+		case OP_SUBSCRIBE:
+		case OP_CHANNEL:
+		case OP_PING:
+			if (get_varint(p, end, a) != 1) { break; }
+			return handler(op, unzigzag(a));
+
+		case OP_SCHEDULE_ENTRY:
+			if (get_varint(p, end, a) != 1 || get_varint(p, end, b) != 1) { break; }
+			return handler(unzigzag(a), unzigzag(b));
+
+		case OP_RAMP:
+			if (get_varint(p, end, a) != 1 || get_varint(p, end, b) != 1 ||
+					get_varint(p, end, c) != 1) { break; }
+			return handler(OP_RAMP, unzigzag(a)) && handler(unzigzag(b), unzigzag(c));
+
+		default:
+			m_skipped++;
+			return true;
+		}
+		m_error = "Malformed frame from client";
+		return false;
+	}
+};
+
+// Encodes commands for a connection in whichever protocol version it uses.
+class WireEncoder {
+public:
+	/// @brief Most bytes that one command can take.
+	static const size_t MAX_COMMAND_SIZE = 2 + 2 * MAX_VARINT_SIZE;
+
+	/// @brief Start encoding for a new connection with the negotiated CAP_ bits.
+	void Reset(int64_t caps)
+	{
+		m_compact = (caps & CAP_COMPACT) != 0;
+		m_delta = (caps & CAP_DELTA) != 0;
+		m_havePrevious = false;
+		m_scheduleRemaining = 0;
+	}
+
+	int Version() const { return m_compact ? 2 : 1; }
+
+	/// @brief Encode (op, value) pairs as the receiver's RecordAssembler
+	///        expects them.  Schedule entries follow their OP_SET_SCHEDULE as
+	///        (time, offset) pairs, and the (duration, curve) of a ramp follows
+	///        its OP_RAMP, just as in version 1.
+	/// @param [out] out Room for count * MAX_COMMAND_SIZE bytes.
+	/// @return Number of bytes used.
+	size_t Encode(const int64_t* commands, size_t count, char* out)
+	{
+		char* o = out;
+		for (size_t i = 0; i < count; i++) {
+			int64_t op = commands[2 * i];
+			int64_t value = commands[2 * i + 1];
+			if (!m_compact) {
+				int64_t record[2] = { atl::CoreSocket::hton(op), atl::CoreSocket::hton(value) };
+				memcpy(o, record, sizeof(record));
+				o += sizeof(record);
+				continue;
+			}
+			uint64_t values[3] = { zigzag(value) };
+			if (m_scheduleRemaining > 0) {
+				m_scheduleRemaining--;
+				values[0] = zigzag(op);
+				values[1] = zigzag(value);
+				o = Frame(o, OP_SCHEDULE_ENTRY, values, 2);
+				continue;
+			}
+			if (op == OP_SET_TIME) {
+				uint64_t delta = zigzag(static_cast<int64_t>(
+					static_cast<uint64_t>(value) - static_cast<uint64_t>(m_previous)));
+				bool useDelta = m_delta && m_havePrevious && varint_size(delta) < varint_size(values[0]);
+				m_previous = value;
+				m_havePrevious = true;
+				if (useDelta) {
+					values[0] = delta;
+				}
+				o = Frame(o, useDelta ? OP_SET_TIME_DELTA : OP_SET_TIME, values, 1);
+				continue;
+			}
+			if (op == OP_RAMP && i + 1 < count) {
+				i++;
+				values[1] = zigzag(commands[2 * i]);
+				values[2] = zigzag(commands[2 * i + 1]);
+				o = Frame(o, OP_RAMP, values, 3);
+				continue;
+			}
+			if (op == OP_SET_SCHEDULE) {
+				m_scheduleRemaining = value;
+			}
+			o = Frame(o, op, values, 1);
+		}
+		return o - out;
+	}
+
+private:
+	bool	m_compact = false;
+	bool	m_delta = false;
+	bool	m_havePrevious = false;
+	int64_t	m_previous = 0;
+	int64_t	m_scheduleRemaining = 0;
+
+	/// @brief Write a frame holding up to three values that have already
+	///        been zigzag encoded.
+	static char* Frame(char* o, int64_t op, const uint64_t* values, size_t count)
+	{
+		char payload[3 * MAX_VARINT_SIZE];
+		size_t len = 0;
+		for (size_t i = 0; i < count; i++) {
+			len += put_varint(values[i], payload + len);
+		}
+		*o++ = static_cast<char>(op);
+		*o++ = static_cast<char>(len);		// Always less than 0x80
+		memcpy(o, payload, len);
+		return o + len;
+	}
+};
+
+// Hashed timing wheel holding entries (anything with an m_due time point) that
+// are to be handled at particular times.  Entries live in the slot for the
+// tick in which they are due, so adding an entry and collecting the ones that
+// are due take time proportional to the entries involved rather than to the
+// number that are pending.  Not thread-safe; the owner provides locking.
+template <class Entry>
+class TimerWheel {
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	TimerWheel(Clock::duration tick, size_t slots)
+		: m_tick(tick), m_slots(slots), m_current(TickOf(Clock::now())) {}
+
+	bool Empty() const { return m_count == 0; }
+
+	/// @brief Add an entry.  Entries that are already due go in the current tick.
+	void Add(Entry e)
+	{
+		int64_t t = TickOf(e.m_due);
+		if (t < m_current) { t = m_current; }
+		m_slots[t % m_slots.size()].push_back(std::move(e));
+		m_count++;
+	}
+
+	/// @brief Move all entries that are due by the specified time into out
+	///        (in no particular order) and advance the wheel to that time.
+	///        Entries due later in the current tick stay where they are.
+	void Collect(Clock::time_point now, std::vector<Entry>& out)
+	{
+		int64_t target = TickOf(now);
+		// If we've been idle for more than a revolution, each slot only needs
+		// to be looked at once.
+		int64_t first = m_current;
+		if (target - first >= static_cast<int64_t>(m_slots.size())) {
+			first = target - static_cast<int64_t>(m_slots.size()) + 1;
+		}
+		for (int64_t t = first; t <= target; t++) {
+			std::vector<Entry>& slot = m_slots[t % m_slots.size()];
+			for (size_t i = 0; i < slot.size(); ) {
+				if (slot[i].m_due <= now) {
+					out.push_back(std::move(slot[i]));
+					slot[i] = std::move(slot.back());
+					slot.pop_back();
+					m_count--;
+				} else {
+					i++;
+				}
+			}
+		}
+		if (target > m_current) { m_current = target; }
+	}
+
+	/// @brief When the earliest pending entry is due.  Looks at most one
+	///        revolution ahead; if nothing is due by then, returns the end
+	///        of that revolution so the caller will look again.
+	Clock::time_point NextDue() const
+	{
+		int64_t size = static_cast<int64_t>(m_slots.size());
+		for (int64_t t = m_current; t < m_current + size; t++) {
+			const std::vector<Entry>& slot = m_slots[t % size];
+			bool found = false;
+			Clock::time_point best = Clock::time_point::max();
+			for (const Entry& e : slot) {
+				if (TickOf(e.m_due) <= t && e.m_due < best) {
+					best = e.m_due;
+					found = true;
+				}
+			}
+			if (found) { return best; }
+		}
+		return Clock::time_point(m_tick * (m_current + size));
+	}
+
+private:
+	int64_t TickOf(Clock::time_point t) const
+	{
+		return static_cast<int64_t>(t.time_since_epoch() / m_tick);
+	}
+
+	Clock::duration						m_tick;
+	std::vector<std::vector<Entry> >	m_slots;
+	int64_t								m_current;		///< Earliest tick that may hold entries
+	size_t								m_count = 0;
+};
+
+// Bounded lock-free queue that any number of threads can push into and a
+// single thread pops from (D. Vyukov's bounded MPMC design).  Each cell
+// carries a sequence number that tells producers and the consumer whether it
+// is free or full, so neither side ever takes a lock.
+template <class T>
+class MPSCQueue {
+public:
+	explicit MPSCQueue(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity) { size *= 2; }
+		m_cells.reset(new Cell[size]);
+		for (size_t i = 0; i < size; i++) {
+			m_cells[i].m_seq.store(i, std::memory_order_relaxed);
+		}
+		m_mask = size - 1;
+		m_enqueue.store(0, std::memory_order_relaxed);
+		m_dequeue.store(0, std::memory_order_relaxed);
+	}
+
+	/// @brief Add an entry to the queue.  Safe to call from any thread.
+	/// @return False if the queue is full.
+	bool TryPush(const T& value)
+	{
+		Cell* cell;
+		size_t pos = m_enqueue.load(std::memory_order_relaxed);
+		while (true) {
+			cell = &m_cells[pos & m_mask];
+			size_t seq = cell->m_seq.load(std::memory_order_acquire);
+			intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+			if (dif == 0) {
+				if (m_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (dif < 0) {
+				return false;
+			} else {
+				pos = m_enqueue.load(std::memory_order_relaxed);
+			}
+		}
+		cell->m_value = value;
+		cell->m_seq.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	/// @brief Remove the oldest entry.  Only call from the consumer thread.
+	/// @return False if the queue is empty.
+	bool TryPop(T& value)
+	{
+		size_t pos = m_dequeue.load(std::memory_order_relaxed);
+		Cell* cell = &m_cells[pos & m_mask];
+		size_t seq = cell->m_seq.load(std::memory_order_acquire);
+		if (static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1) < 0) {
+			return false;
+		}
+		value = std::move(cell->m_value);
+		cell->m_seq.store(pos + m_mask + 1, std::memory_order_release);
+		m_dequeue.store(pos + 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	/// @brief Tells whether there is an entry ready to pop.  Only call from the
+	///        consumer thread.
+	bool Empty() const
+	{
+		size_t pos = m_dequeue.load(std::memory_order_relaxed);
+		size_t seq = m_cells[pos & m_mask].m_seq.load(std::memory_order_acquire);
+		return static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1) < 0;
+	}
+
+	/// @brief Approximate number of entries in the queue.  Safe from any thread.
+	size_t Depth() const
+	{
+		size_t enq = m_enqueue.load(std::memory_order_relaxed);
+		size_t deq = m_dequeue.load(std::memory_order_relaxed);
+		return enq > deq ? enq - deq : 0;
+	}
+
+private:
+	struct Cell {
+		std::atomic<size_t>	m_seq;
+		T					m_value;
+	};
+	std::unique_ptr<Cell[]>	m_cells;
+	size_t					m_mask;
+	// Keep the producer and consumer indices on separate cache lines.
+	char					m_pad0[64];
+	std::atomic<size_t>		m_enqueue;
+	char					m_pad1[64];
+	std::atomic<size_t>		m_dequeue;
+	char					m_pad2[64];
+};
+
+// A TimeWarpLatencyHistogram that many threads can add to and that can be
+// read while they do so, without any locking.
+class AtomicHistogram {
+public:
+	void Add(int64_t ns)
+	{
+		if (ns < 0) { ns = 0; }
+		m_buckets[TimeWarpLatencyHistogram::Bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+		m_count.fetch_add(1, std::memory_order_relaxed);
+		m_sum.fetch_add(ns, std::memory_order_relaxed);
+		int64_t v = m_min.load(std::memory_order_relaxed);
+		while (ns < v && !m_min.compare_exchange_weak(v, ns, std::memory_order_relaxed)) {}
+		v = m_max.load(std::memory_order_relaxed);
+		while (ns > v && !m_max.compare_exchange_weak(v, ns, std::memory_order_relaxed)) {}
+	}
+
+	/// @brief Copy the current contents.  Samples being added at the same time
+	///        may be partly included.
+	TimeWarpLatencyHistogram Snapshot() const
+	{
+		TimeWarpLatencyHistogram ret;
+		for (size_t i = 0; i < TimeWarpLatencyHistogram::Buckets; i++) {
+			ret.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+		}
+		ret.count = m_count.load(std::memory_order_relaxed);
+		ret.sumNs = static_cast<double>(m_sum.load(std::memory_order_relaxed));
+		if (ret.count) {
+			ret.minNs = m_min.load(std::memory_order_relaxed);
+			ret.maxNs = m_max.load(std::memory_order_relaxed);
+		}
+		return ret;
+	}
+
+private:
+	std::atomic<uint64_t>	m_buckets[TimeWarpLatencyHistogram::Buckets] = {};
+	std::atomic<uint64_t>	m_count{ 0 };
+	std::atomic<int64_t>	m_sum{ 0 };
+	std::atomic<int64_t>	m_min{ INT64_MAX };
+	std::atomic<int64_t>	m_max{ 0 };
+};
+
+class atl::TimeWarp::TimeWarpServer::TimeWarpServerPrivate {
+public:
+	// Mutex for all subthreads to use to avoid race conditions when
+	// accessing data structures.
+	std::mutex					m_mutex;
+
+	TimeWarpServerOptions		m_options;
+
+	TimeWarpServerCallback		m_callback = nullptr;
+	void*						m_userData = nullptr;
+	TimeWarpUpdateHandler		m_handler;		///< Used instead of m_callback if set
+	std::deque<std::string>		m_errors;		///< The most recent errors, protected by m_mutex
+
+	// Counters reported by GetStats().  They are updated without locking by
+	// whichever thread sees the event.
+	std::atomic<int64_t>		m_activeConnections{ 0 };
+	std::atomic<uint64_t>		m_accepts{ 0 };
+	std::atomic<uint64_t>		m_handshakeFailures{ 0 };
+	std::atomic<uint64_t>		m_setTimeMessages{ 0 };
+	std::atomic<uint64_t>		m_scheduleMessages{ 0 };
+	std::atomic<uint64_t>		m_scheduleEntries{ 0 };
+	std::atomic<uint64_t>		m_ackRequests{ 0 };
+	std::atomic<uint64_t>		m_unknownMessages{ 0 };
+	std::atomic<uint64_t>		m_compactConnections{ 0 };
+	std::atomic<uint64_t>		m_bytesReceived{ 0 };
+	std::atomic<uint64_t>		m_errorCount{ 0 };
+	AtomicHistogram				m_callbackDuration;
+
+	// What we send when a connection opens: the magic cookie followed, for
+	// protocol version 2, by the capabilities we offer.
+	std::string					m_hello;
+	int64_t						m_caps = 0;
+
+	SOCKET						m_listen = BAD_SOCKET;
+	std::thread					m_listenThread;
+
+	// Threads accepting on the TCP port besides the listening thread, and the
+	// socket each uses: one of its own with SO_REUSEPORT, or else m_listen.
+	std::vector<SOCKET>			m_acceptorSockets;
+	std::vector<std::thread>	m_acceptorThreads;
+
+	// Listening sockets for unix:// endpoints, which are handled just like the
+	// TCP one, and the paths to remove when we're done with them.
+	std::vector<SOCKET>			m_localListens;
+	std::vector<std::string>	m_localPaths;
+
+#ifdef TIMEWARP_USE_LOCAL_TRANSPORTS
+	// Segments for shm:// endpoints, each read by its own thread.
+	std::vector<std::unique_ptr<ShmChannel> >	m_shmChannels;
+	std::vector<std::thread>	m_shmThreads;
+#endif
+
+	// This structure keeps track of threads and the sockets that they should
+	// be listening on.  Each thread is responsible for closing its own socket
+	// before it exits.  There is a map from std::size to the infos to make it
+	// easy for a thread to look up its entry and still allow each deletion
+	// without changing the placement (as would happen in a vector).
+	struct AcceptInfo {
+		AcceptInfo(std::shared_ptr<std::thread> t, SOCKET s) : m_thread(t), m_sock(s), m_done(false) {};
+		std::shared_ptr<std::thread>	m_thread;
+		SOCKET							m_sock;
+		std::atomic<bool>				m_done;
+	};
+	std::map<size_t, std::shared_ptr<AcceptInfo> > m_acceptThreads;
+	size_t				m_nextMapEntry = 0;
+
+	// Threads that multiplex the listening socket and all connections when
+	// the server is running in event-loop mode.
+	std::vector<std::thread>	m_loopThreads;
+
+	std::atomic<bool>			m_quit;		///< Time to shut down?
+	WakeupSignal				m_quitSignal;	///< Set along with m_quit to wake threads
+	WakeupSignal				m_reapSignal;	///< Set when an accept thread has finished
+
+	// Source of identifiers for connections.
+	std::atomic<size_t>			m_nextConnectionId;
+
+	// Holds the newest offset from a source (a connection, or the whole server)
+	// when delivering only the latest value.  A single entry in the dispatch
+	// queue refers to the slot while it is pending; later offsets just replace
+	// the value and are counted as coalesced.
+	struct LatestSlot {
+		std::atomic<int64_t>	m_offset{ 0 };
+		std::atomic<bool>		m_pending{ false };
+	};
+
+	// Token bucket limiting the offsets that a connection can have delivered;
+	// see TimeWarpServerOptions::maxOffsetsPerSecond.  An offset held back by
+	// the COALESCE policy is delivered by the schedule thread once a token is
+	// due; it queues the offset with the mutex held.  The network thread only
+	// clears m_held under the mutex and queues a newer offset after releasing
+	// it, which is enough to keep a stale held offset from following it.
+	struct RateLimiter {
+		std::mutex								m_mutex;
+		double									m_tokens = 0;
+		std::chrono::steady_clock::time_point	m_refilled;
+		bool									m_held = false;		///< m_heldOffset is waiting for a token
+		int64_t									m_heldOffset = 0;
+	};
+
+	// Where a connection's acknowledgements are written.  Dispatcher threads
+	// write to the socket while the network thread may be closing it, so the
+	// socket is cleared under the mutex before it is closed.
+	struct AckSink {
+		std::mutex		m_mutex;
+		SOCKET			m_sock = BAD_SOCKET;
+	};
+
+	// A client's request for an offset to be acknowledged.
+	struct AckRequest {
+		int64_t		m_sequence = 0;
+		int64_t		m_received = 0;		///< monotonic_ns() when the offset arrived
+		std::shared_ptr<AckSink>	m_sink;
+	};
+
+	// An offset that has been received and is waiting to be delivered.  If
+	// m_slot is set, the offset to deliver is read from it instead.
+	struct OffsetUpdate {
+		int64_t		m_op = 0;			///< OP_SET_TIME, OP_SET_SCHEDULE or OP_RAMP
+		int64_t		m_offset = 0;
+		size_t		m_connection = 0;
+		int64_t		m_received = 0;		///< monotonic_ns() when queued
+		uint32_t	m_channel = 0;
+		uint64_t	m_rampStep = 0;		///< For OP_RAMP, the step's number; see m_rampSteps
+		std::shared_ptr<LatestSlot>	m_slot;
+		AckRequest	m_ack;		///< Acknowledge after the callback if m_ack.m_sink is set
+	};
+
+	// Network threads hand received offsets to a dispatcher thread through its
+	// queue, so that user code in the callback never runs while any server
+	// lock is held or on a thread that is reading sockets.  The dispatcher
+	// sleeps on its condition variable only when its queue is empty, and
+	// producers take its mutex only when it has said it is sleeping.
+	struct Dispatcher {
+		explicit Dispatcher(size_t queueSize) : m_queue(queueSize), m_sleeping(false) {}
+		MPSCQueue<OffsetUpdate>		m_queue;
+		std::atomic<size_t>			m_highWater{ 0 };
+		std::atomic<uint64_t>		m_coalesced{ 0 };
+		std::mutex					m_wakeMutex;
+		std::condition_variable		m_wake;
+		std::atomic<bool>			m_sleeping;
+		std::condition_variable		m_space;		///< Signalled when producers are waiting for room
+		std::atomic<size_t>			m_waitingForSpace{ 0 };
+		bool						m_stop = false;		///< Protected by m_wakeMutex
+		std::thread					m_thread;
+	};
+	std::vector<std::unique_ptr<Dispatcher> >	m_dispatchers;
+
+	// Slot shared by all connections when delivering the latest global offset.
+	std::shared_ptr<LatestSlot>		m_globalSlot = std::make_shared<LatestSlot>();
+
+	// An offset that a client has asked to be delivered at a particular time.
+	struct ScheduledOffset {
+		std::chrono::steady_clock::time_point	m_due;
+		size_t							m_connection = 0;
+		int64_t							m_offset = 0;
+		std::shared_ptr<LatestSlot>		m_slot;
+		std::shared_ptr<RateLimiter>	m_limiter;	///< Set to deliver the offset it holds instead
+	};
+
+	// Scheduled offsets wait in a timing wheel until the schedule thread hands
+	// them to the dispatchers at their requested times.  The schedule thread
+	// sleeps until the earliest one is due, or indefinitely if there are none.
+	std::mutex						m_scheduleMutex;
+	std::condition_variable			m_scheduleWake;
+	TimerWheel<ScheduledOffset>		m_schedule{ std::chrono::milliseconds(1), 1024 };
+	bool							m_scheduleStop = false;	///< Protected by m_scheduleMutex
+	std::thread						m_scheduleThread;
+
+	// A ramp from one offset to another that the schedule thread is working
+	// through, delivering an offset at each tick.  Protected by m_scheduleMutex.
+	struct Ramp {
+		std::chrono::steady_clock::time_point	m_start;
+		std::chrono::steady_clock::time_point	m_end;
+		std::chrono::steady_clock::time_point	m_nextTick;
+		int64_t							m_from = 0;
+		int64_t							m_to = 0;
+		int64_t							m_last = 0;		///< Offset delivered at the last tick
+		TimeWarpRampCurve				m_curve = TimeWarpRampCurve::LINEAR;
+		size_t							m_connection = 0;
+
+		/// @brief Offset the ramp has reached at a given time.
+		int64_t ValueAt(std::chrono::steady_clock::time_point t) const
+		{
+			if (t >= m_end) { return m_to; }
+			if (t <= m_start) { return m_from; }
+			double x = std::chrono::duration<double>(t - m_start).count() /
+				std::chrono::duration<double>(m_end - m_start).count();
+			switch (m_curve) {
+			case TimeWarpRampCurve::EASE_IN:		x = x * x; break;
+			case TimeWarpRampCurve::EASE_OUT:		x = 1 - (1 - x) * (1 - x); break;
+			case TimeWarpRampCurve::EASE_IN_OUT:	x = x * x * (3 - 2 * x); break;
+			default:								break;
+			}
+			return m_from + static_cast<int64_t>(std::llround(static_cast<double>(m_to - m_from) * x));
+		}
+	};
+	Ramp							m_ramp;
+	bool							m_rampActive = false;	///< Protected by m_scheduleMutex
+	std::atomic<bool>				m_ramping{ false };		///< Copy of m_rampActive for quick checks
+	std::atomic<uint64_t>			m_ramps{ 0 };
+
+	// Ramp steps are numbered as they are queued, and don't share the latest-
+	// value slots, so a dispatcher can tell whether a step it pops is stale.
+	// Steps numbered below m_rampFirstStep belong to a ramp that has since
+	// been stopped or replaced and are dropped.  The dispatcher holds
+	// m_rampDeliveryMutex from that check until the callback returns, and
+	// stopping a ramp takes it too, so an offset that stops a ramp is never
+	// queued while one of the ramp's steps is being delivered, whichever
+	// dispatcher each is on.
+	std::atomic<uint64_t>			m_rampSteps{ 0 };		///< Number of the newest step queued
+	std::mutex						m_rampDeliveryMutex;
+	std::atomic<uint64_t>			m_rampFirstStep{ 1 };	///< Changed with m_rampDeliveryMutex held
+	std::atomic<uint64_t>			m_rampUpdates{ 0 };
+
+	// What the server knows about each connection, whichever mode it is handled in.
+	struct ConnectionState {
+		size_t							m_id = 0;
+		RecordAssembler					m_records;
+		std::shared_ptr<LatestSlot>		m_slot;		///< For LATEST_PER_CONNECTION delivery
+		std::shared_ptr<AckSink>		m_ack;		///< Null if acknowledgements can't be sent
+		int64_t							m_ackSequence = 0;	///< From OP_REQUEST_ACK, 0 if none
+		bool							m_subscribed = false;
+		int64_t							m_channel = 0;		///< From OP_CHANNEL
+		std::shared_ptr<RateLimiter>	m_limiter;	///< Made by the first offset when limiting
+		bool							m_rampPending = false;	///< Next record is (microseconds, curve)
+		int64_t							m_rampTarget = 0;
+
+		// Entries of an OP_SET_SCHEDULE command that are still to be read,
+		// and the ones that have been read so far.
+		int64_t							m_scheduleRemaining = 0;
+		std::vector<ScheduledOffset>	m_schedule;
+	};
+
+	// Socket and thread receiving offsets from multicast publishers, along
+	// with what we know about each publisher (keyed by its address).  Each
+	// publisher is treated like a connection.
+	struct MulticastPublisher {
+		int64_t							m_lastSeq = 0;
+		ConnectionState					m_conn;
+	};
+	SOCKET							m_multicast = BAD_SOCKET;
+	std::thread						m_multicastThread;
+	std::atomic<uint64_t>			m_multicastGaps{ 0 };
+	std::atomic<uint64_t>			m_multicastRecovered{ 0 };
+
+	// The current offset, which is the one most recently delivered to the
+	// callback, and the number delivered so far, which orders them for
+	// subscribers.  Both are protected by m_currentMutex.
+	std::mutex						m_currentMutex;
+	int64_t							m_currentOffset = 0;
+	uint64_t						m_currentSequence = 0;
+
+	// The latest offset on each channel other than 0, and the callback for
+	// it if there is one, all protected by m_channelMutex.
+	struct Channel {
+		int64_t							m_offset = 0;
+		uint64_t						m_sequence = 0;
+		TimeWarpChannelCallback			m_callback = nullptr;
+		void*							m_userData = nullptr;
+	};
+	std::mutex									m_channelMutex;
+	std::unordered_map<uint32_t, Channel>		m_channels;
+	std::atomic<uint64_t>						m_channelMessages{ 0 };
+	std::atomic<uint64_t>						m_channelsUsed{ 0 };
+
+	// Connections that have asked to hear about every new current offset.
+	std::mutex									m_subscribersMutex;
+	std::vector<std::shared_ptr<AckSink> >		m_subscribers;
+	std::atomic<size_t>							m_subscriberCount{ 0 };
+	std::atomic<uint64_t>						m_queries{ 0 };
+	std::atomic<uint64_t>						m_pings{ 0 };
+	std::atomic<uint64_t>						m_rejectedConnections{ 0 };
+	std::atomic<uint64_t>						m_rateLimitDropped{ 0 };
+	std::atomic<uint64_t>						m_rateLimitCoalesced{ 0 };
+	std::atomic<uint64_t>						m_rateLimitDisconnects{ 0 };
+
+#ifdef TIMEWARP_USE_JOURNAL
+	// Offsets waiting for the journal thread to write them to m_journal, in a
+	// fixed-size ring so that the threads queueing them never wait on the
+	// disk.  Offsets that arrive when it is full are counted and not written.
+	std::unique_ptr<Journal>					m_journal;
+	std::mutex									m_journalMutex;
+	std::condition_variable						m_journalWake;
+	std::vector<JournalRecord>					m_journalRing;
+	size_t										m_journalHead = 0;
+	size_t										m_journalCount = 0;
+	bool										m_journalStop = false;
+	std::thread									m_journalThread;
+#endif
+	std::atomic<uint64_t>						m_journalRecords{ 0 };
+	std::atomic<uint64_t>						m_journalDropped{ 0 };
+	uint64_t									m_journalRecovered = 0;
+
+	/// @brief Open the journal and take the latest offsets from it.
+	/// @return False (with an error added) on failure.
+	bool OpenJournal(const std::string& path);
+
+	/// @brief Hand an offset to the journal thread, if there is a journal.
+	void JournalOffset(size_t connection, int64_t op, int64_t value, uint32_t channel)
+	{
+#ifdef TIMEWARP_USE_JOURNAL
+		if (!m_journal) {
+			return;
+		}
+		JournalRecord r;
+		r.m_wallTime = wall_us();
+		r.m_connection = connection;
+		r.m_kind = static_cast<uint32_t>((op == OP_SET_SCHEDULE) ? TimeWarpUpdateKind::SCHEDULED :
+			(op == OP_RAMP) ? TimeWarpUpdateKind::RAMP : TimeWarpUpdateKind::SET_TIME);
+		r.m_channel = channel;
+		r.m_offset = value;
+		bool wake;
+		{
+			std::lock_guard<std::mutex> lock(m_journalMutex);
+			if (m_journalCount == m_journalRing.size()) {
+				m_journalDropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			m_journalRing[(m_journalHead + m_journalCount) % m_journalRing.size()] = r;
+			wake = (m_journalCount++ == 0);
+		}
+		if (wake) {
+			m_journalWake.notify_one();
+		}
+#endif
+	}
+
+	TimeWarpServerPrivate() : m_quit(false), m_nextConnectionId(0) {}
+
+	/// @brief Record a newly delivered offset as the current one.
+	/// @return Its sequence number, to pass to Publish().
+	uint64_t SetCurrent(int64_t offset)
+	{
+		std::lock_guard<std::mutex> lock(m_currentMutex);
+		m_currentOffset = offset;
+		return ++m_currentSequence;
+	}
+
+	/// @brief Send an OP_OFFSET record to a client.  A client that can't take
+	///        it within the timeout is disconnected, since a partial record
+	///        would garble everything sent after it.
+	/// @return False if the client could not be sent to.
+	bool SendOffset(AckSink& sink, int64_t request, uint64_t sequence, int64_t offset, int timeoutMs)
+	{
+		return SendReply(sink, OP_OFFSET, request, static_cast<int64_t>(sequence), offset, timeoutMs);
+	}
+
+	/// @brief Send a four-value record to a client, disconnecting it if it
+	///        can't take it within the timeout.
+	/// @param [in] stampWallClock Replace the last value with wall_us() once
+	///             the socket is ours to write to.
+	/// @return False if the client could not be sent to.
+	bool SendReply(AckSink& sink, int64_t op, int64_t a, int64_t b, int64_t c, int timeoutMs,
+		bool stampWallClock = false)
+	{
+		std::lock_guard<std::mutex> lock(sink.m_mutex);
+		if (sink.m_sock == BAD_SOCKET) {
+			return false;
+		}
+		if (stampWallClock) {
+			c = wall_us();
+		}
+		int64_t reply[4] = { CoreSocket::hton(op), CoreSocket::hton(a),
+			CoreSocket::hton(b), CoreSocket::hton(c) };
+		if (write_all(sink.m_sock, reinterpret_cast<const char*>(reply), sizeof(reply), timeoutMs)) {
+			return true;
+		}
+		shutdown(sink.m_sock, SHUT_RDWR);
+		sink.m_sock = BAD_SOCKET;
+		return false;
+	}
+
+	/// @brief Tell subscribers about a new current offset, dropping any that
+	///        have gone away or can't keep up.  This runs on a dispatcher
+	///        thread, so it never waits for a subscriber: one whose socket
+	///        can't take the record right away is dropped.
+	void Publish(uint64_t sequence, int64_t offset)
+	{
+		if (m_subscriberCount.load(std::memory_order_relaxed) == 0) {
+			return;
+		}
+		std::lock_guard<std::mutex> lock(m_subscribersMutex);
+		for (size_t i = 0; i < m_subscribers.size(); ) {
+			if (SendOffset(*m_subscribers[i], 0, sequence, offset, 0)) {
+				i++;
+			} else {
+				m_subscribers[i] = m_subscribers.back();
+				m_subscribers.pop_back();
+			}
+		}
+		m_subscriberCount = m_subscribers.size();
+	}
+
+	/// @brief Start or stop telling a connection about new offsets.  Starting
+	///        sends it the current offset right away.
+	void SetSubscribed(ConnectionState& c, bool subscribe)
+	{
+		std::lock_guard<std::mutex> lock(m_subscribersMutex);
+		if (subscribe != c.m_subscribed) {
+			if (subscribe) {
+				m_subscribers.push_back(c.m_ack);
+			} else {
+				m_subscribers.erase(std::remove(m_subscribers.begin(), m_subscribers.end(), c.m_ack),
+					m_subscribers.end());
+			}
+			c.m_subscribed = subscribe;
+			m_subscriberCount = m_subscribers.size();
+		}
+		if (subscribe) {
+			int64_t offset;
+			uint64_t sequence;
+			{
+				std::lock_guard<std::mutex> current(m_currentMutex);
+				offset = m_currentOffset;
+				sequence = m_currentSequence;
+			}
+			if (sequence > 0) {
+				SendOffset(*c.m_ack, 0, sequence, offset, 100);
+			}
+		}
+	}
+
+	/// @brief Open a UDP socket on the specified port and join the multicast group.
+	/// @return True on success, false (with an error added) on failure.
+	bool OpenMulticast(uint16_t port, const std::string& cardIP);
+
+	/// @brief Open the local endpoints listed in the options.
+	/// @return True on success, false (with an error added) on failure.
+	bool OpenEndpoints();
+
+	// A connection that has been accepted but has not finished exchanging
+	// magic cookies.  Its socket is non-blocking until then, so that one thread
+	// can move any number of handshakes along at once and a slow or silent
+	// peer costs only a descriptor until it times out.
+	struct Handshake {
+		enum State { SENDING_COOKIE, READING_COOKIE, DONE };
+
+		State						m_state = SENDING_COOKIE;
+		size_t						m_done = 0;		///< Bytes of cookie sent or read
+		std::vector<char>			m_cookie;		///< Cookie read from the client
+		std::chrono::steady_clock::time_point	m_deadline;	///< When the handshake times out
+	};
+
+	/// @brief Start a handshake on a newly accepted connection.
+	void StartHandshake(Handshake& h)
+	{
+		h.m_deadline = std::chrono::steady_clock::now() +
+			std::chrono::microseconds(static_cast<int64_t>(m_options.handshakeTimeout * 1e6));
+	}
+
+	/// @brief Move a handshake along as far as its non-blocking socket allows.
+	/// @return False if the handshake failed and the connection should be closed.
+	bool StepHandshake(SOCKET sock, Handshake& h);
+
+	/// @brief Accept connections on non-blocking listening sockets and drive
+	///        their handshakes, giving each connection that completes one a
+	///        thread of its own, until it is time to quit.  Any number of
+	///        threads may do this on the same sockets.
+	/// @param [in] listens Listening sockets to accept on.
+	/// @param [in] reap Also join the threads of connections that have closed.
+	static void AcceptLoop(std::shared_ptr<TimeWarpServerPrivate> p,
+		const std::vector<SOCKET>& listens, bool reap);
+
+	/// @brief Give a connection that has completed its handshake a thread of
+	///        its own.
+	static void StartConnection(std::shared_ptr<TimeWarpServerPrivate> p, SOCKET sock);
+
+	/// @brief Get a new connection's state ready for use.
+	/// @param [in] sock Socket to send acknowledgements on, if it has one.
+	void InitConnection(ConnectionState& c, size_t id, SOCKET sock = BAD_SOCKET)
+	{
+		c.m_id = id;
+		if (m_options.delivery == TimeWarpDelivery::LATEST_PER_CONNECTION) {
+			c.m_slot = std::make_shared<LatestSlot>();
+		}
+		if (sock != BAD_SOCKET) {
+			c.m_ack = std::make_shared<AckSink>();
+			c.m_ack->m_sock = sock;
+		}
+	}
+
+	/// @brief Stop sending acknowledgements for a connection whose socket is
+	///        about to be closed.
+	void ReleaseConnection(ConnectionState& c)
+	{
+		if (c.m_ack) {
+			std::lock_guard<std::mutex> lock(c.m_ack->m_mutex);
+			c.m_ack->m_sock = BAD_SOCKET;
+		}
+		if (c.m_subscribed) {
+			SetSubscribed(c, false);
+		}
+	}
+
+	/// @brief Handle bytes received on a connection after the handshake.
+	/// @return False if the connection should be closed.
+	bool HandleBytes(ConnectionState& c, const char* data, size_t len)
+	{
+		m_bytesReceived.fetch_add(len, std::memory_order_relaxed);
+		bool ret = c.m_records.Consume(data, len, [this, &c](int64_t op, int64_t value) {
+			return HandleCommand(c, op, value);
+		});
+		if (uint64_t skipped = c.m_records.TakeSkipped()) {
+			m_unknownMessages.fetch_add(skipped, std::memory_order_relaxed);
+		}
+		if (!ret && c.m_records.Error()) {
+			AddError(c.m_records.Error());
+		}
+		return ret;
+	}
+
+	/// @brief Handle one record received on a connection.
+	/// @return False if the connection should be closed.
+	bool HandleCommand(ConnectionState& c, int64_t op, int64_t value);
+
+	/// @brief Add a batch of offsets to be delivered at their requested times.
+	void Schedule(std::vector<ScheduledOffset>& entries)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_scheduleMutex);
+			for (auto& e : entries) {
+				m_schedule.Add(std::move(e));
+			}
+		}
+		entries.clear();
+		m_scheduleWake.notify_one();
+	}
+
+	/// @brief Count a newly accepted connection, or reset it right away if
+	///        maxConnections are already open.
+	/// @return True if the connection may go ahead.
+	bool Admit(SOCKET sock)
+	{
+		int64_t active = ++m_activeConnections;
+		if (m_options.maxConnections == 0 || active <= static_cast<int64_t>(m_options.maxConnections)) {
+			m_accepts++;
+			return true;
+		}
+		m_activeConnections--;
+		m_rejectedConnections.fetch_add(1, std::memory_order_relaxed);
+		struct linger reset;
+		reset.l_onoff = 1;
+		reset.l_linger = 0;
+		setsockopt(sock, SOL_SOCKET, SO_LINGER, reinterpret_cast<const char*>(&reset), sizeof(reset));
+		CoreSocket::close_socket(sock);
+		return false;
+	}
+
+	/// @brief Add the tokens a rate limiter has earned since it was last refilled.
+	void Refill(RateLimiter& r, std::chrono::steady_clock::time_point now)
+	{
+		double earned = std::chrono::duration<double>(now - r.m_refilled).count() *
+			m_options.maxOffsetsPerSecond;
+		r.m_tokens = std::min(r.m_tokens + earned, std::max(m_options.rateLimitBurst, 1.0));
+		r.m_refilled = now;
+	}
+
+	/// @brief Take a token for an offset from a connection, applying the
+	///        rate-limit policy if there isn't one.
+	/// @return 1 to deliver the offset, 0 if it was dropped or held back, and
+	///         -1 to close the connection.
+	int RateLimit(ConnectionState& c, int64_t value)
+	{
+		auto now = std::chrono::steady_clock::now();
+		if (!c.m_limiter) {
+			c.m_limiter = std::make_shared<RateLimiter>();
+			c.m_limiter->m_tokens = std::max(m_options.rateLimitBurst, 1.0);
+			c.m_limiter->m_refilled = now;
+		}
+		RateLimiter& r = *c.m_limiter;
+		std::lock_guard<std::mutex> lock(r.m_mutex);
+		Refill(r, now);
+		if (r.m_tokens >= 1) {
+			r.m_tokens -= 1;
+			if (r.m_held && c.m_channel == 0) {
+				r.m_held = false;
+				m_rateLimitCoalesced.fetch_add(1, std::memory_order_relaxed);
+			}
+			return 1;
+		}
+		switch (m_options.rateLimitPolicy) {
+		case TimeWarpRateLimitPolicy::DISCONNECT:
+			m_rateLimitDisconnects.fetch_add(1, std::memory_order_relaxed);
+			AddError("Closing connection that went over its rate limit");
+			return -1;
+		case TimeWarpRateLimitPolicy::COALESCE:
+			if (c.m_channel == 0) {
+				if (r.m_held) {
+					m_rateLimitCoalesced.fetch_add(1, std::memory_order_relaxed);
+				} else {
+					// Deliver it when the next token is due.
+					std::vector<ScheduledOffset> flush(1);
+					flush[0].m_due = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+						std::chrono::duration<double>((1 - r.m_tokens) / m_options.maxOffsetsPerSecond));
+					flush[0].m_connection = c.m_id;
+					flush[0].m_slot = c.m_slot;
+					flush[0].m_limiter = c.m_limiter;
+					Schedule(flush);
+					r.m_held = true;
+				}
+				r.m_heldOffset = value;
+				return 0;
+			}
+			break;
+		default:
+			break;
+		}
+		m_rateLimitDropped.fetch_add(1, std::memory_order_relaxed);
+		return 0;
+	}
+
+	/// @brief Deliver the offset that a rate limiter is holding back, if it
+	///        still is.  Called by the schedule thread when a token is due.
+	void ReleaseHeld(const ScheduledOffset& e)
+	{
+		RateLimiter& r = *e.m_limiter;
+		std::lock_guard<std::mutex> lock(r.m_mutex);
+		if (!r.m_held) {
+			return;
+		}
+		Refill(r, std::chrono::steady_clock::now());
+		r.m_tokens -= 1;
+		r.m_held = false;
+		QueueOffset(e.m_connection, OP_SET_TIME, r.m_heldOffset, e.m_slot);
+	}
+
+	/// @brief Start ramping to a new offset, replacing any ramp in progress.
+	void StartRamp(ConnectionState& c, int64_t target, int64_t microseconds, TimeWarpRampCurve curve)
+	{
+		auto now = std::chrono::steady_clock::now();
+		{
+			std::lock_guard<std::mutex> lock(m_scheduleMutex);
+			int64_t from = target;
+			if (m_rampActive) {
+				from = m_ramp.ValueAt(now);
+			} else {
+				std::lock_guard<std::mutex> current(m_currentMutex);
+				if (m_currentSequence > 0) {
+					from = m_currentOffset;
+				}
+			}
+			m_ramp.m_start = now;
+			m_ramp.m_end = now + std::chrono::microseconds(microseconds);
+			m_ramp.m_nextTick = now;
+			m_ramp.m_from = from;
+			m_ramp.m_to = target;
+			m_ramp.m_last = from;
+			m_ramp.m_curve = curve;
+			m_ramp.m_connection = c.m_id;
+			m_rampActive = true;
+			m_ramping = true;
+			DropRampSteps();
+		}
+		m_scheduleWake.notify_one();
+	}
+
+	/// @brief Stop any ramp in progress because another offset is being delivered.
+	///        Steps of a ramp that has just finished may still be waiting for
+	///        a dispatcher, so those are dropped too.
+	void CancelRamp()
+	{
+		if (m_ramping.load() || m_rampSteps.load() >= m_rampFirstStep.load()) {
+			std::lock_guard<std::mutex> lock(m_scheduleMutex);
+			m_rampActive = false;
+			m_ramping = false;
+			DropRampSteps();
+		}
+	}
+
+	/// @brief Make the dispatchers drop every ramp step queued so far, waiting
+	///        for any step being delivered to finish.  Called with
+	///        m_scheduleMutex held.
+	void DropRampSteps()
+	{
+		std::lock_guard<std::mutex> lock(m_rampDeliveryMutex);
+		m_rampFirstStep = m_rampSteps.load() + 1;
+	}
+
+	/// @brief Hand an offset to the dispatcher for its connection.  Called from
+	///        the network threads and the schedule thread.
+	/// @param [in] op What caused the offset: OP_SET_TIME, or OP_SET_SCHEDULE
+	///             or OP_RAMP from the schedule thread.
+	/// @param [in] slot The connection's latest-value slot, if it has one.
+	/// @param [in] ack Acknowledgement to send once the callback returns, if any.
+	/// @param [in] channel Channel the offset is for.
+	/// @param [in] rampStep For OP_RAMP, the step's number from m_rampSteps.
+	void QueueOffset(size_t connection, int64_t op, int64_t value,
+		const std::shared_ptr<LatestSlot>& slot, const AckRequest* ack = nullptr,
+		uint32_t channel = 0, uint64_t rampStep = 0)
+	{
+		Dispatcher& d = *m_dispatchers[connection % m_dispatchers.size()];
+		OffsetUpdate u;
+		u.m_op = op;
+		u.m_offset = value;
+		u.m_connection = connection;
+		u.m_received = ack ? ack->m_received : monotonic_ns();
+		u.m_channel = channel;
+		u.m_rampStep = rampStep;
+		JournalOffset(connection, op, value, channel);
+
+		// When delivering only the latest offset, replace the value in the slot
+		// and only queue an entry if one is not already pending for it.  An
+		// offset that is to be acknowledged is always delivered itself, as are
+		// those for channels other than 0, since the slots are only for one.
+		// Ramp steps are queued themselves too, and the dispatcher skips all
+		// but the newest.
+		if (ack) {
+			u.m_ack = *ack;
+		} else if (m_options.delivery != TimeWarpDelivery::EVERY_OFFSET && channel == 0 &&
+				op != OP_RAMP) {
+			const std::shared_ptr<LatestSlot>& s =
+				(m_options.delivery == TimeWarpDelivery::LATEST_GLOBAL) ? m_globalSlot : slot;
+			s->m_offset.store(value);
+			if (s->m_pending.exchange(true)) {
+				d.m_coalesced.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			u.m_slot = s;
+		}
+
+		// If the dispatcher has fallen behind, sleep until it makes room rather
+		// than dropping offsets.  This stops us reading from the network so
+		// that back-pressure builds up in the socket.  The dispatcher never
+		// takes a rate limiter's mutex, so ReleaseHeld() may wait here with it
+		// held.  As with sleeping, the fence pairs with one in the dispatcher
+		// so that it either sees that we are waiting or we see the room it made.
+		if (!d.m_queue.TryPush(u)) {
+			std::unique_lock<std::mutex> lock(d.m_wakeMutex);
+			d.m_waitingForSpace.fetch_add(1);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			d.m_space.wait(lock, [this, &d, &u]() { return m_quit || d.m_queue.TryPush(u); });
+			d.m_waitingForSpace.fetch_sub(1);
+			if (m_quit) { return; }
+		}
+		size_t depth = d.m_queue.Depth();
+		size_t high = d.m_highWater.load(std::memory_order_relaxed);
+		while (depth > high && !d.m_highWater.compare_exchange_weak(high, depth,
+			std::memory_order_relaxed)) {
+		}
+
+		// The fence orders our push before the check of the sleeping flag; the
+		// dispatcher has a matching fence between setting the flag and its
+		// final check of the queue, so one of us always sees the other.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (d.m_sleeping.load(std::memory_order_relaxed)) {
+			std::lock_guard<std::mutex> lock(d.m_wakeMutex);
+			d.m_wake.notify_one();
+		}
+	}
+
+	/// @brief Tell the dispatcher threads to deliver what they have and quit,
+	///        and wait for them to do so.
+	void StopDispatchers()
+	{
+		for (auto& d : m_dispatchers) {
+			{
+				std::lock_guard<std::mutex> lock(d->m_wakeMutex);
+				d->m_stop = true;
+			}
+			d->m_wake.notify_one();
+		}
+		for (auto& d : m_dispatchers) {
+			if (d->m_thread.joinable()) {
+				d->m_thread.join();
+			}
+		}
+	}
+
+	/// @brief Record an error message from one of the server threads, keeping
+	///        only the most recent ones.
+	void AddError(const std::string& msg)
+	{
+		m_errorCount.fetch_add(1, std::memory_order_relaxed);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_errors.size() >= SERVER_ERROR_HISTORY) {
+			m_errors.pop_front();
+		}
+		m_errors.push_back(msg);
+	}
+
+#ifdef TIMEWARP_USE_EPOLL
+	// State of one connection handled by an event-loop thread.
+	struct LoopConnection {
+		SOCKET						m_sock = BAD_SOCKET;
+		Handshake					m_handshake;
+		ConnectionState				m_conn;
+	};
+
+	/// @brief Make progress on a connection that epoll reported as ready.
+	/// @return False if the connection should be closed.
+	bool ServiceConnection(LoopConnection& c);
+#endif
+};
+
+bool TimeWarpServer::TimeWarpServerPrivate::StepHandshake(SOCKET sock, Handshake& h)
+{
+	size_t len = MagicCookie.size();
+#ifdef MSG_NOSIGNAL
+	const int flags = MSG_NOSIGNAL;
+#else
+	const int flags = 0;
+#endif
+
+	// Send as much of the magic cookie and capabilities as the socket will take.
+	if (h.m_state == Handshake::SENDING_COOKIE) {
+		while (h.m_done < m_hello.size()) {
+			int ret = send(sock, &m_hello[h.m_done], static_cast<int>(m_hello.size() - h.m_done), flags);
+			if (ret < 0) {
+				int retry = socket_retry();
+				if (retry > 0) { continue; }
+				if (retry == 0) { return true; }
+				AddError("Could not write magic cookie");
+				return false;
+			}
+			h.m_done += ret;
+		}
+		h.m_state = Handshake::READING_COOKIE;
+		h.m_done = 0;
+		h.m_cookie.resize(len);
+	}
+
+	// Read the client's magic cookie, and no more, so that any commands that
+	// follow it are handled as records once the connection is running.
+	if (h.m_state == Handshake::READING_COOKIE) {
+		while (h.m_done < len) {
+			int ret = recv(sock, &h.m_cookie[h.m_done], static_cast<int>(len - h.m_done), 0);
+			if (ret < 0) {
+				int retry = socket_retry();
+				if (retry > 0) { continue; }
+				if (retry == 0) { return true; }
+			}
+			if (ret <= 0) {
+				AddError("Could not read magic cookie");
+				return false;
+			}
+			h.m_done += ret;
+		}
+		if (0 != memcmp(h.m_cookie.data(), MagicCookie.c_str(), len)) {
+			AddError("Bad magic cookie from client");
+			return false;
+		}
+		h.m_state = Handshake::DONE;
+		std::vector<char>().swap(h.m_cookie);
+	}
+	return true;
+}
+
+#ifdef TIMEWARP_USE_EPOLL
+bool TimeWarpServer::TimeWarpServerPrivate::ServiceConnection(LoopConnection& c)
+{
+	if (c.m_handshake.m_state != Handshake::DONE) {
+		if (!StepHandshake(c.m_sock, c.m_handshake)) {
+			return false;
+		}
+		if (c.m_handshake.m_state != Handshake::DONE) {
+			return true;
+		}
+	}
+
+	// Read whatever commands are available and handle each complete one.
+	// If the read fills the buffer, there may be more waiting; epoll is level-
+	// triggered so we will be called again rather than starving others.
+	char buffer[4096];
+	ssize_t got;
+	do {
+		got = recv(c.m_sock, buffer, sizeof(buffer), 0);
+	} while (got < 0 && errno == EINTR);
+	if (got < 0) {
+		// Errors are not global errors, just a closed connection.
+		return (errno == EAGAIN || errno == EWOULDBLOCK);
+	}
+	if (got == 0) {
+		return false;
+	}
+	return HandleBytes(c.m_conn, buffer, static_cast<size_t>(got));
+}
+#endif
+
+bool TimeWarpServer::TimeWarpServerPrivate::OpenMulticast(uint16_t port, const std::string& cardIP)
+{
+	m_multicast = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (m_multicast == BAD_SOCKET) {
+		AddError("Could not open multicast socket");
+		return false;
+	}
+
+	// Let other subscribers on this host share the port.
+	int one = 1;
+	setsockopt(m_multicast, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&one), sizeof(one));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	struct ip_mreq mreq;
+	memset(&mreq, 0, sizeof(mreq));
+	if (inet_pton(AF_INET, m_options.multicastGroup.c_str(), &mreq.imr_multiaddr) != 1) {
+		AddError("Bad multicast group address: " + m_options.multicastGroup);
+	} else if (!cardIP.empty() && inet_pton(AF_INET, cardIP.c_str(), &mreq.imr_interface) != 1) {
+		AddError("Bad card address for multicast: " + cardIP);
+	} else if (bind(m_multicast, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+		AddError("Could not bind multicast socket to port " + std::to_string(port));
+	} else if (setsockopt(m_multicast, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+			reinterpret_cast<const char*>(&mreq), sizeof(mreq)) != 0) {
+		AddError("Could not join multicast group " + m_options.multicastGroup);
+	} else {
+		return true;
+	}
+	CoreSocket::close_socket(m_multicast);
+	m_multicast = BAD_SOCKET;
+	return false;
+}
+
+bool TimeWarpServer::TimeWarpServerPrivate::OpenEndpoints()
+{
+	for (const std::string& uri : m_options.endpoints) {
+		Endpoint e;
+		if (!parse_endpoint(uri, e) || e.m_transport == Endpoint::TCP) {
+			AddError("Bad endpoint URI: " + uri);
+			return false;
+		}
+#ifdef TIMEWARP_USE_LOCAL_TRANSPORTS
+		std::string error;
+		if (e.m_transport == Endpoint::UNIX) {
+			if (m_localListens.size() >= 4) {
+				AddError("Too many unix:// endpoints");
+				return false;
+			}
+			SOCKET s = open_unix_socket(e.m_path, true, error);
+			if (s == BAD_SOCKET) {
+				AddError(error);
+				return false;
+			}
+			m_localListens.push_back(s);
+			m_localPaths.push_back(e.m_path);
+		} else {
+			std::unique_ptr<ShmChannel> shm(new ShmChannel());
+			if (!shm->Create(e.m_path, error)) {
+				AddError(error);
+				return false;
+			}
+			m_shmChannels.push_back(std::move(shm));
+		}
+#else
+		AddError("Local endpoints are not supported on this platform: " + uri);
+		return false;
+#endif
+	}
+	return true;
+}
+
+bool TimeWarpServer::TimeWarpServerPrivate::HandleCommand(ConnectionState& c, int64_t op, int64_t value)
+{
+	// The record after an OP_RAMP holds its duration and curve.
+	if (c.m_rampPending) {
+		c.m_rampPending = false;
+		if (op < 0 || value < static_cast<int64_t>(TimeWarpRampCurve::LINEAR) ||
+				value > static_cast<int64_t>(TimeWarpRampCurve::EASE_IN_OUT)) {
+			AddError("Bad ramp from client");
+			return false;
+		}
+		if (op == 0) {
+			CancelRamp();
+			QueueOffset(c.m_id, OP_SET_TIME, c.m_rampTarget, c.m_slot);
+		} else {
+			StartRamp(c, c.m_rampTarget, op, static_cast<TimeWarpRampCurve>(value));
+		}
+		return true;
+	}
+
+	// If we're in the middle of a schedule, this record is one of its entries;
+	// once we have all of them, hand them to the schedule thread in one go.
+	if (c.m_scheduleRemaining > 0) {
+		// Convert the requested wall-clock time to our steady clock, so that
+		// the entry is not affected by later adjustments to the wall clock.
+		// The time comes straight off the wire, so compare before subtracting.
+		int64_t wallNow = wall_us();
+		int64_t delay;
+		if (op < wallNow - MAX_SCHEDULE_DELAY_US) {
+			delay = -MAX_SCHEDULE_DELAY_US;
+		} else if (op > wallNow + MAX_SCHEDULE_DELAY_US) {
+			delay = MAX_SCHEDULE_DELAY_US;
+		} else {
+			delay = op - wallNow;
+		}
+		ScheduledOffset e;
+		e.m_due = std::chrono::steady_clock::now() + std::chrono::microseconds(delay);
+		e.m_connection = c.m_id;
+		e.m_offset = value;
+		e.m_slot = c.m_slot;
+		c.m_schedule.push_back(std::move(e));
+		m_scheduleEntries.fetch_add(1, std::memory_order_relaxed);
+		if (--c.m_scheduleRemaining == 0) {
+			Schedule(c.m_schedule);
+		}
+		return true;
+	}
+
+	switch (op) {
+	case OP_SET_TIME:
+		m_setTimeMessages.fetch_add(1, std::memory_order_relaxed);
+		if (m_options.maxOffsetsPerSecond > 0) {
+			int limit = RateLimit(c, value);
+			if (limit <= 0) {
+				c.m_ackSequence = 0;
+				return limit == 0;
+			}
+		}
+		if (c.m_channel != 0) {
+			m_channelMessages.fetch_add(1, std::memory_order_relaxed);
+		} else {
+			CancelRamp();
+		}
+		if (c.m_ackSequence != 0 && c.m_ack) {
+			AckRequest ack;
+			ack.m_sequence = c.m_ackSequence;
+			ack.m_received = monotonic_ns();
+			ack.m_sink = c.m_ack;
+			c.m_ackSequence = 0;
+			QueueOffset(c.m_id, op, value, c.m_slot, &ack, static_cast<uint32_t>(c.m_channel));
+		} else {
+			QueueOffset(c.m_id, op, value, c.m_slot, nullptr, static_cast<uint32_t>(c.m_channel));
+		}
+		return true;
+
+	case OP_CHANNEL:
+		if (value < 0 || value >= static_cast<int64_t>(MaxChannels)) {
+			AddError("Bad channel from client: " + std::to_string(value));
+			return false;
+		}
+		c.m_channel = value;
+		return true;
+
+	case OP_REQUEST_ACK:
+		m_ackRequests.fetch_add(1, std::memory_order_relaxed);
+		c.m_ackSequence = value;
+		return true;
+
+	case OP_RAMP:
+		m_ramps.fetch_add(1, std::memory_order_relaxed);
+		c.m_rampPending = true;
+		c.m_rampTarget = value;
+		return true;
+
+	case OP_GET: {
+		m_queries.fetch_add(1, std::memory_order_relaxed);
+		if (!c.m_ack) {
+			return true;
+		}
+		int64_t offset;
+		uint64_t sequence;
+		{
+			std::lock_guard<std::mutex> lock(m_currentMutex);
+			offset = m_currentOffset;
+			sequence = m_currentSequence;
+		}
+		return SendOffset(*c.m_ack, value, sequence, offset, 100);
+	}
+
+	case OP_SUBSCRIBE:
+		if (c.m_ack) {
+			SetSubscribed(c, value != 0);
+		}
+		return true;
+
+	case OP_PING: {
+		int64_t arrived = wall_us();
+		m_pings.fetch_add(1, std::memory_order_relaxed);
+		if (!c.m_ack) {
+			return true;
+		}
+		return SendReply(*c.m_ack, OP_PONG, value, arrived, 0, 100, true);
+	}
+
+	case OP_CAPS:
+		// Only the first record on a connection may choose capabilities, and
+		// only ones that we offered.
+		if (c.m_records.Compact() || (value & ~m_caps) != 0) {
+			AddError("Bad capabilities from client: " + std::to_string(value));
+			return false;
+		}
+		if (value & CAP_COMPACT) {
+			c.m_records.SetCompact();
+			m_compactConnections.fetch_add(1, std::memory_order_relaxed);
+		}
+		return true;
+
+	case OP_SET_SCHEDULE:
+		m_scheduleMessages.fetch_add(1, std::memory_order_relaxed);
+		if (value <= 0 || value > static_cast<int64_t>(MaxScheduleEntries)) {
+			AddError("Bad schedule length from client: " + std::to_string(value));
+			return false;
+		}
+		c.m_scheduleRemaining = value;
+		c.m_schedule.reserve(static_cast<size_t>(value));
+		return true;
+
+	default:
+		m_unknownMessages.fetch_add(1, std::memory_order_relaxed);
+		AddError("Unknown op code from client: " + std::to_string(op));
+		return false;
+	}
+}
+
+TimeWarpServer::TimeWarpServer(TimeWarpServerCallback callback, void* userData,
+	uint16_t port, std::string cardIP)
+	: TimeWarpServer(callback, userData, TimeWarpServerOptions(), port, cardIP)
+{
+}
+
+TimeWarpServer::TimeWarpServer(TimeWarpServerCallback callback, void* userData,
+	const TimeWarpServerOptions& options, uint16_t port, std::string cardIP)
+{
+	m_private.reset(new TimeWarpServerPrivate());
+
+	// Check and store the paramters
+	if (!callback) {
+		m_private->AddError("Null callback handler passed to constructor");
+		return;
+	}
+	m_private->m_callback = callback;
+	m_private->m_userData = userData;
+	Open(options, port, cardIP);
+}
+
+TimeWarpServer::TimeWarpServer(TimeWarpUpdateHandler handler,
+	const TimeWarpServerOptions& options, uint16_t port, std::string cardIP)
+{
+	m_private.reset(new TimeWarpServerPrivate());
+	if (!handler) {
+		m_private->AddError("Empty update handler passed to constructor");
+		return;
+	}
+	m_private->m_handler = std::move(handler);
+	Open(options, port, cardIP);
+}
+
+void TimeWarpServer::Open(const TimeWarpServerOptions& options, uint16_t port, std::string cardIP)
+{
+	m_private->m_options = options;
+	m_private->m_hello = MagicCookie;
+	if (options.protocolVersion >= 2) {
+		m_private->m_caps = CAP_COMPACT | CAP_DELTA | CAP_CHANNELS | CAP_CLOCK;
+		int64_t caps[2] = { CoreSocket::hton(OP_CAPS), CoreSocket::hton(m_private->m_caps) };
+		m_private->m_hello.append(reinterpret_cast<const char*>(caps), sizeof(caps));
+	}
+	if (m_private->m_quitSignal.Fd() == BAD_SOCKET || m_private->m_reapSignal.Fd() == BAD_SOCKET) {
+		m_private->AddError("Could not create wakeup signals");
+		return;
+	}
+
+	// Pick up where the last server using the journal left off before any
+	// clients can connect.
+	if (!options.journalPath.empty()) {
+		if (!m_private->OpenJournal(options.journalPath)) {
+			return;
+		}
+#ifdef TIMEWARP_USE_JOURNAL
+		m_private->m_journalThread = std::thread(JournalThread, m_private);
+#endif
+	}
+
+	// Open the socket that we're going to listen on for new connections.
+	const char* cardIPChar = nullptr;
+	if (cardIP.size() > 0) {
+		cardIPChar = cardIP.c_str();
+	}
+	// With SO_REUSEPORT, each accept thread gets a socket of its own bound to
+	// the same port.
+	int backlog = options.listenBacklog > 0 ? options.listenBacklog : SOMAXCONN;
+	unsigned acceptors = options.acceptThreads > 0 ? options.acceptThreads : 1;
+	bool reusePort = options.reusePort && !options.useEventLoop;
+	if (reusePort) {
+		m_private->m_listen = open_reuseport_socket(&port, cardIPChar);
+		reusePort = m_private->m_listen != BAD_SOCKET;
+	}
+	if (!reusePort) {
+		m_private->m_listen = CoreSocket::open_tcp_socket(&port, cardIPChar);
+	}
+	if (m_private->m_listen == BAD_SOCKET) {
+		m_private->AddError("Could not open socket " + std::to_string(port) +
+			" for listening");
+		return;
+	}
+	if (listen(m_private->m_listen, backlog)) {
+		m_private->AddError("get_a_TCP_socket: listen() failed.");
+		CoreSocket::close_socket(m_private->m_listen);
+		m_private->m_listen = BAD_SOCKET;
+		return;
+	}
+	if (!set_nonblocking(m_private->m_listen, true)) {
+		m_private->AddError("Could not make listening socket non-blocking");
+		return;
+	}
+	for (unsigned i = 1; i < acceptors && !options.useEventLoop; i++) {
+		SOCKET s = m_private->m_listen;
+		if (reusePort) {
+			s = open_reuseport_socket(&port, cardIPChar);
+			if (s == BAD_SOCKET || listen(s, backlog) || !set_nonblocking(s, true)) {
+				m_private->AddError("Could not open another socket on port " +
+					std::to_string(port) + " for listening");
+				if (s != BAD_SOCKET) { CoreSocket::close_socket(s); }
+				return;
+			}
+		}
+		m_private->m_acceptorSockets.push_back(s);
+	}
+
+	// Start the threads that deliver offsets to the callback before any
+	// connections can arrive.
+	unsigned dispatchers = options.dispatchThreads > 0 ? options.dispatchThreads : 1;
+	for (unsigned i = 0; i < dispatchers; i++) {
+		m_private->m_dispatchers.emplace_back(
+			new TimeWarpServerPrivate::Dispatcher(options.dispatchQueueSize));
+	}
+	for (unsigned i = 0; i < dispatchers; i++) {
+		m_private->m_dispatchers[i]->m_thread = std::thread(DispatchThread, m_private, i);
+	}
+	m_private->m_scheduleThread = std::thread(ScheduleThread, m_private);
+
+	// Subscribe to multicast offsets if we've been asked to.
+	if (!options.multicastGroup.empty()) {
+		if (!m_private->OpenMulticast(port, cardIP)) {
+			return;
+		}
+		m_private->m_multicastThread = std::thread(MulticastThread, m_private);
+	}
+
+	// Open any local endpoints.  Unix sockets are handled by the same
+	// threads as the TCP socket; each shared-memory segment gets its own.
+	if (!m_private->OpenEndpoints()) {
+		return;
+	}
+	for (SOCKET s : m_private->m_localListens) {
+		if (!set_nonblocking(s, true)) {
+			m_private->AddError("Could not make listening socket non-blocking");
+			return;
+		}
+	}
+#ifdef TIMEWARP_USE_LOCAL_TRANSPORTS
+	for (size_t i = 0; i < m_private->m_shmChannels.size(); i++) {
+		m_private->m_shmThreads.push_back(std::thread(ShmThread, m_private, i));
+	}
+#endif
+
+#ifdef TIMEWARP_USE_EPOLL
+	// In event-loop mode, every loop thread waits on the (non-blocking) listening
+	// socket and takes ownership of the connections that it accepts.
+	if (options.useEventLoop) {
+		unsigned count = options.eventLoopThreads > 0 ? options.eventLoopThreads : 1;
+		for (unsigned i = 0; i < count; i++) {
+			m_private->m_loopThreads.push_back(std::thread(EventLoopThread, m_private));
+		}
+		return;
+	}
+#endif
+
+	// Start a thread to accept connections on the listening socket, and any
+	// others that were asked for.
+	m_private->m_listenThread = std::thread(ListenThread, m_private);
+	for (size_t i = 0; i < m_private->m_acceptorSockets.size(); i++) {
+		m_private->m_acceptorThreads.push_back(std::thread(AcceptorThread, m_private, i));
+	}
+}
+
+TimeWarpServer::~TimeWarpServer()
+{
+	// Tell all of our sub-threads it is time to quit, including any that are
+	// waiting for room in a dispatcher's queue.
+	m_private->m_quit = true;
+	m_private->m_quitSignal.Signal();
+	for (auto& d : m_private->m_dispatchers) {
+		std::lock_guard<std::mutex> lock(d->m_wakeMutex);
+		d->m_space.notify_all();
+	}
+
+	// Wait for the listening thread to quit, which will have waited for
+	// all of the accepting threads to have quit.  Other threads that start
+	// accepting threads must be done first.
+	for (auto& t : m_private->m_acceptorThreads) {
+		t.join();
+	}
+	for (SOCKET s : m_private->m_acceptorSockets) {
+		if (s != m_private->m_listen) {
+			CoreSocket::close_socket(s);
+		}
+	}
+	if (m_private->m_listenThread.joinable()) {
+		m_private->m_listenThread.join();
+	}
+	for (auto& t : m_private->m_loopThreads) {
+		t.join();
+	}
+	if (m_private->m_multicastThread.joinable()) {
+		m_private->m_multicastThread.join();
+	}
+	if (m_private->m_multicast != BAD_SOCKET) {
+		CoreSocket::close_socket(m_private->m_multicast);
+	}
+	if (m_private->m_listen != BAD_SOCKET) {
+		CoreSocket::close_socket(m_private->m_listen);
+	}
+	for (size_t i = 0; i < m_private->m_localListens.size(); i++) {
+		CoreSocket::close_socket(m_private->m_localListens[i]);
+#ifdef TIMEWARP_USE_LOCAL_TRANSPORTS
+		unlink(m_private->m_localPaths[i].c_str());
+#endif
+	}
+#ifdef TIMEWARP_USE_LOCAL_TRANSPORTS
+	for (auto& shm : m_private->m_shmChannels) {
+		shm->Close();
+	}
+	for (auto& t : m_private->m_shmThreads) {
+		t.join();
+	}
+#endif
+
+	// Nothing more can be received, so let the dispatchers finish up once
+	// the schedule thread has stopped feeding them.  Offsets scheduled for
+	// later than now are dropped.
+	{
+		std::lock_guard<std::mutex> lock(m_private->m_scheduleMutex);
+		m_private->m_scheduleStop = true;
+	}
+	m_private->m_scheduleWake.notify_one();
+	if (m_private->m_scheduleThread.joinable()) {
+		m_private->m_scheduleThread.join();
+	}
+	m_private->StopDispatchers();
+
+	// Everything that was queued has also been handed to the journal.
+#ifdef TIMEWARP_USE_JOURNAL
+	if (m_private->m_journalThread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(m_private->m_journalMutex);
+			m_private->m_journalStop = true;
+		}
+		m_private->m_journalWake.notify_one();
+		m_private->m_journalThread.join();
+	}
+#endif
+}
+
+bool TimeWarpServer::TimeWarpServerPrivate::OpenJournal(const std::string& path)
+{
+#ifdef TIMEWARP_USE_JOURNAL
+	std::string error;
+	m_journal.reset(new Journal());
+	if (!m_journal->Open(path, false, error)) {
+		m_journal.reset();
+		AddError(error);
+		return false;
+	}
+
+	// The latest offset on each channel is the last one in the journal.
+	const JournalRecord* records = m_journal->Records();
+	m_journalRecovered = m_journal->Count();
+	for (uint64_t i = 0; i < m_journalRecovered; i++) {
+		if (records[i].m_channel == 0) {
+			SetCurrent(records[i].m_offset);
+		} else if (records[i].m_channel < MaxChannels) {
+			Channel& ch = m_channels[records[i].m_channel];
+			if (ch.m_sequence++ == 0) {
+				m_channelsUsed++;
+			}
+			ch.m_offset = records[i].m_offset;
+		}
+	}
+
+	m_journalRing.resize(m_options.journalQueueSize > 0 ? m_options.journalQueueSize : 1);
+	return true;
+#else
+	AddError("Offset journals are not supported on this platform");
+	return false;
+#endif
+}
+
+void TimeWarpServer::JournalThread(std::shared_ptr<TimeWarpServerPrivate> p)
+{
+#ifdef TIMEWARP_USE_JOURNAL
+	// Take everything that is waiting each time around, so that a burst of
+	// offsets goes to the journal in one copy.
+	std::vector<JournalRecord> batch;
+	bool failed = false;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(p->m_journalMutex);
+			p->m_journalWake.wait(lock, [&]() { return p->m_journalStop || p->m_journalCount > 0; });
+			if (p->m_journalCount == 0) {
+				return;
+			}
+			batch.clear();
+			for (; p->m_journalCount > 0; p->m_journalCount--) {
+				batch.push_back(p->m_journalRing[p->m_journalHead]);
+				p->m_journalHead = (p->m_journalHead + 1) % p->m_journalRing.size();
+			}
+		}
+		if (!failed && p->m_journal->Append(batch.data(), batch.size())) {
+			p->m_journalRecords.fetch_add(batch.size(), std::memory_order_relaxed);
+		} else {
+			if (!failed) {
+				p->AddError("Could not grow journal; no longer writing to it");
+				failed = true;
+			}
+			p->m_journalDropped.fetch_add(batch.size(), std::memory_order_relaxed);
+		}
+	}
+#endif
+}
+
+void TimeWarpServer::TimeWarpServerPrivate::AcceptLoop(
+	std::shared_ptr<TimeWarpServerPrivate> p, const std::vector<SOCKET>& listens, bool reap)
+{
+	// Connections that are still handshaking, with their sockets.
+	std::vector<std::pair<SOCKET, Handshake> > pending;
+	auto drop = [&](size_t i) {
+		p->m_handshakeFailures++;
+		p->m_activeConnections--;
+		CoreSocket::close_socket(pending[i].first);
+		pending[i] = std::move(pending.back());
+		pending.pop_back();
+	};
+
+	// We block until there is a connection, a handshake can make progress or
+	// times out, a connection thread finishes, or we're told to quit, so an
+	// idle server does not wake up at all.  The listening sockets come first,
+	// then the signals, then the handshaking connections.
+	std::vector<PollFd> fds;
+	auto add = [&fds](SOCKET s, short events) {
+		PollFd fd;
+		fd.fd = s;
+		fd.events = events;
+		fd.revents = 0;
+		fds.push_back(fd);
+	};
+	size_t signals = listens.size();
+	size_t first = signals + (reap ? 2 : 1);
+	while (!p->m_quit) {
+		fds.clear();
+		for (SOCKET s : listens) {
+			add(s, POLLIN);
+		}
+		add(p->m_quitSignal.Fd(), POLLIN);
+		if (reap) {
+			add(p->m_reapSignal.Fd(), POLLIN);
+		}
+		int timeoutMs = -1;
+		auto now = std::chrono::steady_clock::now();
+		for (auto& h : pending) {
+			add(h.first, h.second.m_state == Handshake::SENDING_COOKIE ? POLLOUT : POLLIN);
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+				h.second.m_deadline - now).count() + 1;
+			if (left < 0) { left = 0; }
+			if (timeoutMs < 0 || left < timeoutMs) { timeoutMs = static_cast<int>(left); }
+		}
+		if (poll_sockets(fds.data(), fds.size(), timeoutMs) < 0) {
+			p->AddError("Failure waiting on listening socket");
+			break;
+		}
+
+		// Move along the handshakes that can make progress, hand off the ones
+		// that are done and drop the ones that failed or ran out of time.  We
+		// go backwards so that removing one leaves the rest where they were.
+		now = std::chrono::steady_clock::now();
+		for (size_t i = pending.size(); i-- > 0; ) {
+			SOCKET sock = pending[i].first;
+			Handshake& h = pending[i].second;
+			if (fds[first + i].revents && !p->StepHandshake(sock, h)) {
+				drop(i);
+			} else if (h.m_state == Handshake::DONE) {
+				set_nonblocking(sock, false);
+				StartConnection(p, sock);
+				pending[i] = std::move(pending.back());
+				pending.pop_back();
+			} else if (h.m_deadline < now) {
+				p->AddError("Could not read magic cookie");
+				drop(i);
+			}
+		}
+
+		// Accept until there are none left; another thread may have beaten us
+		// to them, in which case accept() says to try again.
+		for (size_t l = 0; l < listens.size(); l++) {
+			if (!fds[l].revents) { continue; }
+			while (true) {
+				SOCKET sock = accept(listens[l], nullptr, nullptr);
+				if (sock == BAD_SOCKET) {
+					int retry = socket_retry();
+#ifndef _WIN32
+					if (errno == ECONNABORTED) { retry = 1; }
+#endif
+					if (retry > 0) { continue; }
+					if (retry < 0) {
+						p->AddError("Failure accepting on socket");
+					}
+					break;
+				}
+				if (!p->Admit(sock)) {
+					continue;
+				}
+
+				// Some systems have accepted sockets inherit the listening
+				// socket's non-blocking mode and some don't; we want it until
+				// the handshake is done.
+				set_nonblocking(sock, true);
+				int one = 1;
+				setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+					reinterpret_cast<const char*>(&one), sizeof(one));
+				pending.push_back(std::make_pair(sock, Handshake()));
+				p->StartHandshake(pending.back().second);
+				if (!p->StepHandshake(sock, pending.back().second)) {
+					drop(pending.size() - 1);
+				} else if (pending.back().second.m_state == Handshake::DONE) {
+					set_nonblocking(sock, false);
+					StartConnection(p, sock);
+					pending.pop_back();
+				}
+			}
+		}
+
+		// If any of the connection threads have completed, remove them from the map.
+		if (reap && fds[signals + 1].revents) {
+			p->m_reapSignal.Drain();
+			std::lock_guard<std::mutex> lock(p->m_mutex);
+			auto i = p->m_acceptThreads.begin();
+			while (i != p->m_acceptThreads.end()) {
+				if (i->second->m_done) {
+					i->second->m_thread->join();
+					// Delete the entry from the map and advance to the next entry
+					auto victim = i;
+					i++;
+					p->m_acceptThreads.erase(victim);
+				}
+				else {
+					i++;
+				}
+			}
+		}
+	}
+
+	for (auto& h : pending) {
+		p->m_activeConnections--;
+		CoreSocket::close_socket(h.first);
+	}
+}
+
+void TimeWarpServer::TimeWarpServerPrivate::StartConnection(
+	std::shared_ptr<TimeWarpServerPrivate> p, SOCKET sock)
+{
+	std::lock_guard<std::mutex> lock(p->m_mutex);
+	p->m_acceptThreads[p->m_nextMapEntry] =
+		std::make_shared<TimeWarpServerPrivate::AcceptInfo>(
+			nullptr,
+			sock);
+	// Start the thread only after the map entry is made to avoid
+	// having the thread running before its data is available.
+	p->m_acceptThreads[p->m_nextMapEntry]->m_thread =
+		std::make_shared<std::thread>(AcceptThread, p, p->m_nextMapEntry);
+	p->m_nextMapEntry++;
+}
+
+/* Static */
+void TimeWarpServer::ListenThread(std::shared_ptr<TimeWarpServerPrivate> p)
+{
+	if (!p) { return; }
+
+	// Keep listening for connections on the TCP socket and any unix:// ones.
+	std::vector<SOCKET> listens(1, p->m_listen);
+	listens.insert(listens.end(), p->m_localListens.begin(), p->m_localListens.end());
+	TimeWarpServerPrivate::AcceptLoop(p, listens, true);
+
+	// Wait for all of the accept threads to quit and remove them from the map.
+	while (p->m_acceptThreads.size()) {
+		p->m_acceptThreads.begin()->second->m_thread->join();
+		p->m_acceptThreads.erase(p->m_acceptThreads.begin());
+	}
+}
+
+/* Static */
+void TimeWarpServer::AcceptorThread(std::shared_ptr<TimeWarpServerPrivate> p, size_t i)
+{
+	if (!p) { return; }
+	TimeWarpServerPrivate::AcceptLoop(p, std::vector<SOCKET>(1, p->m_acceptorSockets[i]), false);
+}
+
+void TimeWarpServer::AcceptThread(std::shared_ptr<TimeWarpServerPrivate> p, size_t i)
+{
+	if (!p) { return; }
+	std::shared_ptr<TimeWarpServerPrivate::AcceptInfo> info;
+	{
+		std::lock_guard<std::mutex> lock(p->m_mutex);
+		info = p->m_acceptThreads[i];
+	}
+
+	// Mark ourselves done and tell the listening thread to come reap us.
+	auto finish = [&]() {
+		p->m_activeConnections--;
+		CoreSocket::close_socket(info->m_sock);
+		info->m_sock = BAD_SOCKET;
+		info->m_done = true;
+		p->m_reapSignal.Signal();
+	};
+
+	// We wait on our socket and the quit signal, so that we hear about
+	// shutdown right away rather than on a timeout.
+	SOCKET waitOn[2] = { info->m_sock, p->m_quitSignal.Fd() };
+
+	// Keep reading until it is time to quit or we get an error.
+	TimeWarpServerPrivate::ConnectionState conn;
+	p->InitConnection(conn, p->m_nextConnectionId++, info->m_sock);
+	char buffer[4096];
+	while (!p->m_quit) {
+		// Block until there is something to read or we're told to quit.
+		int ready = wait_readable(waitOn, 2, -1);
+		if (ready < 0 || (ready & 2)) {
+			break;
+		}
+		if (!(ready & 1)) {
+			continue;
+		}
+
+		// If it was an error, we're done.  This is not a global error, just a closed connection.
+		int got = recv(info->m_sock, buffer, sizeof(buffer), 0);
+		if (got <= 0) {
+			break;
+		}
+
+		// Handle each complete record; partial ones are kept until the rest arrives.
+		if (!p->HandleBytes(conn, buffer, got)) {
+			break;
+		}
+	}
+
+	// Close my socket before quitting
+	p->ReleaseConnection(conn);
+	finish();
+}
+
+/* Static */
+void TimeWarpServer::EventLoopThread(std::shared_ptr<TimeWarpServerPrivate> p)
+{
+	if (!p) { return; }
+#ifdef TIMEWARP_USE_EPOLL
+	typedef TimeWarpServerPrivate::LoopConnection LoopConnection;
+
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	if (ep < 0) {
+		p->AddError("Could not create epoll instance");
+		return;
+	}
+
+	// Listening sockets are marked by pointers to where they are stored.  They
+	// are shared by all of the loop threads, so we ask that only one of them
+	// be woken per connection.
+	std::vector<SOCKET*> listens;
+	listens.push_back(&p->m_listen);
+	for (SOCKET& s : p->m_localListens) {
+		listens.push_back(&s);
+	}
+	struct epoll_event ev;
+	for (SOCKET* s : listens) {
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		ev.data.ptr = s;
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, *s, &ev) != 0) {
+			p->AddError("Could not add listening socket to epoll");
+			close(ep);
+			return;
+		}
+	}
+
+	// The quit signal is marked by a pointer to itself.
+	ev.events = EPOLLIN;
+	ev.data.ptr = &p->m_quitSignal;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, p->m_quitSignal.Fd(), &ev) != 0) {
+		p->AddError("Could not add quit signal to epoll");
+		close(ep);
+		return;
+	}
+
+	// The connections owned by this thread, along with the subset that are
+	// still handshaking and must be timed out if the peer stalls.
+	std::unordered_map<LoopConnection*, std::unique_ptr<LoopConnection> > conns;
+	std::set<LoopConnection*> handshaking;
+	auto closeConnection = [&](LoopConnection* c) {
+		p->m_activeConnections--;
+		p->ReleaseConnection(c->m_conn);
+		epoll_ctl(ep, EPOLL_CTL_DEL, c->m_sock, nullptr);
+		CoreSocket::close_socket(c->m_sock);
+		handshaking.erase(c);
+		conns.erase(c);
+	};
+
+	std::vector<struct epoll_event> events(256);
+	while (!p->m_quit) {
+		// Block until something happens, or until the next handshake deadline
+		// if any connections are still handshaking.
+		int timeoutMs = -1;
+		if (!handshaking.empty()) {
+			auto next = (*handshaking.begin())->m_handshake.m_deadline;
+			for (LoopConnection* c : handshaking) {
+				if (c->m_handshake.m_deadline < next) { next = c->m_handshake.m_deadline; }
+			}
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+				next - std::chrono::steady_clock::now()).count() + 1;
+			timeoutMs = left > 0 ? static_cast<int>(left) : 0;
+		}
+		int n = epoll_wait(ep, events.data(), static_cast<int>(events.size()), timeoutMs);
+		if (n < 0) {
+			if (errno == EINTR) { continue; }
+			p->AddError("Failure waiting on epoll");
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.ptr == &p->m_quitSignal) {
+				continue;
+			}
+			// Accept all pending connections; another loop thread may have
+			// beaten us to them, in which case accept() says to try again.
+			SOCKET* listen = static_cast<SOCKET*>(events[i].data.ptr);
+			if (std::find(listens.begin(), listens.end(), listen) != listens.end()) {
+				while (true) {
+					SOCKET s = accept4(*listen, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+					if (s == BAD_SOCKET) {
+						if (errno == EINTR || errno == ECONNABORTED) { continue; }
+						if (errno != EAGAIN && errno != EWOULDBLOCK) {
+							p->AddError("Failure accepting on socket");
+						}
+						break;
+					}
+					if (!p->Admit(s)) {
+						continue;
+					}
+					int one = 1;
+					setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+					std::unique_ptr<LoopConnection> nc(new LoopConnection());
+					nc->m_sock = s;
+					p->InitConnection(nc->m_conn, p->m_nextConnectionId++, s);
+					p->StartHandshake(nc->m_handshake);
+					LoopConnection* raw = nc.get();
+					conns[raw] = std::move(nc);
+					handshaking.insert(raw);
+
+					struct epoll_event cev;
+					cev.events = EPOLLIN | EPOLLOUT;
+					cev.data.ptr = raw;
+					if (epoll_ctl(ep, EPOLL_CTL_ADD, s, &cev) != 0) {
+						p->AddError("Could not add connection to epoll");
+						p->m_activeConnections--;
+						CoreSocket::close_socket(s);
+						handshaking.erase(raw);
+						conns.erase(raw);
+					}
+				}
+				continue;
+			}
+
+			LoopConnection* c = static_cast<LoopConnection*>(events[i].data.ptr);
+			TimeWarpServerPrivate::Handshake::State before = c->m_handshake.m_state;
+			if (!p->ServiceConnection(*c)) {
+				if (c->m_handshake.m_state != TimeWarpServerPrivate::Handshake::DONE) {
+					p->m_handshakeFailures++;
+				}
+				closeConnection(c);
+				continue;
+			}
+
+			// Once the cookie has been sent we only care about reading.
+			if (before == TimeWarpServerPrivate::Handshake::SENDING_COOKIE &&
+					c->m_handshake.m_state != before) {
+				struct epoll_event cev;
+				cev.events = EPOLLIN;
+				cev.data.ptr = c;
+				epoll_ctl(ep, EPOLL_CTL_MOD, c->m_sock, &cev);
+			}
+			if (c->m_handshake.m_state == TimeWarpServerPrivate::Handshake::DONE) {
+				handshaking.erase(c);
+			}
+		}
+
+		// Drop connections whose handshake did not finish in time.
+		if (!handshaking.empty()) {
+			auto now = std::chrono::steady_clock::now();
+			std::vector<LoopConnection*> expired;
+			for (LoopConnection* c : handshaking) {
+				if (c->m_handshake.m_deadline < now) { expired.push_back(c); }
+			}
+			for (LoopConnection* c : expired) {
+				p->m_handshakeFailures++;
+				p->AddError("Could not read magic cookie");
+				closeConnection(c);
+			}
+		}
+	}
+
+	// Close all of our connections before quitting.
+	for (auto& c : conns) {
+		p->m_activeConnections--;
+		p->ReleaseConnection(c.second->m_conn);
+		CoreSocket::close_socket(c.second->m_sock);
+	}
+	close(ep);
+#endif
+}
+
+/* Static */
+void TimeWarpServer::DispatchThread(std::shared_ptr<TimeWarpServerPrivate> p, size_t i)
+{
+	if (!p) { return; }
+	TimeWarpServerPrivate::Dispatcher& d = *p->m_dispatchers[i];
+
+	TimeWarpServerPrivate::OffsetUpdate u;
+	while (true) {
+		while (d.m_queue.TryPop(u)) {
+			// Wake any producer that is waiting for room in the queue.
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (d.m_waitingForSpace.load(std::memory_order_relaxed) > 0) {
+				std::lock_guard<std::mutex> lock(d.m_wakeMutex);
+				d.m_space.notify_all();
+			}
+
+			// Clear the pending flag before reading the value, so that any offset
+			// stored after we read will queue a new entry rather than be lost.
+			if (u.m_slot) {
+				u.m_slot->m_pending.store(false);
+				u.m_offset = u.m_slot->m_offset.load();
+				u.m_slot.reset();
+			}
+
+			// Drop steps of a ramp that has been stopped and, when delivering
+			// only the latest offset, all but the newest step.  A step that is
+			// delivered holds the lock until its callback has returned.
+			std::unique_lock<std::mutex> rampLock;
+			if (u.m_op == OP_RAMP) {
+				rampLock = std::unique_lock<std::mutex>(p->m_rampDeliveryMutex);
+				if (u.m_rampStep < p->m_rampFirstStep) {
+					continue;
+				}
+				if (p->m_options.delivery != TimeWarpDelivery::EVERY_OFFSET &&
+						u.m_rampStep != p->m_rampSteps.load()) {
+					d.m_coalesced.fetch_add(1, std::memory_order_relaxed);
+					continue;
+				}
+			}
+
+			// Offsets for channels other than 0 go to the channel's callback if
+			// it has one and are not seen by subscribers.
+			uint64_t sequence;
+			TimeWarpChannelCallback channelCallback = nullptr;
+			void* channelData = nullptr;
+			if (u.m_channel != 0) {
+				std::lock_guard<std::mutex> lock(p->m_channelMutex);
+				TimeWarpServerPrivate::Channel& ch = p->m_channels[u.m_channel];
+				if (ch.m_sequence == 0) {
+					p->m_channelsUsed++;
+				}
+				ch.m_offset = u.m_offset;
+				sequence = ++ch.m_sequence;
+				channelCallback = ch.m_callback;
+				channelData = ch.m_userData;
+			} else {
+				sequence = p->SetCurrent(u.m_offset);
+			}
+			// Only time the updates that something was actually called for.
+			auto start = std::chrono::steady_clock::now();
+			bool called = true;
+			if (channelCallback) {
+				channelCallback(channelData, u.m_channel, u.m_offset);
+			} else if (p->m_handler) {
+				TimeWarpUpdate update;
+				update.connection = u.m_connection;
+				update.kind = (u.m_op == OP_SET_SCHEDULE) ? TimeWarpUpdateKind::SCHEDULED :
+					(u.m_op == OP_RAMP) ? TimeWarpUpdateKind::RAMP : TimeWarpUpdateKind::SET_TIME;
+				update.timeOffset = u.m_offset;
+				update.receivedNs = u.m_received;
+				update.sequence = sequence;
+				update.channel = u.m_channel;
+				p->m_handler(update);
+			} else if (u.m_channel == 0) {
+				p->m_callback(p->m_userData, u.m_offset);
+			} else {
+				called = false;
+			}
+			if (called) {
+				p->m_callbackDuration.Add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - start).count());
+			}
+			if (u.m_channel == 0) {
+				p->Publish(sequence, u.m_offset);
+			}
+
+			// Tell the client that its offset has been applied.  Don't wait long
+			// for a client that isn't reading; it just misses the acknowledgement.
+			if (u.m_ack.m_sink) {
+				int64_t ack[4] = { CoreSocket::hton(OP_ACK), CoreSocket::hton(u.m_ack.m_sequence),
+					CoreSocket::hton(u.m_ack.m_received), CoreSocket::hton(monotonic_ns()) };
+				std::lock_guard<std::mutex> lock(u.m_ack.m_sink->m_mutex);
+				if (u.m_ack.m_sink->m_sock != BAD_SOCKET) {
+					write_all(u.m_ack.m_sink->m_sock, reinterpret_cast<const char*>(ack), sizeof(ack), 100);
+				}
+				u.m_ack = TimeWarpServerPrivate::AckRequest();
+			}
+		}
+
+		// Say that we're going to sleep and then check the queue once more,
+		// so that we don't miss an entry pushed by a producer that looked at
+		// the flag before we set it.
+		std::unique_lock<std::mutex> lock(d.m_wakeMutex);
+		d.m_sleeping.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		d.m_wake.wait(lock, [&d]() { return d.m_stop || !d.m_queue.Empty(); });
+		d.m_sleeping.store(false, std::memory_order_relaxed);
+		if (d.m_stop && d.m_queue.Empty()) {
+			break;
+		}
+	}
+}
+
+/* Static */
+void TimeWarpServer::ShmThread(std::shared_ptr<TimeWarpServerPrivate> p, size_t i)
+{
+	if (!p) { return; }
+#ifdef TIMEWARP_USE_LOCAL_TRANSPORTS
+	// All of the writers to a segment are treated as a single connection.
+	ShmChannel& shm = *p->m_shmChannels[i];
+	TimeWarpServerPrivate::ConnectionState conn;
+	p->InitConnection(conn, p->m_nextConnectionId++);
+	std::chrono::microseconds spin(p->m_options.shmSpinMicroseconds);
+	uint64_t seq = 0;
+	int64_t offset;
+	while (shm.Read(seq, offset, spin)) {
+		p->HandleCommand(conn, OP_SET_TIME, offset);
+	}
+#endif
+}
+
+/* Static */
+void TimeWarpServer::MulticastThread(std::shared_ptr<TimeWarpServerPrivate> p)
+{
+	if (!p) { return; }
+	typedef TimeWarpServerPrivate::MulticastPublisher MulticastPublisher;
+	std::map<std::pair<uint32_t, uint16_t>, MulticastPublisher> publishers;
+	std::vector<std::pair<int64_t, int64_t> > missed;
+
+	// If we know where the publisher is, ask it for the current offset so that
+	// we don't have to wait for the next change to find out what it is.
+	const std::string& pubHost = p->m_options.multicastPublisherHost;
+	if (!pubHost.empty()) {
+		// A publisher that has not sent anything yet answers with no offsets,
+		// which is not an error; we just wait for its first datagram.
+		if (!fetch_multicast_history(pubHost, p->m_options.multicastPublisherPort, 0, missed)) {
+			p->AddError("Could not get current offset from multicast publisher " + pubHost);
+		} else if (!missed.empty()) {
+			TimeWarpServerPrivate::ConnectionState conn;
+			p->InitConnection(conn, p->m_nextConnectionId++);
+			p->HandleCommand(conn, OP_SET_TIME, missed.back().second);
+			p->m_multicastRecovered++;
+		}
+		missed.clear();
+	}
+
+	SOCKET waitOn[2] = { p->m_multicast, p->m_quitSignal.Fd() };
+	char buffer[MULTICAST_DATAGRAM_SIZE + 1];
+	while (!p->m_quit) {
+		int ready = wait_readable(waitOn, 2, -1);
+		if (ready < 0) {
+			p->AddError("Failure waiting on multicast socket");
+			break;
+		}
+		if (!(ready & 1)) {
+			continue;
+		}
+
+		struct sockaddr_in from;
+		socklen_t fromLen = sizeof(from);
+		int got = recvfrom(p->m_multicast, buffer, sizeof(buffer), 0,
+			reinterpret_cast<struct sockaddr*>(&from), &fromLen);
+		if (got != static_cast<int>(MULTICAST_DATAGRAM_SIZE)) {
+			continue;
+		}
+		p->m_bytesReceived.fetch_add(got, std::memory_order_relaxed);
+		int64_t fields[5];
+		memcpy(fields, buffer, sizeof(fields));
+		for (size_t i = 0; i < 5; i++) {
+			fields[i] = CoreSocket::ntoh(fields[i]);
+		}
+		if (fields[0] != MULTICAST_COOKIE) {
+			continue;
+		}
+		int64_t seq = fields[1];
+		int64_t op = fields[2];
+		int64_t value = fields[3];
+		int64_t recoveryPort = fields[4];
+
+		// Find the publisher, treating a new one like a new connection.
+		auto key = std::make_pair(static_cast<uint32_t>(from.sin_addr.s_addr), from.sin_port);
+		auto it = publishers.find(key);
+		if (it == publishers.end()) {
+			it = publishers.insert(std::make_pair(key, MulticastPublisher())).first;
+			p->InitConnection(it->second.m_conn, p->m_nextConnectionId++);
+		}
+		MulticastPublisher& pub = it->second;
+
+		// Ignore duplicated or reordered datagrams.
+		if (seq <= pub.m_lastSeq) {
+			continue;
+		}
+
+		// If we missed some, ask the publisher for them so that they are all
+		// delivered in order.  The first datagram from a publisher is not a gap;
+		// it just means that we joined late.
+		if (pub.m_lastSeq != 0 && seq > pub.m_lastSeq + 1) {
+			p->m_multicastGaps += static_cast<uint64_t>(seq - pub.m_lastSeq - 1);
+			char host[INET_ADDRSTRLEN];
+			if (recoveryPort > 0 && recoveryPort < 65536 &&
+					inet_ntop(AF_INET, &from.sin_addr, host, sizeof(host)) &&
+					fetch_multicast_history(host, static_cast<int>(recoveryPort), pub.m_lastSeq + 1, missed)) {
+				for (auto& m : missed) {
+					if (m.first > pub.m_lastSeq && m.first < seq) {
+						p->HandleCommand(pub.m_conn, OP_SET_TIME, m.second);
+						p->m_multicastRecovered++;
+					}
+				}
+			}
+			missed.clear();
+		}
+		pub.m_lastSeq = seq;
+		if (op == OP_SET_TIME) {
+			p->HandleCommand(pub.m_conn, op, value);
+		}
+	}
+}
+
+/* Static */
+void TimeWarpServer::ScheduleThread(std::shared_ptr<TimeWarpServerPrivate> p)
+{
+	if (!p) { return; }
+	typedef std::chrono::steady_clock Clock;
+
+	std::vector<TimeWarpServerPrivate::ScheduledOffset> due;
+	TimeWarpServerPrivate::Ramp& ramp = p->m_ramp;
+	auto tick = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(
+		1.0 / (p->m_options.rampUpdateRate > 0 ? p->m_options.rampUpdateRate : 240)));
+	std::unique_lock<std::mutex> lock(p->m_scheduleMutex);
+	while (!p->m_scheduleStop) {
+		// Sleep until there is something to do.  A new entry, a new ramp or a
+		// request to stop wakes us, in which case we go around and look again.
+		if (p->m_schedule.Empty() && !p->m_rampActive) {
+			p->m_scheduleWake.wait(lock);
+			continue;
+		}
+		Clock::time_point next = Clock::time_point::max();
+		if (!p->m_schedule.Empty()) {
+			next = p->m_schedule.NextDue();
+		}
+		if (p->m_rampActive && ramp.m_nextTick < next) {
+			next = ramp.m_nextTick;
+		}
+		Clock::time_point now = Clock::now();
+		if (next > now) {
+			p->m_scheduleWake.wait_until(lock, next);
+			continue;
+		}
+
+		// Collect everything that is due.  Scheduled offsets stop a ramp.
+		p->m_schedule.Collect(now, due);
+		bool rampTick = false;
+		TimeWarpServerPrivate::Ramp step;
+		uint64_t stepNumber = 0;
+		if (!due.empty()) {
+			if (p->m_rampActive || p->m_rampSteps.load() >= p->m_rampFirstStep.load()) {
+				p->m_rampActive = false;
+				p->m_ramping = false;
+				p->DropRampSteps();
+			}
+		} else if (p->m_rampActive && ramp.m_nextTick <= now) {
+			// Skip ticks that we were too late for, and make the last one land
+			// exactly at the end of the ramp.
+			int64_t value = ramp.ValueAt(now);
+			rampTick = (value != ramp.m_last || now >= ramp.m_end);
+			ramp.m_last = value;
+			ramp.m_nextTick += tick;
+			if (ramp.m_nextTick <= now) {
+				ramp.m_nextTick = now + tick;
+			}
+			if (ramp.m_nextTick > ramp.m_end) {
+				ramp.m_nextTick = ramp.m_end;
+			}
+			step = ramp;
+			if (rampTick) {
+				stepNumber = ++p->m_rampSteps;
+			}
+			if (now >= ramp.m_end) {
+				p->m_rampActive = false;
+				p->m_ramping = false;
+			}
+		}
+
+		// Deliver everything that is due, in time order, without holding the
+		// lock so that new schedules can be added meanwhile.
+		lock.unlock();
+		std::stable_sort(due.begin(), due.end(),
+			[](const TimeWarpServerPrivate::ScheduledOffset& a,
+				const TimeWarpServerPrivate::ScheduledOffset& b) { return a.m_due < b.m_due; });
+		for (auto& e : due) {
+			if (e.m_limiter) {
+				p->ReleaseHeld(e);
+			} else {
+				p->QueueOffset(e.m_connection, OP_SET_SCHEDULE, e.m_offset, e.m_slot);
+			}
+		}
+		due.clear();
+		if (rampTick) {
+			p->m_rampUpdates.fetch_add(1, std::memory_order_relaxed);
+			p->QueueOffset(step.m_connection, OP_RAMP, step.m_last, nullptr, nullptr, 0, stepNumber);
+		}
+		lock.lock();
+	}
+}
+
+std::vector<std::string> TimeWarpServer::GetErrorMessages()
+{
+	if (m_private) {
+		std::lock_guard<std::mutex> lock(m_private->m_mutex);
+		return std::vector<std::string>(m_private->m_errors.begin(), m_private->m_errors.end());
+	}
+	std::vector<std::string> errs = { "NULL private pointer in call to GetErrorMessages" };
+	return errs;
+}
+
+TimeWarpServerStats TimeWarpServer::GetStats()
+{
+	TimeWarpServerStats ret;
+	if (m_private) {
+		for (auto& d : m_private->m_dispatchers) {
+			ret.dispatchQueueDepth += d->m_queue.Depth();
+			ret.coalescedOffsets += d->m_coalesced.load(std::memory_order_relaxed);
+			size_t high = d->m_highWater.load(std::memory_order_relaxed);
+			if (high > ret.dispatchQueueHighWater) {
+				ret.dispatchQueueHighWater = high;
+			}
+		}
+		ret.multicastGaps = m_private->m_multicastGaps.load();
+		ret.multicastRecovered = m_private->m_multicastRecovered.load();
+		int64_t active = m_private->m_activeConnections.load();
+		ret.activeConnections = active > 0 ? static_cast<uint64_t>(active) : 0;
+		ret.acceptedConnections = m_private->m_accepts.load();
+		ret.handshakeFailures = m_private->m_handshakeFailures.load();
+		ret.setTimeMessages = m_private->m_setTimeMessages.load();
+		ret.scheduleMessages = m_private->m_scheduleMessages.load();
+		ret.scheduleEntries = m_private->m_scheduleEntries.load();
+		ret.ackRequests = m_private->m_ackRequests.load();
+		ret.unknownMessages = m_private->m_unknownMessages.load();
+		ret.compactConnections = m_private->m_compactConnections.load();
+		ret.ramps = m_private->m_ramps.load();
+		ret.rampUpdates = m_private->m_rampUpdates.load();
+		ret.queries = m_private->m_queries.load();
+		ret.subscribers = m_private->m_subscriberCount.load();
+		ret.pings = m_private->m_pings.load();
+		ret.rejectedConnections = m_private->m_rejectedConnections.load();
+		ret.rateLimitDropped = m_private->m_rateLimitDropped.load();
+		ret.rateLimitCoalesced = m_private->m_rateLimitCoalesced.load();
+		ret.rateLimitDisconnects = m_private->m_rateLimitDisconnects.load();
+		ret.journalRecords = m_private->m_journalRecords.load();
+		ret.journalDropped = m_private->m_journalDropped.load();
+		ret.journalRecovered = m_private->m_journalRecovered;
+		ret.channelMessages = m_private->m_channelMessages.load();
+		ret.channels = m_private->m_channelsUsed.load();
+		ret.bytesReceived = m_private->m_bytesReceived.load();
+		ret.callbackDuration = m_private->m_callbackDuration.Snapshot();
+		ret.callbacks = ret.callbackDuration.count;
+		ret.errors = m_private->m_errorCount.load();
+	}
+	return ret;
+}
+
+bool TimeWarpServer::GetTimeOffset(int64_t& timeOffset)
+{
+	if (!m_private) {
+		return false;
+	}
+	std::lock_guard<std::mutex> lock(m_private->m_currentMutex);
+	if (m_private->m_currentSequence == 0) {
+		return false;
+	}
+	timeOffset = m_private->m_currentOffset;
+	return true;
+}
+
+bool TimeWarpServer::SetChannelCallback(uint32_t channel, TimeWarpChannelCallback callback, void* userData)
+{
+	if (!m_private) {
+		return false;
+	}
+	if (channel == 0 || channel >= MaxChannels) {
+		m_private->AddError("Bad channel passed to SetChannelCallback: " + std::to_string(channel));
+		return false;
+	}
+	std::lock_guard<std::mutex> lock(m_private->m_channelMutex);
+	TimeWarpServerPrivate::Channel& ch = m_private->m_channels[channel];
+	ch.m_callback = callback;
+	ch.m_userData = userData;
+	return true;
+}
+
+bool TimeWarpServer::GetChannelOffset(uint32_t channel, int64_t& timeOffset)
+{
+	if (!m_private) {
+		return false;
+	}
+	if (channel == 0) {
+		return GetTimeOffset(timeOffset);
+	}
+	std::lock_guard<std::mutex> lock(m_private->m_channelMutex);
+	auto i = m_private->m_channels.find(channel);
+	if (i == m_private->m_channels.end() || i->second.m_sequence == 0) {
+		return false;
+	}
+	timeOffset = i->second.m_offset;
+	return true;
+}
+
+bool atl::TimeWarp::ReadTimeWarpJournal(const std::string& path,
+	std::vector<TimeWarpJournalRecord>& records, std::string& error)
+{
+	records.clear();
+#ifdef TIMEWARP_USE_JOURNAL
+	Journal journal;
+	if (!journal.Open(path, true, error)) {
+		return false;
+	}
+	const JournalRecord* r = journal.Records();
+	uint64_t count = journal.Count();
+	records.resize(static_cast<size_t>(count));
+	for (uint64_t i = 0; i < count; i++) {
+		records[i].wallTime = r[i].m_wallTime;
+		records[i].connection = static_cast<size_t>(r[i].m_connection);
+		records[i].kind = static_cast<TimeWarpUpdateKind>(r[i].m_kind);
+		records[i].channel = r[i].m_channel;
+		records[i].timeOffset = r[i].m_offset;
+	}
+	return true;
+#else
+	error = "Offset journals are not supported on this platform";
+	return false;
+#endif
+}
+
+size_t TimeWarpLatencyHistogram::Bucket(int64_t ns)
+{
+	if (ns < 0) { ns = 0; }
+
+	// Values below 4 get a bucket each; above that, the bucket is chosen by
+	// the position of the highest set bit and the two bits below it.
+	if (ns < 4) {
+		return static_cast<size_t>(ns);
+	}
+	int top = 0;
+	for (uint64_t v = static_cast<uint64_t>(ns); v > 1; v >>= 1) { top++; }
+	return 4 * top + ((ns >> (top - 2)) & 3);
+}
+
+void TimeWarpLatencyHistogram::Add(int64_t ns)
+{
+	if (ns < 0) { ns = 0; }
+	buckets[Bucket(ns)]++;
+
+	if (count == 0 || ns < minNs) { minNs = ns; }
+	if (ns > maxNs) { maxNs = ns; }
+	count++;
+	sumNs += ns;
+}
+
+int64_t TimeWarpLatencyHistogram::Percentile(double p) const
+{
+	if (count == 0) { return 0; }
+	uint64_t want = static_cast<uint64_t>(p * count + 0.5);
+	if (want < 1) { want = 1; }
+	uint64_t seen = 0;
+	for (size_t i = 0; i < Buckets; i++) {
+		seen += buckets[i];
+		if (seen >= want) {
+			int64_t top = static_cast<int64_t>(i);
+			if (i >= 8) {
+				size_t shift = i / 4 - 2;
+				top = static_cast<int64_t>((static_cast<uint64_t>(4 + i % 4 + 1) << shift) - 1);
+			}
+			return std::max(minNs, std::min(top, maxNs));
+		}
+	}
+	return maxNs;
+}
+
+class atl::TimeWarp::TimeWarpClient::TimeWarpClientPrivate {
+public:
+	~TimeWarpClientPrivate();
+
+	std::vector<std::string> m_errors;
+	std::mutex m_errorMutex;		///< The send thread may also add errors
+	SOCKET m_socket = BAD_SOCKET;
+	std::mutex m_writeMutex;		///< Keeps writes to m_socket from interleaving
+	WireEncoder m_encoder;			///< For m_socket; protected by m_writeMutex
+	std::atomic<int> m_protocolVersion{ 0 };
+	std::atomic<bool> m_channels{ false };	///< The server takes OP_CHANNEL
+	std::atomic<bool> m_clock{ false };		///< The server answers OP_PING
+	TimeWarpClientOptions m_options;
+
+	// Where to connect, for reconnecting.  When m_reconnect is set, the
+	// connection thread owns the socket: it is the only one to open or close
+	// it, and it changes m_socket only while holding m_writeMutex.  A writer
+	// that finds the connection broken clears m_socket and shuts the socket
+	// down, which wakes the connection thread to close it and start again.
+	Endpoint m_endpoint;
+	uint16_t m_port = 0;
+	std::string m_cardIP;
+	bool m_reconnect = false;
+	std::atomic<int64_t> m_latestOffset{ 0 };	///< Sent again on reconnection
+	std::atomic<bool> m_haveLatest{ false };
+	std::atomic<bool> m_connected{ false };
+	std::atomic<uint64_t> m_reconnects{ 0 };
+	std::atomic<bool> m_gaveUp{ false };		///< Stopped trying to connect
+	std::thread m_connectionThread;
+
+	// Signalled whenever the connection thread connects or gives up, for
+	// WaitForConnection().
+	std::mutex m_connectMutex;
+	std::condition_variable m_connectWake;
+
+	/// @brief Wake anyone waiting for the connection to change.
+	void NotifyConnection()
+	{
+		{ std::lock_guard<std::mutex> lock(m_connectMutex); }
+		m_connectWake.notify_all();
+	}
+
+#ifdef TIMEWARP_USE_LOCAL_TRANSPORTS
+	// Segment that offsets are written to directly for shm:// endpoints.
+	std::unique_ptr<ShmChannel> m_shm;
+#endif
+
+	// When sending asynchronously, offsets wait in a fixed-size ring of
+	// (sequence, offset) entries until the send thread writes them.  Callers
+	// only ever hold m_queueMutex long enough to add an entry.
+	std::mutex m_queueMutex;
+	std::condition_variable m_queueWake;	///< Entries were added or it is time to stop
+	std::condition_variable m_sentWake;		///< The send thread finished a batch
+	std::vector<std::pair<int64_t, int64_t> > m_ring;
+	size_t m_ringHead = 0;
+	size_t m_ringCount = 0;
+	int64_t m_lastSequence = 0;				///< Protected by m_queueMutex
+	std::atomic<int64_t> m_sentSequence{ 0 };
+	std::atomic<uint64_t> m_dropped{ 0 };
+	std::atomic<uint64_t> m_coalesced{ 0 };
+	bool m_stopSending = false;				///< Protected by m_queueMutex
+	std::thread m_sendThread;
+
+	// When publishing by multicast, m_socket is a UDP socket connected to the
+	// group.  We number our datagrams and keep the recent ones so that we can
+	// answer subscribers that missed some, on a TCP port we listen to.
+	int64_t m_sequence = 0;			///< Protected by m_historyMutex
+	std::mutex m_historyMutex;
+	std::vector<std::pair<int64_t, int64_t> > m_history;	///< Ring of (sequence, offset)
+	SOCKET m_recoveryListen = BAD_SOCKET;
+	uint16_t m_recoveryPort = 0;
+	WakeupSignal m_quitSignal;
+	std::thread m_recoveryThread;
+
+	// Acknowledged offsets: when each outstanding one was sent and the most
+	// recent acknowledgements, keyed by sequence number.  The ack thread that
+	// reads them from the server is started by the first request.
+	std::mutex m_ackMutex;
+	std::condition_variable m_ackWake;
+	int64_t m_ackSequence = 0;
+	std::map<int64_t, int64_t> m_ackSent;		///< monotonic_ns() at send time
+	std::map<int64_t, TimeWarpAck> m_acks;
+	TimeWarpLatencyHistogram m_ackRoundTrip;
+	TimeWarpLatencyHistogram m_ackApply;
+	uint64_t m_acksReceived = 0;
+	bool m_ackReaderDone = false;				///< The ack thread has stopped reading
+	std::thread m_ackThread;
+
+	// Answers to QueryTimeOffset(), keyed by request number, as the server's
+	// (sequence, offset).  Protected by m_ackMutex.
+	int64_t m_queryNumber = 0;
+	std::map<int64_t, std::pair<int64_t, int64_t> > m_queryReplies;
+
+	// Subscriptions to the server's offsets, one for each TimeWarpClient that
+	// has asked, since clients sharing a connection share this object.  The
+	// connection stays subscribed while any of them is.  m_subscribeMutex is
+	// held while the callbacks run, so that Unsubscribe() can wait for them.
+	struct Subscriber {
+		TimeWarpSubscriberCallback	m_callback = nullptr;
+		void*						m_userData = nullptr;
+		int64_t						m_lastPushed = 0;	///< Server sequence of the last offset passed on
+	};
+	std::mutex m_subscribeMutex;
+	std::map<const TimeWarpClient*, Subscriber> m_subscribers;
+	std::atomic<bool> m_subscribed{ false };	///< Renew the subscription on reconnection
+
+	// Estimate of the server's wall clock from answered pings, protected by
+	// m_ackMutex.  Each sample is (round-trip delay, clock offset) in
+	// microseconds; the estimate is the offset from the sample with the
+	// smallest delay.  m_pingThread sends pings every clockSyncInterval.
+	std::pair<int64_t, int64_t> m_clockSamples[CLOCK_SAMPLES];
+	uint64_t m_pongs = 0;						///< Number of samples ever taken
+	int64_t m_clockOffset = 0;
+	int64_t m_clockDelay = 0;
+	bool m_stopPinging = false;
+	std::thread m_pingThread;
+
+	/// @brief Send one ping and wait for the answer.
+	/// @return True if it was answered, false on timeout or failure.
+	bool Ping(double timeoutSeconds);
+
+	/// @brief Ping the server every clockSyncInterval until told to quit.
+	void PingThread();
+
+	/// @brief Make sure that something is reading replies from the server.
+	///        Call with m_ackMutex held.
+	/// @return False if the connection to the server has been lost.
+	bool StartReader()
+	{
+		if (m_ackReaderDone) {
+			return false;
+		}
+		if (!m_reconnect && !m_ackThread.joinable()) {
+			m_ackThread = std::thread(&TimeWarpClientPrivate::AckThread, this);
+		}
+		return true;
+	}
+
+	/// @brief Set up m_socket to publish to a multicast group.
+	/// @return True on success, false (with errors added) on failure.
+	bool OpenMulticast(const std::string& group, uint16_t port, const std::string& cardIP);
+
+	/// @brief Send one datagram to the multicast group and remember it.
+	bool PublishMulticast(int64_t op, int64_t value);
+
+	/// @brief Send one datagram per value to the multicast group, using as
+	///        few system calls as the platform allows.
+	bool PublishMulticast(int64_t op, const int64_t* values, size_t count);
+
+	/// @brief Fill in a datagram for the next sequence number and remember it.
+	void PackMulticast(int64_t op, int64_t value, int64_t (&fields)[5]);
+
+	/// @brief Answer requests from subscribers for datagrams they missed.
+	void RecoveryThread();
+
+	/// @brief Record an error message.
+	void AddError(const std::string& msg)
+	{
+		std::lock_guard<std::mutex> lock(m_errorMutex);
+		m_errors.push_back(msg);
+	}
+
+	/// @brief Send offsets right away, from whichever thread we're called on.
+	/// @return True on success, false on failure.
+	bool SendOffsets(const int64_t* values, size_t count);
+
+	/// @brief Add offsets to the ring for the send thread, in order, making
+	///        room according to the overflow policy if it is full.
+	/// @return Sequence number assigned to the last of them.
+	int64_t Enqueue(const int64_t* values, size_t count);
+	int64_t Enqueue(int64_t value) { return Enqueue(&value, 1); }
+
+	/// @brief Write queued offsets to the network until told to stop.
+	void SendThread();
+
+	/// @brief Read acknowledgements and other replies from the server until
+	///        told to quit.
+	void AckThread();
+
+	/// @brief Read acknowledgements and other replies from a connection to
+	///        the server.
+	/// @return True if told to quit, false if the connection was lost.
+	bool ReadFromServer(SOCKET sock);
+
+	/// @brief Connect to the server, exchange magic cookies and agree on
+	///        which capabilities to use.
+	/// @param [out] error Description of what went wrong on failure.
+	/// @param [out] caps CAP_ bits to encode commands with.
+	/// @return Connected socket, or BAD_SOCKET on failure.
+	SOCKET Connect(std::string& error, int64_t& caps);
+
+	/// @brief Start using a newly-connected socket.  Call with m_writeMutex
+	///        held, or before any other thread can write.
+	void UseSocket(SOCKET sock, int64_t caps)
+	{
+		m_encoder.Reset(caps);
+		m_protocolVersion = m_encoder.Version();
+		m_channels = (caps & CAP_CHANNELS) != 0;
+		m_clock = (caps & CAP_CLOCK) != 0;
+		m_socket = sock;
+		m_connected = true;
+	}
+
+	/// @brief Keep the connection to the server open until told to quit.
+	void ConnectionThread();
+
+	/// @brief Whether it is worth trying to send.  With autoReconnect this is
+	///        always true, since offsets will be sent on reconnection; the same
+	///        goes for connectAsync until the connection thread gives up.
+	bool CanSend() const { return (m_reconnect && !m_gaveUp) || m_socket != BAD_SOCKET || UsingShm(); }
+
+	/// @brief Whether offsets are written to a shared-memory segment.
+	bool UsingShm() const
+	{
+#ifdef TIMEWARP_USE_LOCAL_TRANSPORTS
+		return m_shm != nullptr;
+#else
+		return false;
+#endif
+	}
+
+	/// @brief Write the latest offset to the shared-memory segment.
+	bool WriteShm(int64_t offset)
+	{
+#ifdef TIMEWARP_USE_LOCAL_TRANSPORTS
+		return m_shm->Write(offset);
+#else
+		return false;
+#endif
+	}
+
+	/// @brief Remember the most recent offset, to send again on reconnection.
+	void SetLatest(int64_t offset)
+	{
+		m_latestOffset.store(offset, std::memory_order_relaxed);
+		m_haveLatest.store(true, std::memory_order_release);
+	}
+
+	/// @brief Encode commands and write them to the server in one write,
+	///        noticing if the connection has been lost.
+	/// @param [in] commands Pairs of (op, value), in host byte order.
+	/// @param [in] count Number of pairs.
+	/// @param [in] replayed True if the commands only set offsets, so that with
+	///             autoReconnect it is enough for the latest one to be sent
+	///             once the connection is back.
+	/// @return True if the commands were written or, if replayed, will be
+	///         covered by the offset sent on reconnection.  False otherwise.
+	bool WriteToServer(const int64_t* commands, size_t count, bool replayed);
+};
+
+TimeWarpClient::TimeWarpClientPrivate::~TimeWarpClientPrivate()
+{
+	if (m_pingThread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(m_ackMutex);
+			m_stopPinging = true;
+		}
+		m_ackWake.notify_all();
+		m_pingThread.join();
+	}
+
+	// Let the send thread write whatever is still queued before it quits.
+	if (m_sendThread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(m_queueMutex);
+			m_stopSending = true;
+		}
+		m_queueWake.notify_one();
+		m_sendThread.join();
+	}
+	m_quitSignal.Signal();
+	if (m_recoveryThread.joinable()) {
+		m_recoveryThread.join();
+	}
+	if (m_ackThread.joinable()) {
+		m_ackThread.join();
+	}
+	if (m_connectionThread.joinable()) {
+		m_connectionThread.join();
+	}
+	if (m_recoveryListen != BAD_SOCKET) {
+		CoreSocket::close_socket(m_recoveryListen);
+	}
+	if (m_socket != BAD_SOCKET) {
+		CoreSocket::close_socket(m_socket);
+	}
+}
+
+bool TimeWarpClient::TimeWarpClientPrivate::WriteToServer(const int64_t* commands, size_t count, bool replayed)
+{
+	// Small batches are encoded on the stack so that sending offsets does
+	// not allocate.
+	const size_t STACK_COMMANDS = 256;
+	char stackBuffer[STACK_COMMANDS * WireEncoder::MAX_COMMAND_SIZE];
+	std::vector<char> heapBuffer;
+	char* data = stackBuffer;
+	if (count > STACK_COMMANDS) {
+		heapBuffer.resize(count * WireEncoder::MAX_COMMAND_SIZE);
+		data = heapBuffer.data();
+	}
+
+	std::lock_guard<std::mutex> lock(m_writeMutex);
+	if (m_socket == BAD_SOCKET) {
+		return m_reconnect && !m_gaveUp && replayed;
+	}
+	size_t len = m_encoder.Encode(commands, count, data);
+	if (static_cast<int>(len) == CoreSocket::noint_block_write(m_socket, data, len)) {
+		return true;
+	}
+	if (!m_reconnect) {
+		return false;
+	}
+
+	// Hand the broken connection back to the connection thread.
+	shutdown(m_socket, SHUT_RDWR);
+	m_socket = BAD_SOCKET;
+	m_connected = false;
+	m_protocolVersion = 0;
+	return replayed;
+}
+
+SOCKET TimeWarpClient::TimeWarpClientPrivate::Connect(std::string& error, int64_t& caps)
+{
+	caps = 0;
+	SOCKET sock = BAD_SOCKET;
+	if (m_endpoint.m_transport == Endpoint::UNIX) {
+#ifdef TIMEWARP_USE_LOCAL_TRANSPORTS
+		sock = open_unix_socket(m_endpoint.m_path, false, error);
+#else
+		error = "Unix sockets are not supported on this platform";
+#endif
+		if (sock == BAD_SOCKET) {
+			return BAD_SOCKET;
+		}
+	} else {
+		const char* nicName = nullptr;
+		if (m_cardIP.size() > 0) { nicName = m_cardIP.c_str(); }
+		if (!CoreSocket::connect_tcp_to(m_endpoint.m_host.c_str(), m_port, nicName, &sock)) {
+			error = "Could not connect to requested TCP port";
+			return BAD_SOCKET;
+		}
+	}
+
+	// Try to send the magic cookie, telling the server our version.
+	size_t len = MagicCookie.size();
+	if (len != CoreSocket::noint_block_write(sock, MagicCookie.c_str(), len)) {
+		error = "Could not write magic cookie";
+		CoreSocket::close_socket(sock);
+		return BAD_SOCKET;
+	}
+
+	// Try to read the magic cookie from the server and see if it matches what
+	// we're expecting.  Time out if we don't hear back soon enough.
+	std::vector<char> cookie(len);
+	if (static_cast<int>(len) != read_timeout(sock, cookie.data(), len,
+			static_cast<int>(m_options.handshakeTimeout * 1e3))) {
+		error = "Could not read magic cookie";
+		CoreSocket::close_socket(sock);
+		return BAD_SOCKET;
+	}
+	if (0 != memcmp(cookie.data(), MagicCookie.c_str(), len)) {
+		error = "Bad magic cookie from server";
+		CoreSocket::close_socket(sock);
+		return BAD_SOCKET;
+	}
+
+	// See which capabilities the server offers, if any, and tell it which of
+	// them we'll use.  Servers that only speak version 1 send nothing more.
+	if (m_options.protocolVersion >= 2) {
+		int64_t offer[2];
+		int got = read_timeout(sock, reinterpret_cast<char*>(offer), sizeof(offer),
+			NEGOTIATION_TIMEOUT_US / 1000);
+		if (got == static_cast<int>(sizeof(offer)) && CoreSocket::ntoh(offer[0]) == OP_CAPS) {
+			caps = CoreSocket::ntoh(offer[1]) & CAP_COMPACT;
+			if (caps && m_options.deltaEncoding) {
+				caps |= CoreSocket::ntoh(offer[1]) & CAP_DELTA;
+			}
+			caps |= CoreSocket::ntoh(offer[1]) & (CAP_CHANNELS | CAP_CLOCK);
+		} else if (got != 0) {
+			error = "Bad capabilities from server";
+			CoreSocket::close_socket(sock);
+			return BAD_SOCKET;
+		}
+		if (caps) {
+			int64_t use[2] = { CoreSocket::hton(OP_CAPS), CoreSocket::hton(caps) };
+			if (static_cast<int>(sizeof(use)) != CoreSocket::noint_block_write(sock,
+					reinterpret_cast<const char*>(use), sizeof(use))) {
+				error = "Could not write capabilities";
+				CoreSocket::close_socket(sock);
+				return BAD_SOCKET;
+			}
+		}
+	}
+
+	// Each offset is a small message that should go out right away rather
+	// than waiting to be combined with later ones.
+	if (m_endpoint.m_transport == Endpoint::TCP) {
+		int one = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+			reinterpret_cast<const char*>(&one), sizeof(one));
+	}
+	return sock;
+}
+
+void TimeWarpClient::TimeWarpClientPrivate::ConnectionThread()
+{
+	SOCKET quit = m_quitSignal.Fd();
+	auto delay = std::chrono::duration<double>(m_options.reconnectInitialDelay);
+	bool first = m_options.connectAsync;
+	while (true) {
+		SOCKET sock;
+		{
+			std::lock_guard<std::mutex> lock(m_writeMutex);
+			sock = m_socket;
+		}
+		bool replayed = true;
+
+		// Keep trying to connect, waiting longer after each failure.
+		if (sock == BAD_SOCKET) {
+			std::string error;
+			int64_t caps;
+			sock = Connect(error, caps);
+			if (sock == BAD_SOCKET) {
+				if (!m_options.autoReconnect) {
+					AddError(error);
+					m_gaveUp = true;
+					NotifyConnection();
+					return;
+				}
+				if (wait_readable(&quit, 1, static_cast<int>(
+						std::chrono::duration_cast<std::chrono::milliseconds>(delay).count())) != 0) {
+					return;
+				}
+				delay = std::min(delay * 2, std::chrono::duration<double>(m_options.reconnectMaxDelay));
+				continue;
+			}
+			delay = std::chrono::duration<double>(m_options.reconnectInitialDelay);
+
+			// The new server numbers its offsets afresh.
+			{
+				std::lock_guard<std::mutex> lock(m_subscribeMutex);
+				for (auto& s : m_subscribers) {
+					s.second.m_lastPushed = 0;
+				}
+			}
+
+			// Catch the server up with the latest offset and renew any
+			// subscription before anyone else can write to the new connection.
+			std::lock_guard<std::mutex> lock(m_writeMutex);
+			UseSocket(sock, caps);
+			int64_t commands[4];
+			size_t count = 0;
+			if (m_haveLatest.load(std::memory_order_acquire)) {
+				commands[2 * count] = OP_SET_TIME;
+				commands[2 * count + 1] = m_latestOffset.load(std::memory_order_relaxed);
+				count++;
+			}
+			if (m_subscribed) {
+				commands[2 * count] = OP_SUBSCRIBE;
+				commands[2 * count + 1] = 1;
+				count++;
+			}
+			char buffer[2 * WireEncoder::MAX_COMMAND_SIZE];
+			size_t len = m_encoder.Encode(commands, count, buffer);
+			if (len > 0 && static_cast<int>(len) != CoreSocket::noint_block_write(sock, buffer, len)) {
+				// Drop the connection as if it had been lost, so that we
+				// try again rather than carry on without the latest offset.
+				AddError("Could not catch up server on new connection");
+				replayed = false;
+			} else {
+				if (!first) {
+					m_reconnects++;
+				}
+				first = false;
+				NotifyConnection();
+			}
+		}
+
+		bool quitting = replayed ? ReadFromServer(sock) : false;
+		{
+			std::lock_guard<std::mutex> lock(m_writeMutex);
+			if (m_socket == sock) {
+				m_socket = BAD_SOCKET;
+				m_connected = false;
+				m_protocolVersion = 0;
+			}
+		}
+		CoreSocket::close_socket(sock);
+		if (quitting) {
+			return;
+		}
+
+		// Acknowledgements that were outstanding on the lost connection will
+		// never arrive; let anyone waiting for them know.
+		{
+			std::lock_guard<std::mutex> lock(m_ackMutex);
+			m_ackSent.clear();
+			m_ackWake.notify_all();
+		}
+
+		// A client that only connected in the background doesn't try again.
+		if (!m_options.autoReconnect) {
+			AddError("Connection to server lost");
+			m_gaveUp = true;
+			NotifyConnection();
+			return;
+		}
+	}
+}
+
+void TimeWarpClient::TimeWarpClientPrivate::AckThread()
+{
+	if (!ReadFromServer(m_socket)) {
+		AddError("Connection to server lost while waiting for acknowledgements");
+	}
+	std::lock_guard<std::mutex> lock(m_ackMutex);
+	m_ackReaderDone = true;
+	m_ackWake.notify_all();
+}
+
+bool TimeWarpClient::TimeWarpClientPrivate::ReadFromServer(SOCKET sock)
+{
+	SOCKET waitOn[2] = { sock, m_quitSignal.Fd() };
+	char buffer[ACK_SIZE * 128];
+	size_t have = 0;
+	while (true) {
+		int ready = wait_readable(waitOn, 2, -1);
+		if (ready < 0) {
+			return false;
+		}
+		if (ready & 2) {
+			return true;
+		}
+		if (!(ready & 1)) {
+			continue;
+		}
+		int got = recv(sock, buffer + have, static_cast<int>(sizeof(buffer) - have), 0);
+		if (got <= 0) {
+			return false;
+		}
+		int64_t now = monotonic_ns();
+		have += got;
+
+		// Offsets from a subscription are collected here and passed on once
+		// m_ackMutex has been released.
+		int64_t pushed[2 * sizeof(buffer) / ACK_SIZE];
+		size_t pushes = 0;
+		{
+			std::lock_guard<std::mutex> lock(m_ackMutex);
+			size_t used = 0;
+			while (have - used >= CAPS_SIZE) {
+				// Capabilities we didn't ask to use are only CAPS_SIZE long.
+				int64_t v[4];
+				memcpy(v, buffer + used, CAPS_SIZE);
+				if (CoreSocket::ntoh(v[0]) == OP_CAPS) {
+					used += CAPS_SIZE;
+					continue;
+				}
+				if (have - used < ACK_SIZE) {
+					break;
+				}
+				memcpy(v, buffer + used, ACK_SIZE);
+				used += ACK_SIZE;
+				for (size_t i = 0; i < 4; i++) {
+					v[i] = CoreSocket::ntoh(v[i]);
+				}
+
+				if (v[0] == OP_OFFSET) {
+					if (v[1] == 0) {
+						pushed[2 * pushes] = v[2];
+						pushed[2 * pushes + 1] = v[3];
+						pushes++;
+					} else {
+						m_queryReplies[v[1]] = std::make_pair(v[2], v[3]);
+						if (m_queryReplies.size() > ACK_HISTORY) {
+							m_queryReplies.erase(m_queryReplies.begin());
+						}
+					}
+					continue;
+				}
+				if (v[0] == OP_PONG) {
+					// The server's clock minus ours is the average of its
+					// lead over us on the way there and on the way back.
+					int64_t wallNow = wall_us();
+					std::pair<int64_t, int64_t> sample;
+					sample.first = std::max<int64_t>(0, (wallNow - v[1]) - (v[3] - v[2]));
+					sample.second = ((v[2] - v[1]) + (v[3] - wallNow)) / 2;
+					m_clockSamples[m_pongs++ % CLOCK_SAMPLES] = sample;
+					size_t n = std::min<uint64_t>(m_pongs, CLOCK_SAMPLES);
+					size_t best = 0;
+					for (size_t i = 1; i < n; i++) {
+						if (m_clockSamples[i].first < m_clockSamples[best].first) {
+							best = i;
+						}
+					}
+					m_clockDelay = m_clockSamples[best].first;
+					m_clockOffset = m_clockSamples[best].second;
+					continue;
+				}
+				if (v[0] != OP_ACK) {
+					AddError("Unexpected op code from server: " + std::to_string(v[0]));
+					continue;
+				}
+				TimeWarpAck ack;
+				ack.sequence = v[1];
+				ack.applyNs = v[3] - v[2];
+				auto sent = m_ackSent.find(ack.sequence);
+				if (sent == m_ackSent.end()) {
+					continue;
+				}
+				ack.roundTripNs = now - sent->second;
+				m_ackSent.erase(sent);
+
+				m_ackRoundTrip.Add(ack.roundTripNs);
+				m_ackApply.Add(ack.applyNs);
+				m_acksReceived++;
+				m_acks[ack.sequence] = ack;
+				if (m_acks.size() > ACK_HISTORY) {
+					m_acks.erase(m_acks.begin());
+				}
+			}
+			memmove(buffer, buffer + used, have - used);
+			have -= used;
+			m_ackWake.notify_all();
+		}
+
+		// Skip offsets that arrive after newer ones; the server's dispatcher
+		// threads may publish them out of order.
+		if (pushes > 0) {
+			std::lock_guard<std::mutex> lock(m_subscribeMutex);
+			for (size_t i = 0; i < pushes; i++) {
+				for (auto& s : m_subscribers) {
+					if (pushed[2 * i] > s.second.m_lastPushed) {
+						s.second.m_lastPushed = pushed[2 * i];
+						s.second.m_callback(s.second.m_userData, pushed[2 * i + 1]);
+					}
+				}
+			}
+		}
+	}
+}
+
+bool TimeWarpClient::TimeWarpClientPrivate::SendOffsets(const int64_t* values, size_t count)
+{
+	if (m_options.multicast) {
+		return PublishMulticast(OP_SET_TIME, values, count);
+	}
+
+	// Shared memory only holds the latest offset.
+	if (UsingShm()) {
+		return WriteShm(values[count - 1]);
+	}
+
+	// Pack as many records as fit into a buffer on the stack and send each
+	// bufferful with a single write.
+	SetLatest(values[count - 1]);
+	const size_t CHUNK = 256;
+	int64_t buffer[2 * CHUNK];
+	for (size_t done = 0; done < count; ) {
+		size_t n = count - done < CHUNK ? count - done : CHUNK;
+		for (size_t i = 0; i < n; i++) {
+			buffer[2 * i] = OP_SET_TIME;
+			buffer[2 * i + 1] = values[done + i];
+		}
+		if (!WriteToServer(buffer, n, true)) {
+			return false;
+		}
+		done += n;
+	}
+	return true;
+}
+
+int64_t TimeWarpClient::TimeWarpClientPrivate::Enqueue(const int64_t* values, size_t count)
+{
+	int64_t seq = -1;
+	{
+		std::lock_guard<std::mutex> lock(m_queueMutex);
+		SetLatest(values[count - 1]);
+		for (size_t i = 0; i < count; i++) {
+			seq = ++m_lastSequence;
+			if (m_ringCount == m_ring.size()) {
+				if (m_options.overflowPolicy == TimeWarpOverflow::DROP_OLDEST) {
+					m_ringHead = (m_ringHead + 1) % m_ring.size();
+					m_ringCount--;
+					m_dropped++;
+				} else {
+					// Everything waiting is superseded by the new offset.
+					m_coalesced += m_ringCount;
+					m_ringCount = 0;
+				}
+			}
+			m_ring[(m_ringHead + m_ringCount) % m_ring.size()] = std::make_pair(seq, values[i]);
+			m_ringCount++;
+		}
+	}
+	m_queueWake.notify_one();
+	return seq;
+}
+
+void TimeWarpClient::TimeWarpClientPrivate::SendThread()
+{
+	std::vector<int64_t> values;
+	values.reserve(m_ring.size());
+	std::unique_lock<std::mutex> lock(m_queueMutex);
+	while (true) {
+		m_queueWake.wait(lock, [this]() { return m_stopSending || m_ringCount > 0; });
+		if (m_ringCount == 0) {
+			break;
+		}
+
+		// Take everything that is waiting and send it in as few writes as we can
+		// without holding the lock, so callers can keep adding entries.
+		values.clear();
+		for (size_t i = 0; i < m_ringCount; i++) {
+			values.push_back(m_ring[(m_ringHead + i) % m_ring.size()].second);
+		}
+		int64_t last = m_ring[(m_ringHead + m_ringCount - 1) % m_ring.size()].first;
+		m_ringHead = (m_ringHead + m_ringCount) % m_ring.size();
+		m_ringCount = 0;
+		lock.unlock();
+
+		if (!SendOffsets(values.data(), values.size())) {
+			AddError("Could not send queued offsets on socket");
+		}
+
+		lock.lock();
+		m_sentSequence = last;
+		m_sentWake.notify_all();
+	}
+}
+
+bool TimeWarpClient::TimeWarpClientPrivate::OpenMulticast(const std::string& group, uint16_t port,
+	const std::string& cardIP)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, group.c_str(), &addr.sin_addr) != 1) {
+		AddError("Bad multicast group address: " + group);
+		return false;
+	}
+	m_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (m_socket == BAD_SOCKET) {
+		AddError("Could not open multicast socket");
+		return false;
+	}
+
+	// Choose how far datagrams go and which card they leave from.
+	unsigned char ttl = static_cast<unsigned char>(m_options.multicastTTL);
+	setsockopt(m_socket, IPPROTO_IP, IP_MULTICAST_TTL, reinterpret_cast<const char*>(&ttl), sizeof(ttl));
+	if (!cardIP.empty()) {
+		struct in_addr nic;
+		if (inet_pton(AF_INET, cardIP.c_str(), &nic) != 1 ||
+			setsockopt(m_socket, IPPROTO_IP, IP_MULTICAST_IF, reinterpret_cast<const char*>(&nic), sizeof(nic)) != 0) {
+			AddError("Could not use card " + cardIP + " for multicast");
+			CoreSocket::close_socket(m_socket);
+			m_socket = BAD_SOCKET;
+			return false;
+		}
+	}
+	if (connect(m_socket, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+		AddError("Could not connect multicast socket to " + group);
+		CoreSocket::close_socket(m_socket);
+		m_socket = BAD_SOCKET;
+		return false;
+	}
+
+	// Listen for subscribers that missed datagrams, unless asked not to.
+	if (m_options.multicastRecoveryPort >= 0) {
+		m_recoveryPort = static_cast<uint16_t>(m_options.multicastRecoveryPort);
+		const char* nic = cardIP.empty() ? nullptr : cardIP.c_str();
+		m_recoveryListen = CoreSocket::open_tcp_socket(&m_recoveryPort, nic);
+		if (m_recoveryListen == BAD_SOCKET || listen(m_recoveryListen, 16) != 0 ||
+				m_quitSignal.Fd() == BAD_SOCKET) {
+			AddError("Could not open multicast recovery port");
+			if (m_recoveryListen != BAD_SOCKET) {
+				CoreSocket::close_socket(m_recoveryListen);
+				m_recoveryListen = BAD_SOCKET;
+			}
+			CoreSocket::close_socket(m_socket);
+			m_socket = BAD_SOCKET;
+			return false;
+		}
+		m_history.resize(MULTICAST_HISTORY);
+		m_recoveryThread = std::thread(&TimeWarpClientPrivate::RecoveryThread, this);
+	}
+	return true;
+}
+
+void TimeWarpClient::TimeWarpClientPrivate::PackMulticast(int64_t op, int64_t value,
+	int64_t (&fields)[5])
+{
+	// Number and record the offset together so the recovery thread never
+	// sees a sequence number whose history entry has not been stored yet.
+	int64_t seq;
+	{
+		std::lock_guard<std::mutex> lock(m_historyMutex);
+		seq = ++m_sequence;
+		if (!m_history.empty()) {
+			m_history[seq % m_history.size()] = std::make_pair(seq, value);
+		}
+	}
+	fields[0] = CoreSocket::hton(MULTICAST_COOKIE);
+	fields[1] = CoreSocket::hton(seq);
+	fields[2] = CoreSocket::hton(op);
+	fields[3] = CoreSocket::hton(value);
+	fields[4] = CoreSocket::hton(static_cast<int64_t>(
+		m_recoveryListen == BAD_SOCKET ? 0 : m_recoveryPort));
+}
+
+bool TimeWarpClient::TimeWarpClientPrivate::PublishMulticast(int64_t op, int64_t value)
+{
+	int64_t fields[5];
+	PackMulticast(op, value, fields);
+	int sent = send(m_socket, reinterpret_cast<const char*>(fields), sizeof(fields), 0);
+	return sent == static_cast<int>(sizeof(fields));
+}
+
+bool TimeWarpClient::TimeWarpClientPrivate::PublishMulticast(int64_t op, const int64_t* values,
+	size_t count)
+{
+#ifdef __linux__
+	// Hand the kernel a batch of datagrams per system call.
+	const size_t CHUNK = 64;
+	int64_t fields[CHUNK][5];
+	struct iovec iov[CHUNK];
+	struct mmsghdr msgs[CHUNK];
+	for (size_t done = 0; done < count; ) {
+		size_t n = count - done < CHUNK ? count - done : CHUNK;
+		memset(msgs, 0, n * sizeof(msgs[0]));
+		for (size_t i = 0; i < n; i++) {
+			PackMulticast(op, values[done + i], fields[i]);
+			iov[i].iov_base = fields[i];
+			iov[i].iov_len = sizeof(fields[i]);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		size_t sent = 0;
+		while (sent < n) {
+			int ret = sendmmsg(m_socket, &msgs[sent], static_cast<unsigned>(n - sent), 0);
+			if (ret < 0) {
+				if (errno == EINTR) { continue; }
+				return false;
+			}
+			sent += ret;
+		}
+		done += n;
+	}
+	return true;
+#else
+	for (size_t i = 0; i < count; i++) {
+		if (!PublishMulticast(op, values[i])) {
+			return false;
+		}
+	}
+	return true;
+#endif
+}
+
+void TimeWarpClient::TimeWarpClientPrivate::RecoveryThread()
+{
+	SOCKET waitOn[2] = { m_recoveryListen, m_quitSignal.Fd() };
+	while (true) {
+		int ready = wait_readable(waitOn, 2, -1);
+		if (ready < 0 || (ready & 2)) {
+			break;
+		}
+		SOCKET s;
+		if (!(ready & 1) || CoreSocket::poll_for_accept(m_recoveryListen, &s, 0) != 1) {
+			continue;
+		}
+
+		// Read the first sequence number wanted and reply with all of the ones
+		// from there on that we still have, or just the latest if asked for 0.
+		int64_t fromSeq;
+		struct timeval timeout = { 0, 250000 };
+		if (sizeof(fromSeq) == CoreSocket::noint_block_read_timeout(s,
+				reinterpret_cast<char*>(&fromSeq), sizeof(fromSeq), &timeout)) {
+			fromSeq = CoreSocket::ntoh(fromSeq);
+			std::vector<int64_t> reply(1);
+			{
+				std::lock_guard<std::mutex> lock(m_historyMutex);
+				int64_t last = m_sequence;
+				int64_t first = fromSeq > 0 ? fromSeq : last;
+				int64_t oldest = last - static_cast<int64_t>(m_history.size()) + 1;
+				if (first < oldest) { first = oldest; }
+				if (first < 1) { first = 1; }
+				for (int64_t seq = first; seq <= last; seq++) {
+					const std::pair<int64_t, int64_t>& h = m_history[seq % m_history.size()];
+					if (h.first == seq) {
+						reply.push_back(CoreSocket::hton(h.first));
+						reply.push_back(CoreSocket::hton(h.second));
+					}
+				}
+			}
+			reply[0] = CoreSocket::hton(static_cast<int64_t>((reply.size() - 1) / 2));
+			CoreSocket::noint_block_write(s, reinterpret_cast<const char*>(reply.data()),
+				reply.size() * sizeof(int64_t));
+		}
+		CoreSocket::close_socket(s);
+	}
+}
+
+TimeWarpClient::TimeWarpClient(std::string hostName, uint16_t port, std::string cardIP)
+	: TimeWarpClient(hostName, TimeWarpClientOptions(), port, cardIP)
+{
+}
+
+TimeWarpClient::TimeWarpClient(std::string hostName, const TimeWarpClientOptions& options,
+	uint16_t port, std::string cardIP)
+{
+	// Connections shared by clients with the shareConnection option, keyed by
+	// host, port and card address.  Each lives as long as the clients using it.
+	static std::mutex g_poolMutex;
+	static std::map<std::string, std::weak_ptr<TimeWarpClientPrivate> > g_pool;
+
+	// Use a shared connection if there is a working one.  We hold the lock
+	// while opening a new one so that clients created at the same time share it.
+	std::unique_lock<std::mutex> poolLock(g_poolMutex, std::defer_lock);
+	std::string poolKey;
+	if (options.shareConnection && !options.multicast) {
+		poolKey = hostName + "\n" + std::to_string(port) + "\n" + cardIP;
+		poolLock.lock();
+		for (auto i = g_pool.begin(); i != g_pool.end(); ) {
+			if (i->second.expired()) {
+				i = g_pool.erase(i);
+			} else {
+				i++;
+			}
+		}
+		auto found = g_pool.find(poolKey);
+		if (found != g_pool.end()) {
+			m_private = found->second.lock();
+			if (m_private && m_private->CanSend()) {
+				return;
+			}
+		}
+	}
+
+	m_private = std::make_shared<TimeWarpClientPrivate>();
+	m_private->m_options = options;
+	m_private->m_port = port;
+	m_private->m_cardIP = cardIP;
+
+	if (options.asyncSend) {
+		m_private->m_ring.resize(options.sendQueueSize > 0 ? options.sendQueueSize : 1);
+	}
+
+	// Work out which transport to use.
+	Endpoint& endpoint = m_private->m_endpoint;
+	if (options.multicast) {
+		endpoint.m_host = hostName;
+	} else if (!parse_endpoint(hostName, endpoint)) {
+		m_private->AddError("Bad server URI: " + hostName);
+		return;
+	}
+	if (endpoint.m_port > 0) {
+		m_private->m_port = static_cast<uint16_t>(endpoint.m_port);
+	}
+	if (endpoint.m_transport == Endpoint::SHM) {
+#ifdef TIMEWARP_USE_LOCAL_TRANSPORTS
+		std::string error;
+		m_private->m_shm.reset(new ShmChannel());
+		if (!m_private->m_shm->Open(endpoint.m_path, error)) {
+			m_private->m_shm.reset();
+			m_private->AddError(error);
+			return;
+		}
+		if (options.asyncSend) {
+			m_private->m_sendThread = std::thread(&TimeWarpClientPrivate::SendThread, m_private.get());
+		}
+		if (poolLock.owns_lock()) {
+			g_pool[poolKey] = m_private;
+		}
+#else
+		m_private->AddError("Shared memory is not supported on this platform");
+#endif
+		return;
+	}
+	m_private->m_reconnect = (options.autoReconnect || options.connectAsync) && !options.multicast;
+
+	// Publish to a multicast group rather than connecting if asked to.
+	if (options.multicast) {
+		if (m_private->OpenMulticast(hostName, port, cardIP) && options.asyncSend) {
+			m_private->m_sendThread = std::thread(&TimeWarpClientPrivate::SendThread, m_private.get());
+		}
+		return;
+	}
+
+	// Connect to the requested socket, unless the connection thread is to do
+	// it.  When reconnecting automatically, a failure here is not an error;
+	// the connection thread keeps trying.
+	std::string error;
+	int64_t caps;
+	SOCKET sock = BAD_SOCKET;
+	if (!options.connectAsync) {
+		sock = m_private->Connect(error, caps);
+	}
+	if (sock != BAD_SOCKET) {
+		m_private->UseSocket(sock, caps);
+	}
+	if (m_private->m_reconnect) {
+		m_private->m_connectionThread = std::thread(&TimeWarpClientPrivate::ConnectionThread, m_private.get());
+	} else if (m_private->m_socket == BAD_SOCKET) {
+		m_private->AddError(error);
+		return;
+	}
+
+	if (options.asyncSend) {
+		m_private->m_sendThread = std::thread(&TimeWarpClientPrivate::SendThread, m_private.get());
+	}
+	if (options.clockSyncInterval > 0) {
+		m_private->m_pingThread = std::thread(&TimeWarpClientPrivate::PingThread, m_private.get());
+	}
+	if (poolLock.owns_lock()) {
+		g_pool[poolKey] = m_private;
+	}
+}
+
+TimeWarpClient::~TimeWarpClient()
+{
+	// Stop our subscription, if we have one, so that clients sharing our
+	// connection don't go on calling our callback.
+	if (m_private) {
+		bool subscribed;
+		{
+			std::lock_guard<std::mutex> lock(m_private->m_subscribeMutex);
+			subscribed = m_private->m_subscribers.count(this) > 0;
+		}
+		if (subscribed) {
+			Unsubscribe();
+		}
+	}
+	m_private.reset();
+}
+
+bool TimeWarpClient::SetTimeOffsetSchedule(const std::vector<ScheduledTimeOffset>& schedule)
+{
+	if (!m_private) {
+		return false;
+	}
+	if (!m_private->CanSend()) {
+		m_private->AddError("Attempted to set schedule on unconnected object");
+		return false;
+	}
+	if (m_private->m_options.multicast || m_private->UsingShm()) {
+		m_private->AddError("Schedules cannot be sent by multicast or shared memory");
+		return false;
+	}
+	if (schedule.empty() || schedule.size() > MaxScheduleEntries) {
+		m_private->AddError("Schedule must have between 1 and MaxScheduleEntries entries");
+		return false;
+	}
+
+	// Pack the op-code and count followed by a (time, offset) pair for
+	// each entry and send them in one write.
+	std::vector<int64_t> buffer;
+	buffer.reserve(2 * (schedule.size() + 1));
+	buffer.push_back(OP_SET_SCHEDULE);
+	buffer.push_back(static_cast<int64_t>(schedule.size()));
+	for (const ScheduledTimeOffset& e : schedule) {
+		buffer.push_back(e.wallTime);
+		buffer.push_back(e.timeOffset);
+	}
+
+	// Let any offsets queued before this reach the server first.
+	if (m_private->m_sendThread.joinable()) {
+		Flush(-1);
+	}
+	if (!m_private->WriteToServer(buffer.data(), buffer.size() / 2, false)) {
+		m_private->AddError("Could not send schedule on socket");
+		return false;
+	}
+
+	return true;
+}
+
+bool TimeWarpClient::SetTimeOffset(int64_t timeOffset)
+{
+	if (!m_private) {
+		return false;
+	}
+	if (!m_private->CanSend()) {
+		m_private->AddError("Attempted to set time on unconnected object");
+		return false;
+	}
+
+	if (m_private->m_sendThread.joinable()) {
+		m_private->Enqueue(timeOffset);
+		return true;
+	}
+
+	if (m_private->m_options.multicast) {
+		if (!m_private->PublishMulticast(OP_SET_TIME, timeOffset)) {
+			m_private->AddError("Could not send multicast datagram");
+			return false;
+		}
+		return true;
+	}
+	if (m_private->UsingShm()) {
+		if (!m_private->WriteShm(timeOffset)) {
+			m_private->AddError("Server using shared memory has shut down");
+			return false;
+		}
+		return true;
+	}
+
+	// Send the op-code to set the time offset followed by the time offset.
+	int64_t command[2] = { OP_SET_TIME, timeOffset };
+	m_private->SetLatest(timeOffset);
+	if (!m_private->WriteToServer(command, 1, true)) {
+		m_private->AddError("Could not send command on socket");
+		return false;
+	}
+
+	return true;
+}
+
+bool TimeWarpClient::SetTimeOffsets(const int64_t* timeOffsets, size_t count)
+{
+	if (!m_private) {
+		return false;
+	}
+	if (!m_private->CanSend()) {
+		m_private->AddError("Attempted to set time on unconnected object");
+		return false;
+	}
+	if (count == 0) {
+		return true;
+	}
+	if (!timeOffsets) {
+		m_private->AddError("Null offsets passed to SetTimeOffsets");
+		return false;
+	}
+
+	if (m_private->m_sendThread.joinable()) {
+		m_private->Enqueue(timeOffsets, count);
+		return true;
+	}
+	if (!m_private->SendOffsets(timeOffsets, count)) {
+		m_private->AddError("Could not send commands on socket");
+		return false;
+	}
+	return true;
+}
+
+bool TimeWarpClient::SetTimeOffsets(const std::vector<int64_t>& timeOffsets)
+{
+	return SetTimeOffsets(timeOffsets.data(), timeOffsets.size());
+}
+
+bool TimeWarpClient::SetChannelOffsets(const uint32_t* channels, const int64_t* timeOffsets, size_t count)
+{
+	if (!m_private) {
+		return false;
+	}
+	if (!m_private->CanSend()) {
+		m_private->AddError("Attempted to set time on unconnected object");
+		return false;
+	}
+	if (count == 0) {
+		return true;
+	}
+	if (!channels || !timeOffsets) {
+		m_private->AddError("Null pointer passed to SetChannelOffsets");
+		return false;
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (channels[i] >= MaxChannels) {
+			m_private->AddError("Bad channel passed to SetChannelOffsets: " + std::to_string(channels[i]));
+			return false;
+		}
+	}
+
+	// Offsets only for the main timeline go the usual way.
+	bool onlyMain = true;
+	for (size_t i = 0; i < count && onlyMain; i++) {
+		onlyMain = channels[i] == 0;
+	}
+	if (onlyMain) {
+		return SetTimeOffsets(timeOffsets, count);
+	}
+	if (m_private->m_options.multicast || m_private->UsingShm()) {
+		m_private->AddError("Channels cannot be sent by multicast or shared memory");
+		return false;
+	}
+	if (!m_private->m_channels) {
+		m_private->AddError("Server does not support channels");
+		return false;
+	}
+
+	// Select each channel only when it changes and go back to channel 0 at
+	// the end, so that every other command is for the main timeline.  All of
+	// it goes in one write so that nothing else can come in between.
+	std::vector<int64_t> buffer;
+	buffer.reserve(4 * count + 2);
+	uint32_t current = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (channels[i] != current) {
+			current = channels[i];
+			buffer.push_back(OP_CHANNEL);
+			buffer.push_back(current);
+		}
+		buffer.push_back(OP_SET_TIME);
+		buffer.push_back(timeOffsets[i]);
+		if (current == 0) {
+			m_private->SetLatest(timeOffsets[i]);
+		}
+	}
+	if (current != 0) {
+		buffer.push_back(OP_CHANNEL);
+		buffer.push_back(0);
+	}
+
+	// Let any offsets queued before this reach the server first.
+	if (m_private->m_sendThread.joinable()) {
+		Flush(-1);
+	}
+	if (!m_private->WriteToServer(buffer.data(), buffer.size() / 2, false)) {
+		m_private->AddError("Could not send channel offsets on socket");
+		return false;
+	}
+	return true;
+}
+
+bool TimeWarpClient::SetChannelOffset(uint32_t channel, int64_t timeOffset)
+{
+	return SetChannelOffsets(&channel, &timeOffset, 1);
+}
+
+int64_t TimeWarpClient::SetTimeOffsetAsync(int64_t timeOffset)
+{
+	if (!m_private) {
+		return -1;
+	}
+	if (!m_private->CanSend()) {
+		m_private->AddError("Attempted to set time on unconnected object");
+		return -1;
+	}
+	if (!m_private->m_sendThread.joinable()) {
+		m_private->AddError("SetTimeOffsetAsync() requires the asyncSend option");
+		return -1;
+	}
+	return m_private->Enqueue(timeOffset);
+}
+
+int64_t TimeWarpClient::SetTimeOffsetsAsync(const int64_t* timeOffsets, size_t count)
+{
+	if (!m_private) {
+		return -1;
+	}
+	if (!m_private->CanSend()) {
+		m_private->AddError("Attempted to set time on unconnected object");
+		return -1;
+	}
+	if (!m_private->m_sendThread.joinable()) {
+		m_private->AddError("SetTimeOffsetsAsync() requires the asyncSend option");
+		return -1;
+	}
+	if (count == 0 || !timeOffsets) {
+		m_private->AddError("No offsets passed to SetTimeOffsetsAsync");
+		return -1;
+	}
+	return m_private->Enqueue(timeOffsets, count);
+}
+
+int64_t TimeWarpClient::SetTimeOffsetAcked(int64_t timeOffset)
+{
+	if (!m_private) {
+		return -1;
+	}
+	if (!m_private->CanSend()) {
+		m_private->AddError("Attempted to set time on unconnected object");
+		return -1;
+	}
+	if (m_private->m_options.multicast || m_private->UsingShm()) {
+		m_private->AddError("Acknowledged offsets are not available by multicast or shared memory");
+		return -1;
+	}
+
+	// Let any offsets queued before this reach the server first.
+	if (m_private->m_sendThread.joinable()) {
+		Flush(-1);
+	}
+
+	// Note the request before sending it, so that the ack thread knows about
+	// it however quickly the server answers.
+	int64_t seq;
+	{
+		std::lock_guard<std::mutex> lock(m_private->m_ackMutex);
+		if (!m_private->StartReader()) {
+			m_private->AddError("Connection to server lost");
+			return -1;
+		}
+		seq = ++m_private->m_ackSequence;
+		m_private->m_ackSent[seq] = monotonic_ns();
+		if (m_private->m_ackSent.size() > ACK_HISTORY) {
+			m_private->m_ackSent.erase(m_private->m_ackSent.begin());
+		}
+	}
+
+	int64_t buffer[4] = { OP_REQUEST_ACK, seq, OP_SET_TIME, timeOffset };
+	m_private->SetLatest(timeOffset);
+	if (!m_private->WriteToServer(buffer, 2, false)) {
+		m_private->AddError("Could not send command on socket");
+		std::lock_guard<std::mutex> lock(m_private->m_ackMutex);
+		m_private->m_ackSent.erase(seq);
+		m_private->m_ackWake.notify_all();
+		return -1;
+	}
+	return seq;
+}
+
+bool TimeWarpClient::WaitForAck(int64_t sequence, double timeoutSeconds, TimeWarpAck* ack)
+{
+	if (!m_private) {
+		return false;
+	}
+	std::unique_lock<std::mutex> lock(m_private->m_ackMutex);
+	auto done = [&]() {
+		return m_private->m_ackReaderDone || m_private->m_acks.count(sequence) > 0 ||
+			(m_private->m_ackSent.count(sequence) == 0 && sequence <= m_private->m_ackSequence);
+	};
+	if (timeoutSeconds < 0) {
+		m_private->m_ackWake.wait(lock, done);
+	} else {
+		m_private->m_ackWake.wait_for(lock, std::chrono::duration<double>(timeoutSeconds), done);
 	}
-	if (listen(m_private->m_listen, 1)) {
-		m_private->m_errors.push_back("get_a_TCP_socket: listen() failed.");
-		CoreSocket::close_socket(m_private->m_listen);
-		m_private->m_listen = BAD_SOCKET;
-		return;
+	auto i = m_private->m_acks.find(sequence);
+	if (i == m_private->m_acks.end()) {
+		return false;
 	}
-
-	// Start a thread to accept connections on the listening socket.
-	m_private->m_listenThread = std::thread(ListenThread, m_private);
+	if (ack) {
+		*ack = i->second;
+	}
+	return true;
 }
 
-TimeWarpServer::~TimeWarpServer()
+bool TimeWarpClient::WaitForConnection(double timeoutSeconds)
 {
-	// Tell all of our sub-threads it is time to quit.
-	m_private->m_quit = true;
-
-	// Wait for the listening thread to quit, which will have waited for
-	// all of the accepting threads to have quit.
-	m_private->m_listenThread.join();
+	if (!m_private) {
+		return false;
+	}
+	if (!m_private->m_reconnect) {
+		return m_private->CanSend();
+	}
+	std::unique_lock<std::mutex> lock(m_private->m_connectMutex);
+	auto done = [&]() {
+		return m_private->m_connected || m_private->m_gaveUp;
+	};
+	if (timeoutSeconds < 0) {
+		m_private->m_connectWake.wait(lock, done);
+	} else {
+		m_private->m_connectWake.wait_for(lock, std::chrono::duration<double>(timeoutSeconds), done);
+	}
+	return m_private->m_connected;
 }
 
-/* Static */
-void TimeWarpServer::ListenThread(std::shared_ptr<TimeWarpServerPrivate> p)
+bool TimeWarpClient::RampTimeOffset(int64_t targetOffset, double durationSeconds, TimeWarpRampCurve curve)
 {
-	if (!p) { return; }
+	if (!m_private) {
+		return false;
+	}
+	if (!m_private->CanSend()) {
+		m_private->AddError("Attempted to ramp time on unconnected object");
+		return false;
+	}
+	if (m_private->m_options.multicast || m_private->UsingShm()) {
+		m_private->AddError("Ramps are not available by multicast or shared memory");
+		return false;
+	}
+	if (!(durationSeconds >= 0)) {
+		m_private->AddError("Negative ramp duration");
+		return false;
+	}
 
-	// Keep listening for connections.  When we get one, add it to the list.
-	while (!p->m_quit) {
-		SOCKET acceptSock;
-		int ret = CoreSocket::poll_for_accept(p->m_listen, &acceptSock, 0.01);
-		switch (ret) {
-			case 0:
-				break;
-			case 1:
-				{	std::lock_guard<std::mutex> lock(p->m_mutex);
-					p->m_acceptThreads[p->m_nextMapEntry] =
-						std::make_shared<TimeWarpServerPrivate::AcceptInfo>(
-							nullptr,
-							acceptSock);
-					// Start the thread only after the map entry is made to avoid
-					// having the thread running before its data is available.
-					p->m_acceptThreads[p->m_nextMapEntry]->m_thread =
-						std::make_shared<std::thread>(AcceptThread, p, p->m_nextMapEntry);
-					p->m_nextMapEntry++;
-				}
-				break;
+	// Let any offsets queued before this reach the server first.
+	if (m_private->m_sendThread.joinable()) {
+		Flush(-1);
+	}
+	int64_t command[4] = { OP_RAMP, targetOffset,
+		static_cast<int64_t>(std::llround(durationSeconds * 1e6)), static_cast<int64_t>(curve) };
+	m_private->SetLatest(targetOffset);
+	if (!m_private->WriteToServer(command, 2, false)) {
+		m_private->AddError("Could not send ramp on socket");
+		return false;
+	}
+	return true;
+}
 
-			default:
-				{	std::lock_guard<std::mutex> lock(p->m_mutex);
-					p->m_errors.push_back("Failure listenting on socket");
-				}
-				break;
-		}
+bool TimeWarpClient::QueryTimeOffset(int64_t& timeOffset, double timeoutSeconds)
+{
+	if (!m_private) {
+		return false;
+	}
+	if (!m_private->CanSend()) {
+		m_private->AddError("Attempted to query time on unconnected object");
+		return false;
+	}
+	if (m_private->m_options.multicast || m_private->UsingShm()) {
+		m_private->AddError("Queries are not available by multicast or shared memory");
+		return false;
+	}
 
-		// If any of the accept threads have completed, remove them from the map.
-		auto i = p->m_acceptThreads.begin();
-		{
-			std::lock_guard<std::mutex> lock(p->m_mutex);
-			while (i != p->m_acceptThreads.end()) {
-				if (i->second->m_done) {
-					i->second->m_thread->join();
-					// Delete the entry from the map and advance to the next entry
-					auto victim = i;
-					i++;
-					p->m_acceptThreads.erase(victim);
-				}
-				else {
-					i++;
-				}
-			}
+	int64_t request;
+	{
+		std::lock_guard<std::mutex> lock(m_private->m_ackMutex);
+		if (!m_private->StartReader()) {
+			m_private->AddError("Connection to server lost");
+			return false;
 		}
+		request = ++m_private->m_queryNumber;
+	}
+	int64_t command[2] = { OP_GET, request };
+	if (!m_private->WriteToServer(command, 1, false)) {
+		m_private->AddError("Could not send query on socket");
+		return false;
 	}
 
-	// Wait for all of the accept threads to quit and remove them from the map.
-	while (p->m_acceptThreads.size()) {
-		p->m_acceptThreads.begin()->second->m_thread->join();
-		p->m_acceptThreads.erase(p->m_acceptThreads.begin());
+	std::unique_lock<std::mutex> lock(m_private->m_ackMutex);
+	m_private->m_ackWake.wait_for(lock, std::chrono::duration<double>(timeoutSeconds), [&]() {
+		return m_private->m_ackReaderDone || m_private->m_queryReplies.count(request) > 0;
+	});
+	auto i = m_private->m_queryReplies.find(request);
+	if (i == m_private->m_queryReplies.end()) {
+		return false;
 	}
+	bool ret = (i->second.first != 0);
+	if (ret) {
+		timeOffset = i->second.second;
+	}
+	m_private->m_queryReplies.erase(i);
+	return ret;
 }
 
-void TimeWarpServer::AcceptThread(std::shared_ptr<TimeWarpServerPrivate> p, size_t i)
+bool TimeWarpClient::TimeWarpClientPrivate::Ping(double timeoutSeconds)
 {
-	if (!p) { return; }
-	std::shared_ptr<TimeWarpServerPrivate::AcceptInfo> info = p->m_acceptThreads[i];
-
+	uint64_t before;
 	{
-		// Try to send the magic cookie, telling the client our version.
-		size_t len = MagicCookie.size();
-		if (len != CoreSocket::noint_block_write(info->m_sock, MagicCookie.c_str(), len)) {
-			std::lock_guard<std::mutex> lock(p->m_mutex);
-			p->m_errors.push_back("Could not write magic cookie");
-			CoreSocket::close_socket(info->m_sock);
-			info->m_sock = BAD_SOCKET;
-			info->m_done = true;
-			return;
+		std::lock_guard<std::mutex> lock(m_ackMutex);
+		if (m_stopPinging || !StartReader()) {
+			return false;
 		}
+		before = m_pongs;
+	}
+	int64_t command[2] = { OP_PING, wall_us() };
+	if (!WriteToServer(command, 1, false)) {
+		return false;
+	}
+	std::unique_lock<std::mutex> lock(m_ackMutex);
+	return m_ackWake.wait_for(lock, std::chrono::duration<double>(timeoutSeconds), [&]() {
+		return m_ackReaderDone || m_stopPinging || m_pongs > before;
+	}) && m_pongs > before;
+}
 
-		// Try to read the magic cookie from the client and see if it matches what
-		// we're expecting.  Time out if we don't hear back within half a second.
-		std::vector<char> cookie(len);
-		struct timeval timeout = { 0, 500000 };
-		if (len != CoreSocket::noint_block_read_timeout(info->m_sock, cookie.data(), len, &timeout)) {
-			std::lock_guard<std::mutex> lock(p->m_mutex);
-			p->m_errors.push_back("Could not read magic cookie");
-			CoreSocket::close_socket(info->m_sock);
-			info->m_sock = BAD_SOCKET;
-			info->m_done = true;
-			return;
+void TimeWarpClient::TimeWarpClientPrivate::PingThread()
+{
+	std::chrono::duration<double> interval(m_options.clockSyncInterval);
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(m_ackMutex);
+			if (m_ackWake.wait_for(lock, interval, [&]() { return m_stopPinging; })) {
+				return;
+			}
 		}
-		if (0 != memcmp(cookie.data(), MagicCookie.c_str(), len)) {
-			std::lock_guard<std::mutex> lock(p->m_mutex);
-			p->m_errors.push_back("Bad magic cookie from server");
-			CoreSocket::close_socket(info->m_sock);
-			info->m_sock = BAD_SOCKET;
-			info->m_done = true;
-			return;
+		if (m_connected && m_clock) {
+			Ping(interval.count());
 		}
 	}
+}
 
-	// Keep reading until it is time to quit or we get an error.
-	size_t numRead = 0;
-	int64_t opLocal;
-	int64_t offLocal;
-	size_t len = sizeof(opLocal) + sizeof(offLocal);
-	std::vector<char> buffer(len);
-	while (!p->m_quit) {
-		// Poll to see if we can read another request until we get one or get an error.
-		struct timeval timeout = { 1, 1000 };
-		int got = CoreSocket::noint_block_read_timeout(info->m_sock, &(buffer.data()[numRead]),
-			len - numRead, &timeout);
-
-		// If it was an error, we're done.  This is not a global error, just a closed connection.
-		if (got == -1) {
+bool TimeWarpClient::SyncClock(size_t samples, double timeoutSeconds)
+{
+	if (!m_private) {
+		return false;
+	}
+	if (!m_private->CanSend()) {
+		m_private->AddError("Attempted to synchronize clocks on unconnected object");
+		return false;
+	}
+	if (m_private->m_options.multicast || m_private->UsingShm()) {
+		m_private->AddError("Clocks cannot be synchronized by multicast or shared memory");
+		return false;
+	}
+	if (!m_private->m_clock) {
+		m_private->AddError("Server does not answer clock synchronization pings");
+		return false;
+	}
+	for (size_t i = 0; i < samples; i++) {
+		if (!m_private->Ping(timeoutSeconds)) {
 			break;
 		}
-
-		// If we got a complete report, handle it and reset for the next one
-		// Otherwise, we just go around and read some more.
-		if (numRead + got == len) {
-			std::lock_guard<std::mutex> lock(p->m_mutex);
-			opLocal = CoreSocket::ntoh(*reinterpret_cast<int64_t*>(&buffer.data()[0]));
-			offLocal = CoreSocket::ntoh(*reinterpret_cast<int64_t*>(&buffer.data()[sizeof(opLocal)]));
-			p->m_callback(p->m_userData, offLocal);
-			numRead = 0;
-		}
 	}
-	
-	// Close my socket before quitting
-	CoreSocket::close_socket(info->m_sock);
-	info->m_done = true;
+	std::lock_guard<std::mutex> lock(m_private->m_ackMutex);
+	return m_private->m_pongs > 0;
 }
 
-std::vector<std::string> TimeWarpServer::GetErrorMessages()
+bool TimeWarpClient::GetClockOffset(int64_t& offsetUs, int64_t& delayUs)
 {
-	if (m_private) {
-		return m_private->m_errors;
+	if (!m_private) {
+		return false;
 	}
-	std::vector<std::string> errs = { "NULL private pointer in call to GetErrorMessages" };
-	return errs;
+	std::lock_guard<std::mutex> lock(m_private->m_ackMutex);
+	if (m_private->m_pongs == 0) {
+		return false;
+	}
+	offsetUs = m_private->m_clockOffset;
+	delayUs = m_private->m_clockDelay;
+	return true;
 }
 
-class atl::TimeWarp::TimeWarpClient::TimeWarpClientPrivate {
-public:
-	std::vector<std::string> m_errors;
-	SOCKET m_socket = BAD_SOCKET;
-};
-
-TimeWarpClient::TimeWarpClient(std::string hostName, uint16_t port, std::string cardIP)
+bool TimeWarpClient::SetTimeOffsetAt(int64_t timeOffset, int64_t wallTime)
 {
-	m_private.reset(new TimeWarpClientPrivate());
-
-	// Connect to the requested socket.
-	const char* nicName = nullptr;
-	if (cardIP.size() > 0) { nicName = cardIP.c_str(); }
-	if (!CoreSocket::connect_tcp_to(hostName.c_str(), port, nicName, &m_private->m_socket)) {
-		m_private->m_errors.push_back("Could not connect to requested TCP port");
-		m_private->m_socket = BAD_SOCKET;
-		return;
+	int64_t offset, delay;
+	if (!GetClockOffset(offset, delay)) {
+		if (m_private) {
+			m_private->AddError("SetTimeOffsetAt called before the clock was synchronized");
+		}
+		return false;
 	}
+	ScheduledTimeOffset e;
+	e.wallTime = wallTime + offset;
+	e.timeOffset = timeOffset;
+	return SetTimeOffsetSchedule({ e });
+}
 
-	// Try to send the magic cookie, telling the server our version.
-	size_t len = MagicCookie.size();
-	if (len != CoreSocket::noint_block_write(m_private->m_socket, MagicCookie.c_str(), len)) {
-		m_private->m_errors.push_back("Could not write magic cookie");
-		CoreSocket::close_socket(m_private->m_socket);
-		m_private->m_socket = BAD_SOCKET;
-		return;
+bool TimeWarpClient::Subscribe(TimeWarpSubscriberCallback callback, void* userData)
+{
+	if (!m_private) {
+		return false;
 	}
-
-	// Try to read the magic cookie from the server and see if it matches what
-	// we're expecting.  Time out if we don't hear back within half a second.
-	std::vector<char> cookie(len);
-	struct timeval timeout = { 0, 500000 };
-	int ret;
-	if (len != (ret = CoreSocket::noint_block_read_timeout(m_private->m_socket, cookie.data(), len, &timeout))) {
-		m_private->m_errors.push_back("Could not read magic cookie");
-		CoreSocket::close_socket(m_private->m_socket);
-		m_private->m_socket = BAD_SOCKET;
-		return;
+	if (!callback) {
+		m_private->AddError("Null callback passed to Subscribe");
+		return false;
 	}
-	if (0 != memcmp(cookie.data(), MagicCookie.c_str(), len)) {
-		m_private->m_errors.push_back("Bad magic cookie from server");
-		CoreSocket::close_socket(m_private->m_socket);
-		m_private->m_socket = BAD_SOCKET;
-		return;
+	if (!m_private->CanSend()) {
+		m_private->AddError("Attempted to subscribe on unconnected object");
+		return false;
+	}
+	if (m_private->m_options.multicast || m_private->UsingShm()) {
+		m_private->AddError("Subscriptions are not available by multicast or shared memory");
+		return false;
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_private->m_subscribeMutex);
+		TimeWarpClientPrivate::Subscriber& s = m_private->m_subscribers[this];
+		s.m_callback = callback;
+		s.m_userData = userData;
+		s.m_lastPushed = 0;
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_private->m_ackMutex);
+		if (!m_private->StartReader()) {
+			m_private->AddError("Connection to server lost");
+			return false;
+		}
 	}
-}
 
-TimeWarpClient::~TimeWarpClient()
-{
-	if (m_private->m_socket != BAD_SOCKET) {
-		CoreSocket::close_socket(m_private->m_socket);
+	// With autoReconnect, the subscription is sent on reconnection if we
+	// are not connected now.  If another client sharing the connection is
+	// already subscribed, this just has the server send the current offset
+	// again, which only our new subscription will not have seen.
+	m_private->m_subscribed = true;
+	int64_t command[2] = { OP_SUBSCRIBE, 1 };
+	if (!m_private->WriteToServer(command, 1, true)) {
+		m_private->AddError("Could not send subscription on socket");
+		return false;
 	}
-	m_private.reset();
+	return true;
 }
 
-bool TimeWarpClient::SetTimeOffset(int64_t timeOffset)
+bool TimeWarpClient::Unsubscribe()
 {
 	if (!m_private) {
 		return false;
 	}
-	if (m_private->m_socket == BAD_SOCKET) {
-		m_private->m_errors.push_back("Attempted to set time on unconnected object");
+	if (m_private->m_options.multicast || m_private->UsingShm()) {
+		return true;
+	}
+	{
+		// Leave the connection subscribed for other clients sharing it.
+		std::lock_guard<std::mutex> lock(m_private->m_subscribeMutex);
+		m_private->m_subscribers.erase(this);
+		if (!m_private->m_subscribers.empty()) {
+			return true;
+		}
+		m_private->m_subscribed = false;
+	}
+	int64_t command[2] = { OP_SUBSCRIBE, 0 };
+	if (!m_private->WriteToServer(command, 1, true)) {
+		m_private->AddError("Could not send unsubscription on socket");
 		return false;
 	}
+	return true;
+}
 
-	// Pack a 64-bit op-code to set the time offset followed by
-	// the 64-bit time offset into a buffer and send it.
-	int64_t opNet = CoreSocket::hton(OP_SET_TIME);
-	int64_t offNet = CoreSocket::hton(timeOffset);
-	size_t len = sizeof(opNet) + sizeof(offNet);
-	std::vector<char> buffer(len);
-	memcpy(&buffer[0], &opNet, sizeof(int64_t));
-	memcpy(&buffer[sizeof(opNet)], &offNet, sizeof(int64_t));
-
-	// Send the command
-	if (len != CoreSocket::noint_block_write(m_private->m_socket, buffer.data(), len)) {
-		m_private->m_errors.push_back("Could not send command on socket");
+bool TimeWarpClient::Flush(double timeoutSeconds)
+{
+	if (!m_private) {
 		return false;
 	}
+	if (!m_private->m_sendThread.joinable()) {
+		return true;
+	}
+	std::unique_lock<std::mutex> lock(m_private->m_queueMutex);
+	auto done = [this]() {
+		return m_private->m_ringCount == 0 &&
+			m_private->m_sentSequence == m_private->m_lastSequence;
+	};
+	if (timeoutSeconds < 0) {
+		m_private->m_sentWake.wait(lock, done);
+		return true;
+	}
+	return m_private->m_sentWake.wait_for(lock,
+		std::chrono::duration<double>(timeoutSeconds), done);
+}
 
-	return true;
+TimeWarpClientStats TimeWarpClient::GetStats()
+{
+	TimeWarpClientStats ret;
+	if (m_private) {
+		std::lock_guard<std::mutex> lock(m_private->m_queueMutex);
+		ret.queuedOffsets = m_private->m_ringCount;
+		ret.lastSequence = m_private->m_lastSequence;
+		ret.sentSequence = m_private->m_sentSequence;
+		ret.droppedOffsets = m_private->m_dropped;
+		ret.coalescedOffsets = m_private->m_coalesced;
+	}
+	if (m_private) {
+		std::lock_guard<std::mutex> lock(m_private->m_ackMutex);
+		ret.acksReceived = m_private->m_acksReceived;
+		ret.ackRoundTrip = m_private->m_ackRoundTrip;
+		ret.ackApply = m_private->m_ackApply;
+		ret.connected = m_private->m_connected;
+		ret.reconnects = m_private->m_reconnects;
+		ret.protocolVersion = m_private->m_protocolVersion;
+		ret.clockSamples = m_private->m_pongs;
+		ret.clockOffset = m_private->m_clockOffset;
+		ret.clockDelay = m_private->m_clockDelay;
+	}
+	return ret;
 }
 
 std::vector<std::string> TimeWarpClient::GetErrorMessages()
 {
 	if (m_private) {
+		std::lock_guard<std::mutex> lock(m_private->m_errorMutex);
 		return m_private->m_errors;
 	}
 	std::vector<std::string> errs = { "NULL private pointer in call to GetErrorMessages" };
@@ -333,44 +5318,253 @@ std::vector<std::string> TimeWarpClient::GetErrorMessages()
 }
 
 //===================================================================================
-// C API interface uses a map to store pointers that are used later so that it does
-// not have to return void * (which in C# is unsafe).
-static int g_lastIndex = 0;
-static std::map<int, std::shared_ptr<TimeWarpClient> > g_cliMap;
-static std::mutex d_cliMutex;
+// C API interface uses a table of handles rather than returning pointers,
+// so that it does not have to return void * (which in C# is unsafe) and so
+// that a stale or bogus handle is rejected rather than crashing.
+//
+// Each handle names a slot in a fixed array along with the generation of the
+// slot when the object was added, so a handle to a destroyed object fails
+// even if its slot has been reused.  Looking up a handle is lock-free: it
+// pins the object by bumping a reference count in the same atomic word as
+// the generation, and the object is deleted by whichever of Remove() and
+// the last unpin comes last.  Only adding and removing objects take a lock.
+template <class T>
+class HandleTable {
+public:
+	static const int SLOT_BITS = 12;
+	static const size_t SLOTS = size_t(1) << SLOT_BITS;
+	static const uint32_t GENERATION_MASK = 0x7FFFF;	///< Keeps handles positive
+
+	// A pinned object, which will not be deleted while this exists.
+	class Pin {
+	public:
+		Pin(HandleTable& table, int handle) : m_table(table)
+		{
+			m_obj = table.Acquire(handle, m_slot);
+		}
+		~Pin()
+		{
+			if (m_obj) { m_table.Release(m_slot); }
+		}
+		T* operator->() const { return m_obj; }
+		explicit operator bool() const { return m_obj != nullptr; }
+
+	private:
+		Pin(const Pin&) = delete;
+		Pin& operator=(const Pin&) = delete;
+		HandleTable&	m_table;
+		T*				m_obj;
+		size_t			m_slot = 0;
+	};
+
+	/// @brief Take ownership of an object and return a handle to it.
+	/// @return Handle on success, -1 (with the object deleted) if the table is full.
+	int Insert(T* obj)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		size_t slot;
+		if (!m_free.empty()) {
+			slot = m_free.back();
+			m_free.pop_back();
+		} else if (m_used < SLOTS) {
+			slot = m_used++;
+		} else {
+			delete obj;
+			return -1;
+		}
+		Slot& s = m_slots[slot];
+		s.m_obj.store(obj, std::memory_order_relaxed);
+		uint64_t gen = s.m_word.load(std::memory_order_relaxed) >> 32;
+		s.m_word.store((gen << 32) | LIVE, std::memory_order_release);
+		return static_cast<int>((gen << SLOT_BITS) | slot);
+	}
+
+	/// @brief Remove an object from the table.  It is deleted once nobody has
+	///        it pinned.
+	/// @return True if the handle was valid, false if not.
+	bool Remove(int handle)
+	{
+		size_t slot;
+		uint64_t gen;
+		if (!Decode(handle, slot, gen)) { return false; }
+		Slot& s = m_slots[slot];
+		uint64_t w = s.m_word.load(std::memory_order_acquire);
+		do {
+			if ((w >> 32) != gen || !(w & LIVE)) { return false; }
+		} while (!s.m_word.compare_exchange_weak(w, w & ~LIVE, std::memory_order_acq_rel));
+		if ((w & REFS) == 0) {
+			Free(slot);
+		}
+		return true;
+	}
+
+private:
+	static const uint64_t LIVE = uint64_t(1) << 31;
+	static const uint64_t REFS = LIVE - 1;
+
+	// The word holds the generation in the top half, then the live flag, then
+	// the number of pins.
+	struct Slot {
+		std::atomic<uint64_t>	m_word{ 0 };
+		std::atomic<T*>			m_obj{ nullptr };
+	};
+
+	static bool Decode(int handle, size_t& slot, uint64_t& gen)
+	{
+		if (handle < 0) { return false; }
+		slot = static_cast<size_t>(handle) & (SLOTS - 1);
+		gen = static_cast<uint64_t>(handle) >> SLOT_BITS;
+		return true;
+	}
+
+	T* Acquire(int handle, size_t& slot)
+	{
+		uint64_t gen;
+		if (!Decode(handle, slot, gen)) { return nullptr; }
+		Slot& s = m_slots[slot];
+		uint64_t w = s.m_word.load(std::memory_order_acquire);
+		do {
+			if ((w >> 32) != gen || !(w & LIVE)) { return nullptr; }
+		} while (!s.m_word.compare_exchange_weak(w, w + 1, std::memory_order_acq_rel));
+		return s.m_obj.load(std::memory_order_acquire);
+	}
+
+	void Release(size_t slot)
+	{
+		uint64_t w = m_slots[slot].m_word.fetch_sub(1, std::memory_order_acq_rel) - 1;
+		if ((w & REFS) == 0 && !(w & LIVE)) {
+			Free(slot);
+		}
+	}
+
+	// Delete the object in a slot that nobody can reach any more, and make the
+	// slot available with a new generation.
+	void Free(size_t slot)
+	{
+		Slot& s = m_slots[slot];
+		delete s.m_obj.exchange(nullptr, std::memory_order_acq_rel);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		uint64_t gen = ((s.m_word.load(std::memory_order_relaxed) >> 32) + 1) & GENERATION_MASK;
+		s.m_word.store(gen << 32, std::memory_order_release);
+		m_free.push_back(slot);
+	}
+
+	Slot				m_slots[SLOTS];
+	std::mutex			m_mutex;	///< Protects m_free and m_used
+	std::vector<size_t>	m_free;
+	size_t				m_used = 0;
+};
+
+static HandleTable<TimeWarpClient> g_clients;
+static HandleTable<TimeWarpServer> g_servers;
 
 int atl_TimeWarpClientCreate(const char* hostName, int port, const char* cardIP)
 {
-	std::lock_guard<std::mutex> lock(d_cliMutex);
 	if (port == -1) { port = DefaultPort; }
-	std::shared_ptr<TimeWarpClient> cli =
-		std::make_shared<TimeWarpClient>(hostName, static_cast<uint16_t>(port), cardIP);
+	std::unique_ptr<TimeWarpClient> cli(
+		new TimeWarpClient(hostName, static_cast<uint16_t>(port), cardIP));
+	if (cli->GetErrorMessages().size()) {
+		return -1;
+	}
+	return g_clients.Insert(cli.release());
+}
+
+int atl_TimeWarpClientCreateAsync(const char* hostName, int port, const char* cardIP, int queueSize)
+{
+	if (port == -1) { port = DefaultPort; }
+	TimeWarpClientOptions options;
+	options.asyncSend = true;
+	if (queueSize > 0) {
+		options.sendQueueSize = static_cast<size_t>(queueSize);
+	}
+	std::unique_ptr<TimeWarpClient> cli(
+		new TimeWarpClient(hostName, options, static_cast<uint16_t>(port), cardIP));
 	if (cli->GetErrorMessages().size()) {
 		return -1;
 	}
-	int index = g_lastIndex++;
-	g_cliMap[index] = cli;
-	return index;
+	return g_clients.Insert(cli.release());
 }
 
 bool atl_TimeWarpClientSetTimeOffset(int client, int64_t offset)
 {
-	std::lock_guard<std::mutex> lock(d_cliMutex);
-	if (client == -1) {
+	HandleTable<TimeWarpClient>::Pin cli(g_clients, client);
+	if (!cli) {
+		return false;
+	}
+	return cli->SetTimeOffset(offset);
+}
+
+bool atl_TimeWarpClientSetTimeOffsets(int client, const int64_t* offsets,
+	const int64_t* wallTimes, int count)
+{
+	HandleTable<TimeWarpClient>::Pin cli(g_clients, client);
+	if (!cli || count < 0) {
 		return false;
 	}
-	std::shared_ptr<TimeWarpClient> cli = g_cliMap[client];
-	if (cli == nullptr) {
+	// An empty schedule is an error to SetTimeOffsetSchedule(), but an empty
+	// batch is not, so treat it the same whether or not wall times are given.
+	if (!wallTimes || count == 0) {
+		return cli->SetTimeOffsets(offsets, static_cast<size_t>(count));
+	}
+	if (!offsets) {
 		return false;
 	}
-	return cli->SetTimeOffset(offset);
+	std::vector<ScheduledTimeOffset> schedule(static_cast<size_t>(count));
+	for (size_t i = 0; i < schedule.size(); i++) {
+		schedule[i].wallTime = wallTimes[i];
+		schedule[i].timeOffset = offsets[i];
+	}
+	return cli->SetTimeOffsetSchedule(schedule);
+}
+
+int64_t atl_TimeWarpClientSetTimeOffsetsAsync(int client, const int64_t* offsets, int count)
+{
+	HandleTable<TimeWarpClient>::Pin cli(g_clients, client);
+	if (!cli || count < 0) {
+		return -1;
+	}
+	return cli->SetTimeOffsetsAsync(offsets, static_cast<size_t>(count));
+}
+
+bool atl_TimeWarpClientFlush(int client, double timeoutSeconds)
+{
+	HandleTable<TimeWarpClient>::Pin cli(g_clients, client);
+	if (!cli) {
+		return false;
+	}
+	return cli->Flush(timeoutSeconds);
 }
 
 bool atl_TimeWarpClientDestroy(int client)
 {
-	std::lock_guard<std::mutex> lock(d_cliMutex);
-	if (client == -1) {
+	return g_clients.Remove(client);
+}
+
+int atl_TimeWarpServerCreate(int port, const char* cardIP,
+	TimeWarpServerCallback callback, void* userData)
+{
+	if (port == -1) { port = DefaultPort; }
+	if (!callback) {
+		return -1;
+	}
+	std::unique_ptr<TimeWarpServer> svr(
+		new TimeWarpServer(callback, userData, static_cast<uint16_t>(port), cardIP ? cardIP : ""));
+	if (svr->GetErrorMessages().size()) {
+		return -1;
+	}
+	return g_servers.Insert(svr.release());
+}
+
+bool atl_TimeWarpServerGetTimeOffset(int server, int64_t* offset)
+{
+	HandleTable<TimeWarpServer>::Pin svr(g_servers, server);
+	if (!svr || !offset) {
 		return false;
 	}
-	return (g_cliMap.erase(client) == 1);
+	return svr->GetTimeOffset(*offset);
+}
+
+bool atl_TimeWarpServerDestroy(int server)
+{
+	return g_servers.Remove(server);
 }
@@ -10,26 +10,597 @@
 #include <memory>
 #include <string>
 #include <vector>
+#include <array>
 #include <cstdint>
+#include <functional>
 
 namespace atl { namespace TimeWarp {
 
 	/// @brief Type definition for a TimeWarpServer callback function.
+	///
+	/// The callback is called from one of the server's dispatcher threads, never
+	/// from a thread that is reading from the network.  Offsets from a given
+	/// connection are delivered in order.  If more than one dispatcher thread
+	/// is requested, offsets from different connections may be delivered
+	/// concurrently.
 	/// @param [in] userData A (possibly Null) user-data pointer that was
 	///             passed in when the callback was registered.
 	/// @param [in] timeOffset The time offset to apply.  A negative value
 	///             is in the past and a positive value is in the future.
 	typedef void (*TimeWarpServerCallback)(void* userData, int64_t timeOffset);
 
+	/// @brief Number of timelines (channels) that one TimeWarpServer keeps.
+	///        Channel 0 is the main timeline, delivered to the callback passed
+	///        to the constructor; channels 1 through MaxChannels - 1 are extra
+	///        ones that clients set with TimeWarpClient::SetChannelOffsets().
+	static const uint32_t MaxChannels = 1 << 16;
+
+	/// @brief Type definition for a callback that receives the offsets for one
+	///        channel; see TimeWarpServer::SetChannelCallback().  It is called
+	///        from the dispatcher threads just like a TimeWarpServerCallback.
+	/// @param [in] userData The pointer passed to SetChannelCallback().
+	/// @param [in] channel The channel whose offset has changed.
+	/// @param [in] timeOffset The time offset to apply on that channel.
+	typedef void (*TimeWarpChannelCallback)(void* userData, uint32_t channel, int64_t timeOffset);
+
+	/// @brief Type of function a TimeWarpClient calls when the offset on the
+	///        server it has subscribed to changes; see TimeWarpClient::Subscribe().
+	///
+	/// It is called from the client's thread that reads from the network, so it
+	/// should return quickly.  It must not destroy the client or call its
+	/// Subscribe() or Unsubscribe().
+	/// @param [in] userData The pointer passed to Subscribe().
+	/// @param [in] timeOffset The offset the server has just delivered to its callback.
+	typedef void (*TimeWarpSubscriberCallback)(void* userData, int64_t timeOffset);
+
+	/// @brief What caused a TimeWarpServer to deliver an offset.
+	enum class TimeWarpUpdateKind {
+		SET_TIME,		///< A client set it directly
+		SCHEDULED,		///< An entry in a schedule came due
+		RAMP			///< A step along a ramp requested by a client
+	};
+
+	/// @brief Everything a TimeWarpServer knows about an offset it delivers to
+	///        a TimeWarpUpdateHandler.
+	struct TimeWarpUpdate {
+		/// @brief Identifier of the connection the offset came from, unique for
+		///        the life of the server.  Each multicast publisher and each
+		///        shared-memory endpoint counts as one connection.
+		size_t connection = 0;
+
+		/// @brief What caused the offset to be delivered.
+		TimeWarpUpdateKind kind = TimeWarpUpdateKind::SET_TIME;
+
+		/// @brief The time offset to apply.
+		int64_t timeOffset = 0;
+
+		/// @brief When the server received the offset (or generated it, for
+		///        schedules and ramps), in nanoseconds on std::chrono::steady_clock.
+		///        When offsets are coalesced, this is when the first of them arrived.
+		int64_t receivedNs = 0;
+
+		/// @brief Number of offsets the server has delivered on this channel,
+		///        counting this one.  For channel 0 this is the same sequence
+		///        that subscribers see.
+		uint64_t sequence = 0;
+
+		/// @brief Channel the offset is for; 0 for the main timeline.
+		uint32_t channel = 0;
+	};
+
+	/// @brief Type of callable that a TimeWarpServer can deliver offsets to,
+	///        with the same threading rules as a TimeWarpServerCallback.  The
+	///        update is only valid during the call.
+	typedef std::function<void(const TimeWarpUpdate& update)> TimeWarpUpdateHandler;
+
 	/// @brief Standard port for a TimeWarpServer
 	static const uint16_t DefaultPort = 2984;
 
+	/// @brief Largest number of entries in a schedule sent by
+	///        TimeWarpClient::SetTimeOffsetSchedule().
+	static const size_t MaxScheduleEntries = 1 << 20;
+
+	/// @brief A time offset to be applied at a particular time.
+	struct ScheduledTimeOffset {
+		/// @brief When the offset should be applied, in microseconds since the
+		///        Unix epoch (std::chrono::system_clock) on the server's clock.
+		///        Times in the past are applied right away.
+		int64_t wallTime;
+
+		/// @brief The time offset to apply; positive is in the future and
+		///        negative is in the past.
+		int64_t timeOffset;
+	};
+
+	/// @brief How a TimeWarpServer delivers offsets that arrive faster than
+	///        the callback handles them.
+	enum class TimeWarpDelivery {
+		EVERY_OFFSET,			///< Call the callback once for every offset received
+		LATEST_PER_CONNECTION,	///< Skip to the newest pending offset from each connection
+		LATEST_GLOBAL			///< Skip to the newest pending offset from any connection
+	};
+
+	/// @brief What a TimeWarpServer does with offsets from a connection that is
+	///        sending faster than TimeWarpServerOptions::maxOffsetsPerSecond.
+	enum class TimeWarpRateLimitPolicy {
+		DROP,			///< Discard them
+		COALESCE,		///< Deliver the newest of them once the connection is back within its limit
+		DISCONNECT		///< Close the connection
+	};
+
+	/// @brief Optional settings that control how a TimeWarpServer handles its
+	///        connections.  The defaults match the behavior of the constructor
+	///        that does not take an options structure.
+	struct TimeWarpServerOptions {
+		/// @brief Multiplex the listening socket and all client connections onto
+		///        a fixed number of event-loop threads rather than starting a new
+		///        thread for each connection.  This lets a single server handle
+		///        thousands of clients.  Only available on Linux (epoll); other
+		///        platforms use one thread per connection regardless.
+		bool useEventLoop = false;
+
+		/// @brief Number of event-loop threads to run when useEventLoop is set.
+		///        Connections are spread across them as they are accepted.
+		unsigned eventLoopThreads = 1;
+
+		/// @brief Number of connections that the operating system will hold for
+		///        the server before it accepts them, so that a burst of clients
+		///        reconnecting at once is queued rather than refused.  0 uses the
+		///        largest value the system allows (SOMAXCONN).
+		int listenBacklog = 0;
+
+		/// @brief Number of threads accepting connections on the TCP port when
+		///        not using the event loop (whose threads all accept already).
+		unsigned acceptThreads = 1;
+
+		/// @brief Give each accept thread a listening socket of its own, bound to
+		///        the same port with SO_REUSEPORT so that the operating system
+		///        spreads new connections across them.  This also lets several
+		///        server processes share a port.  Where SO_REUSEPORT is not
+		///        available, the accept threads share one socket instead.
+		bool reusePort = false;
+
+		/// @brief Seconds that a new connection has to complete its handshake
+		///        before it is dropped.  Handshakes are carried out by the threads
+		///        that accept connections, many at a time, so a slow or silent
+		///        peer holds nothing but its socket while it waits.
+		double handshakeTimeout = 0.5;
+
+		/// @brief Number of threads that deliver received offsets to the callback.
+		///        Each connection is always handled by the same dispatcher.
+		unsigned dispatchThreads = 1;
+
+		/// @brief Number of received offsets that can wait for each dispatcher
+		///        thread before the network threads stop reading and let
+		///        back-pressure build in the sockets.  Rounded up to a power of 2.
+		size_t dispatchQueueSize = 4096;
+
+		/// @brief Most offsets per second that each connection (or multicast
+		///        publisher, or shm:// endpoint) can have delivered to the
+		///        callback, so that a client sending as fast as it can cannot
+		///        monopolize it.  0 for no limit.  Each connection has a bucket
+		///        of rateLimitBurst tokens that refills at this rate, and each
+		///        offset it sends (OP_SET_TIME, on any channel) takes a token.
+		///        Schedules and ramps are not limited.
+		double maxOffsetsPerSecond = 0;
+
+		/// @brief Number of offsets that a connection that has been quiet can
+		///        send at once before the limit applies.
+		double rateLimitBurst = 16;
+
+		/// @brief What to do with offsets from a connection that has no tokens.
+		///        COALESCE keeps the newest offset for the main timeline and
+		///        delivers it as soon as a token is available; offsets for other
+		///        channels are dropped.  No acknowledgement is sent for offsets
+		///        that are dropped or coalesced.
+		TimeWarpRateLimitPolicy rateLimitPolicy = TimeWarpRateLimitPolicy::COALESCE;
+
+		/// @brief Most client connections, including Unix-domain ones, to have
+		///        open at once.  Connections beyond that are reset as soon as
+		///        they are accepted, before reading anything from them.  0 for
+		///        no limit.
+		size_t maxConnections = 0;
+
+		/// @brief Whether the callback sees every offset or only the newest one
+		///        that is pending when a dispatcher gets to it.  When only the
+		///        newest offset matters (a scrubbing UI, for example), the
+		///        LATEST modes keep the callback from falling behind.
+		TimeWarpDelivery delivery = TimeWarpDelivery::EVERY_OFFSET;
+
+		/// @brief Multicast group (such as "239.255.29.84") to join, receiving
+		///        offsets published by TimeWarpClients in multicast mode on the
+		///        server's port.  Empty to not use multicast.  One publisher can
+		///        then reach any number of servers with a single datagram.
+		std::string multicastGroup;
+
+		/// @brief Address of a multicast publisher to ask for the current offset
+		///        when the server starts, so that a late joiner does not have to
+		///        wait for the next change.  Empty to not ask.
+		std::string multicastPublisherHost;
+
+		/// @brief TCP port that the publisher named by multicastPublisherHost
+		///        answers on (TimeWarpClientOptions::multicastRecoveryPort).
+		uint16_t multicastPublisherPort = DefaultPort + 1;
+
+		/// @brief Local endpoints to listen on as well as the TCP port, for
+		///        clients on the same machine, as URIs (POSIX systems only):
+		///        - "unix:///path/to/socket" accepts connections on a Unix-domain
+		///          socket, which behave just like TCP connections.  At most four.
+		///        - "shm://name" creates a shared-memory segment that clients
+		///          write offsets into directly, without the kernel network stack.
+		///          It only holds the latest offset, so if clients write faster
+		///          than the server reads, the server skips to the newest one.
+		///          Schedules and acknowledgements are not available over it.
+		std::vector<std::string> endpoints;
+
+		/// @brief How long a thread reading a shm:// endpoint keeps checking for
+		///        a new offset before going to sleep until it is woken by one.
+		///        Spinning costs a CPU but lets offsets arrive within a
+		///        microsecond when they come often.
+		unsigned shmSpinMicroseconds = 50;
+
+		/// @brief Number of offsets per second delivered to the callback while
+		///        ramping to an offset requested by TimeWarpClient::RampTimeOffset().
+		double rampUpdateRate = 240;
+
+		/// @brief Newest protocol version to offer clients.  Version 2 lets
+		///        clients that ask for it send compact variable-length messages
+		///        (see TimeWarpClientOptions::protocolVersion).  Version 1 servers
+		///        offer nothing, like servers from before version 2 existed.
+		int protocolVersion = 2;
+
+		/// @brief File to record every offset queued for the callback in, with
+		///        when it was queued, which connection it came from and why,
+		///        for diagnosis and for replaying (see ReadTimeWarpJournal()).
+		///        Empty to not keep one (POSIX systems only).  The file is
+		///        memory mapped and appended to by a thread of its own.  If it
+		///        already holds records, the server starts with the latest
+		///        offset on each channel in it as the one that GetTimeOffset()
+		///        and GetChannelOffset() report, without calling the callback.
+		std::string journalPath;
+
+		/// @brief Number of offsets that can wait to be written to the journal.
+		///        Offsets that arrive when it is full are not recorded, so that
+		///        a slow disk never holds up the network.
+		size_t journalQueueSize = 65536;
+	};
+
+	/// @brief Histogram of latencies in nanoseconds.  Each power of two is split
+	///        into four buckets, so percentiles are accurate to within 25%.
+	struct TimeWarpLatencyHistogram {
+		/// @brief Number of buckets; enough for any non-negative int64_t.
+		static const size_t Buckets = 256;
+
+		/// @brief Number of samples that fell into each bucket.
+		std::array<uint64_t, Buckets> buckets{};
+
+		uint64_t count = 0;		///< Number of samples
+		int64_t minNs = 0;		///< Smallest sample, 0 if there are none
+		int64_t maxNs = 0;		///< Largest sample, 0 if there are none
+		double sumNs = 0;		///< Sum of all samples
+
+		/// @brief Add a sample.  Negative latencies are counted as 0.
+		void Add(int64_t ns);
+
+		/// @brief Index of the bucket that a latency falls into.
+		static size_t Bucket(int64_t ns);
+
+		/// @brief Latency that the fraction p (0 to 1) of the samples are at or
+		///        below, rounded up to the top of its bucket.
+		/// @return Latency in nanoseconds, 0 if there are no samples.
+		int64_t Percentile(double p) const;
+
+		/// @brief Average latency in nanoseconds, 0 if there are no samples.
+		double Mean() const { return count ? sumNs / count : 0; }
+	};
+
+	/// @brief Snapshot of counters describing the state of a TimeWarpServer.
+	struct TimeWarpServerStats {
+		/// @brief Number of received offsets waiting to be delivered to the callback.
+		uint64_t dispatchQueueDepth = 0;
+
+		/// @brief Largest number of offsets that have been waiting at once in any
+		///        dispatcher's queue.  Reaching dispatchQueueSize means the callback
+		///        has been unable to keep up with the network.
+		uint64_t dispatchQueueHighWater = 0;
+
+		/// @brief Number of offsets that were replaced by a newer one before the
+		///        callback saw them, when using one of the LATEST delivery modes.
+		uint64_t coalescedOffsets = 0;
+
+		/// @brief Number of multicast datagrams that were detected as missing.
+		uint64_t multicastGaps = 0;
+
+		/// @brief Number of missed multicast offsets that were fetched from their
+		///        publisher over TCP and delivered.
+		uint64_t multicastRecovered = 0;
+
+		/// @brief Number of client connections that are currently open, including
+		///        those still exchanging magic cookies.
+		uint64_t activeConnections = 0;
+
+		/// @brief Number of client connections accepted since the server started.
+		uint64_t acceptedConnections = 0;
+
+		/// @brief Number of connections closed because the magic-cookie exchange
+		///        failed or timed out.
+		uint64_t handshakeFailures = 0;
+
+		/// @brief Number of offsets received, by TCP or multicast.
+		uint64_t setTimeMessages = 0;
+
+		/// @brief Number of schedules received, and the total number of entries in them.
+		uint64_t scheduleMessages = 0;
+		uint64_t scheduleEntries = 0;
+
+		/// @brief Number of requests to acknowledge an offset.
+		uint64_t ackRequests = 0;
+
+		/// @brief Number of messages with an unknown op code.  Each closes its
+		///        connection, except on connections using protocol version 2,
+		///        where they are skipped so that newer clients can talk to us.
+		uint64_t unknownMessages = 0;
+
+		/// @brief Number of connections that agreed to use protocol version 2.
+		uint64_t compactConnections = 0;
+
+		/// @brief Number of clock-synchronization pings answered.
+		uint64_t pings = 0;
+
+		/// @brief Number of connections reset because maxConnections were open.
+		uint64_t rejectedConnections = 0;
+
+		/// @brief Number of offsets over a connection's rate limit that were
+		///        dropped, that were replaced by a newer one under the COALESCE
+		///        policy, and number of connections closed for going over.
+		uint64_t rateLimitDropped = 0;
+		uint64_t rateLimitCoalesced = 0;
+		uint64_t rateLimitDisconnects = 0;
+
+		/// @brief Number of offsets written to the journal, the number that
+		///        could not be, and the number that were already in it when
+		///        the server started.
+		uint64_t journalRecords = 0;
+		uint64_t journalDropped = 0;
+		uint64_t journalRecovered = 0;
+
+		/// @brief Number of ramps requested, and the number of offsets generated
+		///        for them.
+		uint64_t ramps = 0;
+		uint64_t rampUpdates = 0;
+
+		/// @brief Number of requests from clients for the current offset.
+		uint64_t queries = 0;
+
+		/// @brief Number of connections currently subscribed to offset changes.
+		uint64_t subscribers = 0;
+
+		/// @brief Number of offsets received for channels other than 0, and the
+		///        number of those channels that have had an offset delivered.
+		uint64_t channelMessages = 0;
+		uint64_t channels = 0;
+
+		/// @brief Number of bytes received from clients after the magic cookie,
+		///        plus multicast datagrams.
+		uint64_t bytesReceived = 0;
+
+		/// @brief Number of times the callback has been called, and how long it took.
+		uint64_t callbacks = 0;
+		TimeWarpLatencyHistogram callbackDuration;
+
+		/// @brief Number of errors reported since the server started.  Only the
+		///        most recent ones are kept for GetErrorMessages().
+		uint64_t errors = 0;
+	};
+
+	/// @brief Acknowledgement of an offset sent with TimeWarpClient::SetTimeOffsetAcked().
+	struct TimeWarpAck {
+		/// @brief Sequence number that SetTimeOffsetAcked() returned.
+		int64_t sequence = 0;
+
+		/// @brief Nanoseconds from just before the client sent the offset until
+		///        the acknowledgement arrived.
+		int64_t roundTripNs = 0;
+
+		/// @brief Nanoseconds from when the server received the offset until the
+		///        callback it was delivered to returned, on the server's clock.
+		int64_t applyNs = 0;
+	};
+
+	/// @brief How a ramp started by TimeWarpClient::RampTimeOffset() moves from
+	///        the current offset to the target over its duration.
+	enum class TimeWarpRampCurve {
+		LINEAR,			///< At a constant rate
+		EASE_IN,		///< Starting slowly and speeding up
+		EASE_OUT,		///< Starting quickly and slowing down
+		EASE_IN_OUT		///< Speeding up and then slowing down, with no sudden changes of rate
+	};
+
+	/// @brief What an asynchronous TimeWarpClient does when more offsets are
+	///        queued than it has room for.
+	enum class TimeWarpOverflow {
+		DROP_OLDEST,			///< Discard the oldest queued offset to make room
+		COALESCE_TO_LATEST		///< Discard everything queued in favor of the new offset
+	};
+
+	/// @brief Snapshot of counters describing the state of a TimeWarpClient.
+	struct TimeWarpClientStats {
+		/// @brief Number of offsets waiting for the send thread.
+		uint64_t queuedOffsets = 0;
+
+		/// @brief Sequence number given to the most recently queued offset.
+		int64_t lastSequence = 0;
+
+		/// @brief Sequence number of the most recent offset the send thread has
+		///        finished with.  All offsets up to and including it have been
+		///        written to the network (or reported as errors).
+		int64_t sentSequence = 0;
+
+		/// @brief Number of offsets discarded by the DROP_OLDEST policy.
+		uint64_t droppedOffsets = 0;
+
+		/// @brief Number of offsets discarded by the COALESCE_TO_LATEST policy.
+		uint64_t coalescedOffsets = 0;
+
+		/// @brief Number of acknowledgements received for SetTimeOffsetAcked().
+		uint64_t acksReceived = 0;
+
+		/// @brief Round-trip times of acknowledged offsets.
+		TimeWarpLatencyHistogram ackRoundTrip;
+
+		/// @brief Time the server took to apply acknowledged offsets, from
+		///        receiving each one until its callback returned.
+		TimeWarpLatencyHistogram ackApply;
+
+		/// @brief Whether the client is currently connected to its server.
+		bool connected = false;
+
+		/// @brief Number of times the client has reconnected after losing (or
+		///        failing to make) its connection, with autoReconnect set.  The
+		///        first connection made with connectAsync does not count.
+		uint64_t reconnects = 0;
+
+		/// @brief Protocol version agreed with the server on the current
+		///        connection, or 0 if there is none.
+		int protocolVersion = 0;
+
+		/// @brief Number of clock-synchronization pings that have been answered;
+		///        see TimeWarpClient::SyncClock().
+		uint64_t clockSamples = 0;
+
+		/// @brief Current estimate of the server's wall clock minus ours, and of
+		///        the round-trip delay of the ping it came from, in microseconds.
+		///        Both are 0 until the first ping has been answered.
+		int64_t clockOffset = 0;
+		int64_t clockDelay = 0;
+	};
+
+	/// @brief Optional settings that control how a TimeWarpClient sends offsets.
+	///        The defaults match the behavior of the constructor that does not
+	///        take an options structure.
+	struct TimeWarpClientOptions {
+		/// @brief Publish offsets as UDP datagrams to the multicast group named
+		///        by the constructor's hostName rather than connecting to a single
+		///        server over TCP.  Every server that has joined the group (see
+		///        TimeWarpServerOptions::multicastGroup) receives each offset at
+		///        the same time, whatever their number.  Datagrams are numbered
+		///        so that servers can detect and recover ones they miss.
+		bool multicast = false;
+
+		/// @brief Number of router hops multicast datagrams may take.
+		int multicastTTL = 1;
+
+		/// @brief TCP port on which a multicast publisher answers servers that
+		///        missed datagrams or joined late.  0 picks any free port (which
+		///        servers learn from the datagrams), -1 disables recovery.
+		int multicastRecoveryPort = DefaultPort + 1;
+
+		/// @brief Queue offsets and write them from a background thread, so that
+		///        SetTimeOffset(), SetTimeOffsets() and SetTimeOffsetAsync() never
+		///        block the caller on the network.  Offsets queued while the
+		///        thread is writing are sent together in its next write.
+		bool asyncSend = false;
+
+		/// @brief Number of offsets that can be waiting when asyncSend is set.
+		size_t sendQueueSize = 1024;
+
+		/// @brief What to do when an offset is queued and the queue is full.
+		TimeWarpOverflow overflowPolicy = TimeWarpOverflow::DROP_OLDEST;
+
+		/// @brief Keep trying to connect in the background if the server can't
+		///        be reached or the connection is lost, rather than failing for
+		///        good.  Offsets set while disconnected are not sent, but the
+		///        latest one is sent as soon as the connection is back, and the
+		///        calls that set them still succeed.  Schedules and acknowledged
+		///        offsets fail while disconnected.  Ignored in multicast mode.
+		bool autoReconnect = false;
+
+		/// @brief Seconds to wait before the first attempt to reconnect.  The
+		///        wait doubles after each failed attempt up to reconnectMaxDelay.
+		double reconnectInitialDelay = 0.05;
+
+		/// @brief Longest time in seconds to wait between attempts to reconnect.
+		double reconnectMaxDelay = 2.0;
+
+		/// @brief Return from the constructor right away and connect in the
+		///        background, so that an application can bring up many clients
+		///        in parallel.  Until the connection is made the client behaves
+		///        as one with autoReconnect does while disconnected, and
+		///        WaitForConnection() waits for it.  Without autoReconnect, a
+		///        failure to connect is reported by GetErrorMessages() and the
+		///        client stops trying.  Ignored in multicast mode.
+		bool connectAsync = false;
+
+		/// @brief Seconds to wait for the server's half of the handshake when
+		///        connecting.
+		double handshakeTimeout = 0.5;
+
+		/// @brief Seconds between the clock-synchronization pings that a
+		///        background thread sends to keep the estimate of the server's
+		///        clock up to date; see SyncClock().  0 only pings when
+		///        SyncClock() is called.
+		double clockSyncInterval = 0;
+
+		/// @brief Share one connection among all of the clients in the process
+		///        that ask for the same host, port and card address, so that
+		///        only the first of them pays for connecting.  The connection
+		///        uses the options of the client that opened it and stays open
+		///        until the last client sharing it is destroyed.  Errors and
+		///        statistics are those of the shared connection.  Ignored in
+		///        multicast mode.
+		bool shareConnection = false;
+
+		/// @brief Newest protocol version to use.  Version 1 sends every message
+		///        as a fixed 16 bytes.  Version 2 sends a one-byte op code, a
+		///        length and variable-length values, so small offsets take three
+		///        bytes; it is used only if the server offers it when connecting,
+		///        and otherwise the client falls back to version 1.  Servers from
+		///        before version 2 existed don't offer anything, so connecting to
+		///        them takes an extra tenth of a second while the client waits to
+		///        see; set this to 1 to avoid that.
+		int protocolVersion = 2;
+
+		/// @brief With protocol version 2, send each offset as the difference
+		///        from the previous one when that is shorter, which it is for
+		///        offsets that change smoothly.
+		bool deltaEncoding = true;
+	};
+
+	/// @brief An offset recorded in a server's journal; see
+	///        TimeWarpServerOptions::journalPath.
+	struct TimeWarpJournalRecord {
+		/// @brief When the server queued the offset for its callback, in
+		///        microseconds since the Unix epoch on the server's clock.
+		int64_t wallTime = 0;
+
+		/// @brief Connection it came from, as in TimeWarpUpdate::connection.
+		size_t connection = 0;
+
+		/// @brief Why it was delivered.
+		TimeWarpUpdateKind kind = TimeWarpUpdateKind::SET_TIME;
+
+		/// @brief Channel it was for; 0 for the main timeline.
+		uint32_t channel = 0;
+
+		/// @brief The offset.
+		int64_t timeOffset = 0;
+	};
+
+	/// @brief Read the records in a journal written by a TimeWarpServer, which
+	///        may still be writing to it (POSIX systems only).
+	/// @param [in] path File named by TimeWarpServerOptions::journalPath.
+	/// @param [out] records Filled in with the records, oldest first.
+	/// @param [out] error Description of the problem on failure.
+	/// @return True on success, false on failure.
+	bool ReadTimeWarpJournal(const std::string& path, std::vector<TimeWarpJournalRecord>& records,
+		std::string& error);
+
 	class TimeWarpServer {
 	public:
 
 		/// @brief Constructor for a TimeWarpServer object.
 		/// @param [in] port The port to listen to for connections on all interfaces.
-		/// @param [in] callback Function to be called from a new thread when a
+		/// @param [in] callback Function to be called from a dispatcher thread when a
 		///             time offset request is received from a connected client.
 		/// @param [in] userData A (possibly-Null) pointer that is passed to the
 		///             callback function when it is called.  This is useful for
@@ -40,23 +611,107 @@ namespace atl { namespace TimeWarp {
 		TimeWarpServer(TimeWarpServerCallback callback, void *userData,
 			uint16_t port = DefaultPort, std::string cardIP = "");
 
+		/// @brief Constructor for a TimeWarpServer object with non-default options.
+		/// @param [in] callback Function to be called when a time offset request
+		///             is received from a connected client.
+		/// @param [in] userData A (possibly-Null) pointer that is passed to the
+		///             callback function when it is called.
+		/// @param [in] options Settings controlling how connections are handled.
+		/// @param [in] port The port to listen to for connections on all interfaces.
+		/// @param [in] cardIP The string name of the IP address of the network
+		///             card to use for the outgoing connection, empty string
+		///             for "ANY".
+		TimeWarpServer(TimeWarpServerCallback callback, void *userData,
+			const TimeWarpServerOptions& options,
+			uint16_t port = DefaultPort, std::string cardIP = "");
+
+		/// @brief Constructor for a TimeWarpServer object that tells a handler
+		///        where each offset came from as well as what it is.
+		/// @param [in] handler Called from a dispatcher thread for each offset.
+		///             It is stored once, so delivering offsets does not allocate.
+		/// @param [in] options Settings controlling how connections are handled.
+		/// @param [in] port The port to listen to for connections on all interfaces.
+		/// @param [in] cardIP The string name of the IP address of the network
+		///             card to use for the outgoing connection, empty string
+		///             for "ANY".
+		TimeWarpServer(TimeWarpUpdateHandler handler,
+			const TimeWarpServerOptions& options = TimeWarpServerOptions(),
+			uint16_t port = DefaultPort, std::string cardIP = "");
+
 		/// @brief Destructor for a TimeWarpServer object; stops all threads and connections.
 		~TimeWarpServer();
 
 		/// @brief Tells whether the object is doing okay.
 		/// @return Empty vector if there have been no errors, descriptions of any
-		///         errors if there have been any.
+		///         errors if there have been any.  Only the most recent 256 are
+		///         kept; GetStats() reports how many there have been in all.
 		std::vector<std::string> GetErrorMessages();
 
+		/// @brief Report counters describing the current state of the server.
+		TimeWarpServerStats GetStats();
+
+		/// @brief Read the current offset, which is the one most recently
+		///        delivered to the callback.  Clients can read it too; see
+		///        TimeWarpClient::QueryTimeOffset().
+		/// @param [out] timeOffset Filled in with the offset if there is one.
+		/// @return True if there is a current offset, false if none has been
+		///         delivered yet.
+		bool GetTimeOffset(int64_t& timeOffset);
+
+		/// @brief Have the offsets for a channel delivered to a callback of its
+		///        own.  Offsets for channels without one go to the handler if
+		///        the server was constructed with a TimeWarpUpdateHandler, and
+		///        are otherwise only recorded for GetChannelOffset().
+		/// @param [in] channel Channel between 1 and MaxChannels - 1; channel 0
+		///             always goes to the constructor's callback.
+		/// @param [in] callback Function to call, or Null to stop calling one.
+		/// @param [in] userData Passed to the callback.
+		/// @return True on success, false if the channel is out of range.
+		bool SetChannelCallback(uint32_t channel, TimeWarpChannelCallback callback, void* userData);
+
+		/// @brief Read the offset most recently delivered on a channel.
+		/// @param [in] channel Channel to read; 0 is the same as GetTimeOffset().
+		/// @param [out] timeOffset Filled in with the offset if there is one.
+		/// @return True if the channel has an offset, false if none has been
+		///         delivered on it yet.
+		bool GetChannelOffset(uint32_t channel, int64_t& timeOffset);
+
 	protected:
 		class TimeWarpServerPrivate;
 		std::shared_ptr<TimeWarpServerPrivate> m_private;
 
+		/// @brief Open the sockets and start the threads, once the constructor
+		///        has stored where offsets are to be delivered.
+		void Open(const TimeWarpServerOptions& options, uint16_t port, std::string cardIP);
+
 		/// @brief Thread that will listen for incoming connections
 		static void ListenThread(std::shared_ptr<TimeWarpServerPrivate> p);
 
+		/// @brief Additional thread accepting connections on a TCP listening
+		///        socket, when more than one is asked for.
+		/// @param [in] i Index of the acceptor, which says which socket it uses.
+		static void AcceptorThread(std::shared_ptr<TimeWarpServerPrivate> p, size_t i);
+
 		/// @brief Thread that will handle commands from an incoming connection
 		static void AcceptThread(std::shared_ptr<TimeWarpServerPrivate> p, size_t i);
+
+		/// @brief Thread that accepts and services many connections using epoll
+		static void EventLoopThread(std::shared_ptr<TimeWarpServerPrivate> p);
+
+		/// @brief Thread that delivers received offsets to the callback
+		static void DispatchThread(std::shared_ptr<TimeWarpServerPrivate> p, size_t i);
+
+		/// @brief Thread that receives offsets from multicast publishers
+		static void MulticastThread(std::shared_ptr<TimeWarpServerPrivate> p);
+
+		/// @brief Thread that queues scheduled offsets when they come due
+		static void ScheduleThread(std::shared_ptr<TimeWarpServerPrivate> p);
+
+		/// @brief Thread that writes queued offsets to the journal
+		static void JournalThread(std::shared_ptr<TimeWarpServerPrivate> p);
+
+		/// @brief Thread that reads offsets from a shared-memory endpoint
+		static void ShmThread(std::shared_ptr<TimeWarpServerPrivate> p, size_t i);
 	};
 
 	class TimeWarpClient {
@@ -70,6 +725,17 @@ namespace atl { namespace TimeWarp {
 		TimeWarpClient(std::string hostName, uint16_t port = DefaultPort,
 			std::string cardIP = "");
 
+		/// @brief Constructor for a TimeWarpClient object with non-default options.
+		/// @param [in] hostName The computer to connect to, or the multicast
+		///             group to publish to if options.multicast is set.
+		/// @param [in] options Settings controlling how offsets are sent.
+		/// @param [in] port The port to connect or publish to.
+		/// @param [in] cardIP The string name of the IP address of the network
+		///             card to use for the outgoing connection, empty string
+		///             for "ANY".
+		TimeWarpClient(std::string hostName, const TimeWarpClientOptions& options,
+			uint16_t port = DefaultPort, std::string cardIP = "");
+
 		/// @brief Destructor for a TimeWarpClient object; stops connection.
 		~TimeWarpClient();
 
@@ -80,6 +746,198 @@ namespace atl { namespace TimeWarp {
 		///         for details of the error(s) on failure.
 		bool SetTimeOffset(int64_t timeOffset);
 
+		/// @brief Send a series of time offsets to the connected server, to be
+		///        applied in order as soon as they arrive.
+		///
+		/// This packs many offsets into each system call, which is much cheaper
+		/// than calling SetTimeOffset() for each of them.
+		/// @param [in] timeOffsets Pointer to the first of the offsets.
+		/// @param [in] count Number of offsets to send.
+		/// @return True on success, false on failure.  See GetErrorMessages()
+		///         for details of the error(s) on failure.
+		bool SetTimeOffsets(const int64_t* timeOffsets, size_t count);
+
+		/// @brief Send a series of time offsets to the connected server.
+		/// @param [in] timeOffsets The offsets to send, in order.
+		/// @return True on success, false on failure.
+		bool SetTimeOffsets(const std::vector<int64_t>& timeOffsets);
+
+		/// @brief Send new time offsets for any number of channels on the
+		///        server, all in one write, so that a single connection can
+		///        carry many independent timelines.
+		///
+		/// Channel 0 is the main timeline that SetTimeOffset() sets.  Other
+		/// channels need a server that supports them, which version 1 servers
+		/// and clients with protocolVersion 1 do not, and are not sent by
+		/// multicast or shared memory.  Offsets for channels other than 0 are
+		/// not sent again on reconnection, so with autoReconnect the call
+		/// fails while disconnected.  Schedules, ramps, queries and
+		/// subscriptions are for channel 0 only.
+		/// @param [in] channels Channel for each offset, below MaxChannels.
+		/// @param [in] timeOffsets Offset for each channel, applied in order.
+		/// @param [in] count Number of entries in both arrays.
+		/// @return True on success, false on failure.  See GetErrorMessages()
+		///         for details of the error(s) on failure.
+		bool SetChannelOffsets(const uint32_t* channels, const int64_t* timeOffsets, size_t count);
+
+		/// @brief Send a new time offset for one channel on the server; see
+		///        SetChannelOffsets().
+		bool SetChannelOffset(uint32_t channel, int64_t timeOffset);
+
+		/// @brief Send a series of time offsets to be applied at specified times.
+		///
+		/// The whole schedule is sent in a single message, and the server calls
+		/// its callback with each offset at the requested time.  This avoids
+		/// both the cost of one message per step and the timing jitter of
+		/// sending each one when it is needed.
+		/// @param [in] schedule Offsets and when to apply them; must have between
+		///             1 and MaxScheduleEntries entries.
+		/// @return True on success, false on failure.  See GetErrorMessages()
+		///         for details of the error(s) on failure.
+		bool SetTimeOffsetSchedule(const std::vector<ScheduledTimeOffset>& schedule);
+
+		/// @brief Queue a new time offset to be sent by the background thread.
+		///
+		/// Requires the asyncSend option.  Returns immediately whatever the state
+		/// of the network; compare the result with GetStats().sentSequence or
+		/// call Flush() to find out when it has been sent.
+		/// @param [in] timeOffset New time offset; positive is in the future
+		///             and negative is in the past.
+		/// @return Sequence number assigned to the offset (starting at 1), or
+		///         -1 on failure.
+		int64_t SetTimeOffsetAsync(int64_t timeOffset);
+
+		/// @brief Queue several time offsets to be sent, in order, by the
+		///        background thread, taking the queue's lock only once.
+		///
+		/// Requires the asyncSend option.  Offsets beyond the room in the queue
+		/// are handled according to the overflowPolicy.
+		/// @param [in] timeOffsets Offsets to send.
+		/// @param [in] count Number of offsets, at least 1.
+		/// @return Sequence number assigned to the last offset, or -1 on failure.
+		int64_t SetTimeOffsetsAsync(const int64_t* timeOffsets, size_t count);
+
+		/// @brief Send a new time offset and ask the server to acknowledge it once
+		///        its callback has returned.
+		///
+		/// The acknowledgement arrives asynchronously; use WaitForAck() to get it
+		/// and GetStats() for histograms of all of them.  Acknowledged offsets
+		/// are always delivered to the callback, even when the server is
+		/// coalescing offsets.  Not available in multicast mode.
+		/// @param [in] timeOffset New time offset; positive is in the future
+		///             and negative is in the past.
+		/// @return Sequence number of the request (starting at 1), or -1 on failure.
+		int64_t SetTimeOffsetAcked(int64_t timeOffset);
+
+		/// @brief Wait for the acknowledgement of an offset sent with
+		///        SetTimeOffsetAcked().  The most recent 1024 are kept.
+		/// @param [in] sequence Value returned by SetTimeOffsetAcked().
+		/// @param [in] timeoutSeconds How long to wait; negative waits forever.
+		/// @param [out] ack Filled in with the acknowledgement if not Null.
+		/// @return True if the acknowledgement arrived, false on timeout or if
+		///         the connection was lost.
+		bool WaitForAck(int64_t sequence, double timeoutSeconds, TimeWarpAck* ack = nullptr);
+
+		/// @brief Wait for the client to be connected to its server, which it
+		///        is as soon as the constructor returns unless the connectAsync
+		///        or autoReconnect options are set.
+		/// @param [in] timeoutSeconds How long to wait; negative waits forever.
+		/// @return True if connected, false on timeout or if the client has
+		///         given up trying to connect.
+		bool WaitForConnection(double timeoutSeconds);
+
+		/// @brief Estimate the difference between the server's wall clock and
+		///        ours, so that SetTimeOffsetAt() can have it apply an offset at
+		///        an instant on our clock.
+		///
+		/// Works like NTP: each ping records when it left us and when it
+		/// arrived at and left the server, which gives the clock difference
+		/// to within half of the time the ping spent on the network.  The
+		/// estimate comes from whichever of the most recent eight pings took
+		/// the least time, since those are the ones least affected by queuing.
+		/// Pings are sent one at a time, each once the previous one has been
+		/// answered.  Needs a server that answers pings, which version 1
+		/// servers and clients with protocolVersion 1 do not.  Not available
+		/// in multicast or shared-memory mode.
+		/// @param [in] samples Number of pings to send.
+		/// @param [in] timeoutSeconds How long to wait for each answer.
+		/// @return True if there is an estimate, false if no ping has been
+		///         answered.
+		bool SyncClock(size_t samples = 8, double timeoutSeconds = 1.0);
+
+		/// @brief Report the current estimate made by SyncClock().
+		/// @param [out] offsetUs Server's wall clock minus ours, in microseconds.
+		/// @param [out] delayUs Round-trip delay of the ping the estimate came
+		///              from, in microseconds.  The estimate is within half of
+		///              this of the truth.
+		/// @return True if there is an estimate, false if no ping has been answered.
+		bool GetClockOffset(int64_t& offsetUs, int64_t& delayUs);
+
+		/// @brief Have the server apply an offset at an instant on our wall
+		///        clock rather than when it arrives, so that servers that
+		///        several clients send to all apply it at the same moment.
+		///        The instant is converted to the server's clock using the
+		///        estimate from SyncClock() and sent as a one-entry schedule.
+		/// @param [in] timeOffset New time offset; positive is in the future
+		///             and negative is in the past.
+		/// @param [in] wallTime When to apply it, in microseconds since the
+		///             Unix epoch (std::chrono::system_clock) on our clock.
+		/// @return True on success, false on failure, including when there is
+		///         no estimate of the server's clock yet.
+		bool SetTimeOffsetAt(int64_t timeOffset, int64_t wallTime);
+
+		/// @brief Wait for all queued offsets to be sent.  Returns immediately
+		///        if the asyncSend option is not set.
+		/// @param [in] timeoutSeconds How long to wait; negative waits forever.
+		/// @return True if everything was sent, false on timeout.
+		bool Flush(double timeoutSeconds = -1);
+
+		/// @brief Have the server move smoothly from its current offset to a new
+		///        one, delivering offsets along the way to its callback at its
+		///        rampUpdateRate, so that a large change does not arrive as a
+		///        single jump.  The server starts from the offset it most recently
+		///        delivered (or from where a ramp in progress has got to), and
+		///        delivers exactly the target at the end.  Any other offset the
+		///        server delivers, directly or from a schedule, stops the ramp.
+		///        Not available in multicast or shared-memory mode.
+		/// @param [in] targetOffset Offset to end at.
+		/// @param [in] durationSeconds How long the ramp takes; 0 jumps straight there.
+		/// @param [in] curve How to get there.
+		/// @return True on success, false on failure.
+		bool RampTimeOffset(int64_t targetOffset, double durationSeconds,
+			TimeWarpRampCurve curve = TimeWarpRampCurve::LINEAR);
+
+		/// @brief Ask the server for its current offset, which is the one it most
+		///        recently delivered to its callback (from any client).  Not
+		///        available in multicast or shared-memory mode.
+		/// @param [out] timeOffset Filled in with the offset on success.
+		/// @param [in] timeoutSeconds How long to wait for the answer.
+		/// @return True on success, false on timeout, if the connection was lost
+		///         or if the server has not delivered any offset yet.
+		bool QueryTimeOffset(int64_t& timeOffset, double timeoutSeconds = 1.0);
+
+		/// @brief Have the server send us every offset it delivers to its
+		///        callback, starting with the current one.  Offsets that arrive
+		///        out of order are skipped, so the callback only ever moves
+		///        forward through the server's offsets.  With autoReconnect, the
+		///        subscription is renewed on reconnection.  Replaces any earlier
+		///        subscription made through this object; clients sharing a
+		///        connection (TimeWarpClientOptions::shareConnection) each have
+		///        their own.  Not available in multicast or shared-memory mode.
+		/// @param [in] callback Function to call with each offset.
+		/// @param [in] userData Passed to the callback.
+		/// @return True on success, false on failure.
+		bool Subscribe(TimeWarpSubscriberCallback callback, void* userData);
+
+		/// @brief Stop the subscription started by Subscribe().  The callback is
+		///        not called once this returns.  The server stops sending offsets
+		///        once no client sharing the connection is subscribed.
+		/// @return True on success, false on failure.
+		bool Unsubscribe();
+
+		/// @brief Report counters describing the state of the client.
+		TimeWarpClientStats GetStats();
+
 		/// @brief Tells whether the object is doing okay.
 		/// @return Empty vector if there have been no errors, descriptions of any
 		///         errors if there have been any.
@@ -87,7 +945,7 @@ namespace atl { namespace TimeWarp {
 
 	protected:
 		class TimeWarpClientPrivate;
-		std::unique_ptr<TimeWarpClientPrivate> m_private;
+		std::shared_ptr<TimeWarpClientPrivate> m_private;
 	};
 
 }};
@@ -101,18 +959,87 @@ extern "C" {
 	/// @param [in] port The port to connect to.  -1 for default.
 	/// @param [in] cardIP The string name of the IP address of the network
 	///             card to use for the outgoing connection, empty string "" for ANY.
-	/// @return Index ofthe client object on success, -1 on failure.
+	/// @return Handle of the client object on success, -1 on failure.
+	///         Handles of destroyed clients are never valid again, even if
+	///         another client is created later.
 	int atl_TimeWarpClientCreate(const char* hostName, int port, const char* cardIP);
 
-	/// @brief Set the offset on a TimeWarpClient object.
+	/// @brief Create a TimeWarpClient object that queues offsets and sends
+	///        them from a background thread (TimeWarpClientOptions::asyncSend),
+	///        for use with atl_TimeWarpClientSetTimeOffsetsAsync().
+	/// @param [in] queueSize Number of offsets that can wait to be sent; the
+	///             oldest is dropped to make room for more.  -1 for default.
+	/// @return Handle of the client object on success, -1 on failure.
+	int atl_TimeWarpClientCreateAsync(const char* hostName, int port, const char* cardIP,
+		int queueSize);
+
+	/// @brief Set the offset on a TimeWarpClient object.  Calls on different
+	///        clients do not wait for each other.
 	/// @param [in] client A value returned by aqt_TimeWarpClientCreate().
 	/// @param [in] timeOffset New time offset; positive is in the future
 	///             and negative is in the past.
 	/// @return True on success, false on failure.
 	bool atl_TimeWarpClientSetTimeOffset(int client, int64_t offset);
 
+	/// @brief Send many offsets in one call, so that a managed caller pays for
+	///        crossing into native code once for all of them (an array of
+	///        Int64 is passed pinned, without copying).  Without wall times,
+	///        the offsets are sent in one write as by SetTimeOffsets(); with
+	///        them they are sent as a schedule as by SetTimeOffsetSchedule().
+	/// @param [in] client A value returned by atl_TimeWarpClientCreate().
+	/// @param [in] offsets Offsets to send.
+	/// @param [in] wallTimes When each offset is to be applied, in microseconds
+	///             since the Unix epoch on the server's clock, or Null to
+	///             apply them on arrival.
+	/// @param [in] count Number of entries in the arrays; sending none
+	///             succeeds, with or without wall times.
+	/// @return True on success, false on failure.
+	bool atl_TimeWarpClientSetTimeOffsets(int client, const int64_t* offsets,
+		const int64_t* wallTimes, int count);
+
+	/// @brief Queue offsets to be sent by the background thread of a client
+	///        made by atl_TimeWarpClientCreateAsync(), returning without waiting
+	///        for the network.
+	/// @param [in] client A value returned by atl_TimeWarpClientCreateAsync().
+	/// @param [in] offsets Offsets to send.
+	/// @param [in] count Number of offsets, at least 1.
+	/// @return Sequence number of the last offset, or -1 on failure.
+	int64_t atl_TimeWarpClientSetTimeOffsetsAsync(int client, const int64_t* offsets, int count);
+
+	/// @brief Wait for the offsets queued on a client to be sent.
+	/// @param [in] client A value returned by atl_TimeWarpClientCreateAsync().
+	/// @param [in] timeoutSeconds How long to wait; negative waits forever.
+	/// @return True if everything was sent, false on timeout or failure.
+	bool atl_TimeWarpClientFlush(int client, double timeoutSeconds);
+
 	/// @brief Destroy a TimeWarpClient object.
 	/// @param [in] client A value returned by aqt_TimeWarpClientCreate().
 	/// @return True on success, false on failure.
 	bool atl_TimeWarpClientDestroy(int client);
+
+	/// @brief Create a TimeWarpServer object, for hosting a server in a
+	///        process that can only call C functions.
+	/// @param [in] port The port to listen on.  -1 for default.
+	/// @param [in] cardIP The string name of the IP address of the network
+	///             card to listen on, empty string "" or Null for ANY.
+	/// @param [in] callback Called from a dispatcher thread with each offset.
+	///             It must stay valid (for a managed delegate, be kept from
+	///             being collected) until the server is destroyed, and must not
+	///             destroy the server itself.
+	/// @param [in] userData Passed to the callback.
+	/// @return Handle of the server object on success, -1 on failure.
+	int atl_TimeWarpServerCreate(int port, const char* cardIP,
+		atl::TimeWarp::TimeWarpServerCallback callback, void* userData);
+
+	/// @brief Read the offset most recently delivered to a server's callback.
+	/// @param [in] server A value returned by atl_TimeWarpServerCreate().
+	/// @param [out] offset Filled in with the offset on success.
+	/// @return True on success, false on failure or if there has been no offset.
+	bool atl_TimeWarpServerGetTimeOffset(int server, int64_t* offset);
+
+	/// @brief Destroy a TimeWarpServer object.  Waits for its callback to
+	///        return if it is running.
+	/// @param [in] server A value returned by atl_TimeWarpServerCreate().
+	/// @return True on success, false on failure.
+	bool atl_TimeWarpServerDestroy(int server);
 }
@@ -0,0 +1,136 @@
+/** @file
+	@brief Throughput of the TimeWarp client C API.
+
+	Sends the same number of offsets three ways through the C API that
+	language bindings such as the C# one use: one atl_TimeWarpClientSetTimeOffset()
+	call per offset, arrays passed to atl_TimeWarpClientSetTimeOffsets(), and
+	arrays queued with atl_TimeWarpClientSetTimeOffsetsAsync().  Each is timed
+	until the server, also made through the C API, has received every offset.
+
+	Usage: TimeWarp_C_API_benchmark [COUNT] [BATCH]
+
+	@copyright 2019 Aqueti
+
+	@author ReliaSolve, working for Aqueti.
+*/
+
+#include <TimeWarp.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+static std::atomic<int64_t> g_received(0);
+
+void CallbackHandler(void* userData, int64_t timeOffset)
+{
+	g_received++;
+}
+
+/// @brief Wait until the server has received the specified number of offsets.
+static bool WaitForReceived(int64_t count)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+	while (g_received < count && std::chrono::steady_clock::now() < deadline) {
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+	return g_received >= count;
+}
+
+/// @brief Report the rate of one way of sending.
+static void Report(const char* name, size_t count,
+	std::chrono::steady_clock::time_point start)
+{
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << name << ": " << count / seconds << " offsets per second ("
+		<< 1e6 * seconds / count << " us each)" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+	size_t count = 100000;
+	size_t batch = 256;
+	if (argc > 1) {
+		count = static_cast<size_t>(std::atoll(argv[1]));
+	}
+	if (argc > 2) {
+		batch = static_cast<size_t>(std::atoll(argv[2]));
+	}
+	if (count == 0 || batch == 0) {
+		std::cerr << "Usage: " << argv[0] << " [COUNT] [BATCH]" << std::endl;
+		return 1;
+	}
+	int port = atl::TimeWarp::DefaultPort + 13;
+
+	int server = atl_TimeWarpServerCreate(port, nullptr, CallbackHandler, nullptr);
+	if (server < 0) {
+		std::cerr << "Error opening server" << std::endl;
+		return 2;
+	}
+	int client = atl_TimeWarpClientCreate("localhost", port, "");
+	int queued = atl_TimeWarpClientCreateAsync("localhost", port, "", static_cast<int>(count));
+	if (client < 0 || queued < 0) {
+		std::cerr << "Error opening clients" << std::endl;
+		return 3;
+	}
+
+	std::vector<int64_t> offsets(count);
+	for (size_t i = 0; i < count; i++) {
+		offsets[i] = static_cast<int64_t>(i);
+	}
+
+	// One call per offset.
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < count; i++) {
+		if (!atl_TimeWarpClientSetTimeOffset(client, offsets[i])) {
+			std::cerr << "Error sending offset " << i << std::endl;
+			return 4;
+		}
+	}
+	if (!WaitForReceived(static_cast<int64_t>(count))) {
+		std::cerr << "Server received " << g_received << " of " << count << std::endl;
+		return 5;
+	}
+	Report("per-call", count, start);
+	g_received = 0;
+
+	// One call per batch.
+	start = std::chrono::steady_clock::now();
+	for (size_t sent = 0; sent < count; sent += batch) {
+		int n = static_cast<int>(std::min(batch, count - sent));
+		if (!atl_TimeWarpClientSetTimeOffsets(client, &offsets[sent], nullptr, n)) {
+			std::cerr << "Error sending batch at " << sent << std::endl;
+			return 6;
+		}
+	}
+	if (!WaitForReceived(static_cast<int64_t>(count))) {
+		std::cerr << "Server received " << g_received << " of " << count << std::endl;
+		return 7;
+	}
+	Report("batch", count, start);
+	g_received = 0;
+
+	// One queued call per batch, sent by the client's background thread.
+	start = std::chrono::steady_clock::now();
+	for (size_t sent = 0; sent < count; sent += batch) {
+		int n = static_cast<int>(std::min(batch, count - sent));
+		if (atl_TimeWarpClientSetTimeOffsetsAsync(queued, &offsets[sent], n) < 0) {
+			std::cerr << "Error queueing batch at " << sent << std::endl;
+			return 8;
+		}
+	}
+	Report("async enqueue", count, start);
+	if (!atl_TimeWarpClientFlush(queued, 30) || !WaitForReceived(static_cast<int64_t>(count))) {
+		std::cerr << "Server received " << g_received << " of " << count << std::endl;
+		return 9;
+	}
+	Report("async delivered", count, start);
+
+	atl_TimeWarpClientDestroy(queued);
+	atl_TimeWarpClientDestroy(client);
+	atl_TimeWarpServerDestroy(server);
+	return 0;
+}
@@ -0,0 +1,124 @@
+/** @file
+	@brief Reconnection-storm benchmark of the TimeWarpServer listen path.
+
+	Starts a TimeWarpServer and then has a large number of TimeWarpClients
+	connect to it all at once, as happens when every node on a network
+	reconnects after a blip.  Reports how long it took until every client
+	had connected and the server had accepted all of them.
+
+	Usage: TimeWarp_connect_storm_benchmark [--clients 1000] [--backlog N]
+		[--accept-threads N] [--reuse-port] [--event-loop]
+
+	A backlog of 0 uses the largest the system allows.
+
+	@copyright 2019 Aqueti
+
+	@author ReliaSolve, working for Aqueti.
+*/
+
+#include <TimeWarp.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+void CallbackHandler(void* userData, int64_t timeOffset)
+{
+}
+
+int main(int argc, char* argv[])
+{
+	size_t clients = 1000;
+	atl::TimeWarp::TimeWarpServerOptions opts;
+	for (int i = 1; i < argc; i++) {
+		if (0 == strcmp(argv[i], "--clients") && i + 1 < argc) {
+			clients = static_cast<size_t>(std::atoll(argv[++i]));
+		} else if (0 == strcmp(argv[i], "--backlog") && i + 1 < argc) {
+			opts.listenBacklog = std::atoi(argv[++i]);
+		} else if (0 == strcmp(argv[i], "--accept-threads") && i + 1 < argc) {
+			opts.acceptThreads = static_cast<unsigned>(std::atoi(argv[++i]));
+		} else if (0 == strcmp(argv[i], "--reuse-port")) {
+			opts.reusePort = true;
+		} else if (0 == strcmp(argv[i], "--event-loop")) {
+			opts.useEventLoop = true;
+			opts.eventLoopThreads = 4;
+		} else {
+			std::cerr << "Usage: " << argv[0] << " [--clients 1000] [--backlog N]"
+				<< " [--accept-threads N] [--reuse-port] [--event-loop]" << std::endl;
+			return 1;
+		}
+	}
+
+#ifndef _WIN32
+	// Each connection needs a descriptor at each end, all in this process.
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		rlim_t want = static_cast<rlim_t>(clients * 2 + 64);
+		if (limit.rlim_cur < want) {
+			limit.rlim_cur = (limit.rlim_max == RLIM_INFINITY || limit.rlim_max > want) ?
+				want : limit.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &limit);
+		}
+		if (limit.rlim_cur < want) {
+			std::cerr << "Warning: only " << limit.rlim_cur << " descriptors available" << std::endl;
+		}
+	}
+#endif
+
+	uint16_t port = atl::TimeWarp::DefaultPort + 12;
+	atl::TimeWarp::TimeWarpServer svr(CallbackHandler, nullptr, opts, port);
+	if (svr.GetErrorMessages().size()) {
+		std::cerr << "Error opening server" << std::endl;
+		return 2;
+	}
+
+	// Start one thread per client, all held until they are released together.
+	std::vector<std::unique_ptr<atl::TimeWarp::TimeWarpClient> > clis(clients);
+	std::atomic<bool> go(false);
+	std::atomic<size_t> failures(0);
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < clients; i++) {
+		threads.emplace_back([&, i]() {
+			while (!go) {
+				std::this_thread::yield();
+			}
+			clis[i].reset(new atl::TimeWarp::TimeWarpClient("localhost", port));
+			if (clis[i]->GetErrorMessages().size()) {
+				failures++;
+			}
+		});
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	go = true;
+	for (auto& t : threads) {
+		t.join();
+	}
+	double clientsDone = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+
+	// The server may still be starting threads for the last few.
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (svr.GetStats().activeConnections < clients - failures &&
+			std::chrono::steady_clock::now() < deadline) {
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+	double serverDone = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+	atl::TimeWarp::TimeWarpServerStats stats = svr.GetStats();
+
+	std::cout << clients << " clients connected in " << clientsDone * 1e3 << " ms; "
+		<< stats.activeConnections << " active on the server after "
+		<< serverDone * 1e3 << " ms (" << failures << " failed to connect)" << std::endl;
+
+	clis.clear();
+	return (failures == 0 && stats.activeConnections == clients) ? 0 : 3;
+}
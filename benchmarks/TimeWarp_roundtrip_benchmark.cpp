@@ -0,0 +1,302 @@
+/** @file
+	@brief Loopback throughput and latency benchmark of client-server round trips.
+
+	Runs a TimeWarpServer and a number of TimeWarpClients in the same process
+	and has each client send offsets at a fixed rate (or as fast as it can)
+	for a while.  Each offset carries the time it was sent, so the callback
+	can measure how long it took to arrive.  For each combination of client
+	count and rate it reports messages per second, callback latency
+	percentiles, CPU time per message and the number of threads in the
+	process, both as a table and optionally as JSON so that results can be
+	compared across releases.
+
+	Usage: TimeWarp_roundtrip_benchmark [--clients 1,4,16] [--rates 0,1000]
+		[--seconds 2] [--event-loop] [--transport tcp|unix|shm] [--json FILE]
+
+	A rate of 0 sends as fast as possible.  The shm transport only delivers
+	the latest offset, so it may report fewer messages than were sent.
+
+	@copyright 2019 Aqueti
+
+	@author ReliaSolve, working for Aqueti.
+*/
+
+#include <TimeWarp.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+//=====================================================================================
+// Offsets are the sender's steady-clock time in nanoseconds, so the callback
+// can tell how long each one took to arrive.
+static int64_t now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::atomic<int64_t> g_received(0);
+static std::mutex g_latencyMutex;
+static atl::TimeWarp::TimeWarpLatencyHistogram g_latency;
+
+void CallbackHandler(void* userData, int64_t timeOffset)
+{
+	int64_t latency = now_ns() - timeOffset;
+	{
+		std::lock_guard<std::mutex> lock(g_latencyMutex);
+		g_latency.Add(latency);
+	}
+	g_received++;
+}
+
+/// @brief CPU time (user plus system) used by the process so far, in nanoseconds.
+static double cpu_ns()
+{
+#ifdef _WIN32
+	FILETIME create, exit, kernel, user;
+	GetProcessTimes(GetCurrentProcess(), &create, &exit, &kernel, &user);
+	ULARGE_INTEGER k, u;
+	k.LowPart = kernel.dwLowDateTime;
+	k.HighPart = kernel.dwHighDateTime;
+	u.LowPart = user.dwLowDateTime;
+	u.HighPart = user.dwHighDateTime;
+	return (k.QuadPart + u.QuadPart) * 100.0;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e9 +
+		(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e3;
+#endif
+}
+
+/// @brief Number of threads in the process, or -1 if we can't tell.
+static int thread_count()
+{
+#ifdef __linux__
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while (std::getline(status, line)) {
+		if (line.compare(0, 8, "Threads:") == 0) {
+			return std::atoi(line.c_str() + 8);
+		}
+	}
+#endif
+	return -1;
+}
+
+/// @brief Parse a comma-separated list of numbers.
+static std::vector<double> parse_list(const char* arg)
+{
+	std::vector<double> ret;
+	std::stringstream ss(arg);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		ret.push_back(std::atof(item.c_str()));
+	}
+	return ret;
+}
+
+struct Result {
+	size_t clients = 0;
+	double rate = 0;
+	int64_t messages = 0;
+	double messagesPerSecond = 0;
+	atl::TimeWarp::TimeWarpLatencyHistogram latency;
+	double cpuNsPerMessage = 0;
+	int threads = 0;
+};
+
+/// @brief Run one configuration and report what happened.
+/// @return True on success, false if the server or a client failed.
+static bool run(size_t clients, double rate, double seconds, bool eventLoop,
+	const std::string& transport, uint16_t port, Result& result)
+{
+	atl::TimeWarp::TimeWarpServerOptions opts;
+	opts.useEventLoop = eventLoop;
+	std::string uri = "localhost";
+	if (transport == "unix") {
+		uri = "unix:///tmp/timewarp_benchmark." + std::to_string(port) + ".sock";
+	} else if (transport == "shm") {
+		uri = "shm://timewarp_benchmark." + std::to_string(port);
+	}
+	if (transport != "tcp") {
+		opts.endpoints.push_back(uri);
+	}
+	atl::TimeWarp::TimeWarpServer svr(CallbackHandler, nullptr, opts, port);
+	if (svr.GetErrorMessages().size()) {
+		std::cerr << "Error opening server" << std::endl;
+		return false;
+	}
+	std::vector<std::unique_ptr<atl::TimeWarp::TimeWarpClient> > clis;
+	for (size_t i = 0; i < clients; i++) {
+		clis.emplace_back(new atl::TimeWarp::TimeWarpClient(uri, port));
+		if (clis.back()->GetErrorMessages().size()) {
+			std::cerr << "Error opening client " << i << std::endl;
+			return false;
+		}
+	}
+
+	g_received = 0;
+	g_latency = atl::TimeWarp::TimeWarpLatencyHistogram();
+	std::atomic<bool> stop(false);
+	std::atomic<int64_t> sent(0);
+	std::atomic<bool> failed(false);
+	double cpuStart = cpu_ns();
+	auto start = std::chrono::steady_clock::now();
+
+	// One sending thread per client, each pacing itself to the requested rate.
+	std::vector<std::thread> senders;
+	for (size_t i = 0; i < clients; i++) {
+		atl::TimeWarp::TimeWarpClient* cli = clis[i].get();
+		senders.emplace_back([&, cli]() {
+			auto next = std::chrono::steady_clock::now();
+			auto period = std::chrono::nanoseconds(rate > 0 ? static_cast<int64_t>(1e9 / rate) : 0);
+			while (!stop) {
+				if (rate > 0) {
+					std::this_thread::sleep_until(next);
+					next += period;
+				}
+				if (!cli->SetTimeOffset(now_ns())) {
+					failed = true;
+					return;
+				}
+				sent++;
+			}
+		});
+	}
+
+	// Count the threads while everything is running.
+	std::this_thread::sleep_for(std::chrono::duration<double>(seconds / 2));
+	result.threads = thread_count();
+	std::this_thread::sleep_for(std::chrono::duration<double>(seconds / 2));
+	stop = true;
+	for (auto& t : senders) {
+		t.join();
+	}
+
+	// Let the server catch up with everything that was sent.  Shared memory
+	// overwrites offsets that have not been read yet, so we can't wait for all of them.
+	bool latestOnly = (transport == "shm");
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(latestOnly ? 0 : 10);
+	if (latestOnly) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	while (g_received < sent && std::chrono::steady_clock::now() < deadline) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	double cpu = cpu_ns() - cpuStart;
+
+	result.clients = clients;
+	result.rate = rate;
+	result.messages = g_received;
+	result.messagesPerSecond = result.messages / elapsed;
+	{
+		std::lock_guard<std::mutex> lock(g_latencyMutex);
+		result.latency = g_latency;
+	}
+	result.cpuNsPerMessage = result.messages ? cpu / result.messages : 0;
+
+	if (failed) {
+		std::cerr << "Error sending offsets" << std::endl;
+		return false;
+	}
+	if (!latestOnly && g_received != sent) {
+		std::cerr << "Only " << g_received << " of " << sent << " offsets were received" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	std::vector<double> clientCounts = { 1, 4, 16 };
+	std::vector<double> rates = { 0, 1000 };
+	double seconds = 2;
+	bool eventLoop = false;
+	std::string transport = "tcp";
+	std::string jsonFile;
+	for (int i = 1; i < argc; i++) {
+		if (0 == strcmp(argv[i], "--clients") && i + 1 < argc) {
+			clientCounts = parse_list(argv[++i]);
+		} else if (0 == strcmp(argv[i], "--rates") && i + 1 < argc) {
+			rates = parse_list(argv[++i]);
+		} else if (0 == strcmp(argv[i], "--seconds") && i + 1 < argc) {
+			seconds = std::atof(argv[++i]);
+		} else if (0 == strcmp(argv[i], "--event-loop")) {
+			eventLoop = true;
+		} else if (0 == strcmp(argv[i], "--transport") && i + 1 < argc) {
+			transport = argv[++i];
+		} else if (0 == strcmp(argv[i], "--json") && i + 1 < argc) {
+			jsonFile = argv[++i];
+		} else {
+			std::cerr << "Usage: " << argv[0] << " [--clients 1,4,16] [--rates 0,1000]"
+				<< " [--seconds 2] [--event-loop] [--transport tcp|unix|shm] [--json FILE]" << std::endl;
+			return 1;
+		}
+	}
+
+	// Use a new port for each run so that we don't wait on sockets from the last one.
+	uint16_t port = atl::TimeWarp::DefaultPort + 11;
+	std::vector<Result> results;
+	std::cout << "clients  rate/client     msgs/s   p50(us)   p99(us)  p99.9(us)  cpu/msg(us)  threads" << std::endl;
+	for (double c : clientCounts) {
+		for (double r : rates) {
+			Result res;
+			if (!run(static_cast<size_t>(c), r, seconds, eventLoop, transport, port++, res)) {
+				return 2;
+			}
+			results.push_back(res);
+			char line[256];
+			snprintf(line, sizeof(line), "%7zu  %11.0f %10.0f %9.1f %9.1f %10.1f %12.2f %8d",
+				res.clients, res.rate, res.messagesPerSecond,
+				res.latency.Percentile(0.5) / 1e3, res.latency.Percentile(0.99) / 1e3,
+				res.latency.Percentile(0.999) / 1e3, res.cpuNsPerMessage / 1e3, res.threads);
+			std::cout << line << std::endl;
+		}
+	}
+
+	if (!jsonFile.empty()) {
+		std::ofstream out(jsonFile);
+		out << "{\"benchmark\": \"TimeWarp_roundtrip\", \"eventLoop\": " << (eventLoop ? "true" : "false")
+			<< ", \"transport\": \"" << transport << "\""
+			<< ", \"seconds\": " << seconds << ", \"results\": [";
+		for (size_t i = 0; i < results.size(); i++) {
+			const Result& r = results[i];
+			out << (i ? ",\n" : "\n") << "  {\"clients\": " << r.clients
+				<< ", \"ratePerClient\": " << r.rate
+				<< ", \"messages\": " << r.messages
+				<< ", \"messagesPerSecond\": " << r.messagesPerSecond
+				<< ", \"latencyNs\": {\"p50\": " << r.latency.Percentile(0.5)
+				<< ", \"p90\": " << r.latency.Percentile(0.9)
+				<< ", \"p99\": " << r.latency.Percentile(0.99)
+				<< ", \"p999\": " << r.latency.Percentile(0.999)
+				<< ", \"max\": " << r.latency.maxNs
+				<< ", \"mean\": " << r.latency.Mean() << "}"
+				<< ", \"cpuNsPerMessage\": " << r.cpuNsPerMessage
+				<< ", \"threads\": " << r.threads << "}";
+		}
+		out << "\n]}" << std::endl;
+		if (!out) {
+			std::cerr << "Error writing " << jsonFile << std::endl;
+			return 3;
+		}
+	}
+
+	return 0;
+}
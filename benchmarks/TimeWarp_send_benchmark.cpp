@@ -0,0 +1,148 @@
+/** @file
+	@brief Microbenchmark of the TimeWarpClient send path.
+
+	Measures the number of heap allocations and the latency of each call to
+	TimeWarpClient::SetTimeOffset(), and the per-offset cost of sending
+	batches with TimeWarpClient::SetTimeOffsets(), against a server running
+	in the same process.
+
+	@copyright 2019 Aqueti
+
+	@author ReliaSolve, working for Aqueti.
+*/
+
+#include <TimeWarp.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <thread>
+#include <vector>
+
+//=====================================================================================
+// Count every heap allocation made by the process, so that we can tell how
+// many the send path makes.
+static std::atomic<size_t> g_allocations(0);
+
+// All of the forms go through the same pair of functions, which are kept out
+// of line so that the compiler doesn't see malloc() and free() paired with
+// new and delete and warn that they are mismatched.
+#ifdef __GNUC__
+#define TIMEWARP_NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define TIMEWARP_NOINLINE __declspec(noinline)
+#else
+#define TIMEWARP_NOINLINE
+#endif
+static TIMEWARP_NOINLINE void* CountedAllocate(size_t size)
+{
+	g_allocations++;
+	void* p = std::malloc(size ? size : 1);
+	if (!p) { throw std::bad_alloc(); }
+	return p;
+}
+static TIMEWARP_NOINLINE void CountedFree(void* p) { std::free(p); }
+
+void* operator new(size_t size) { return CountedAllocate(size); }
+void* operator new[](size_t size) { return CountedAllocate(size); }
+void operator delete(void* p) noexcept { CountedFree(p); }
+void operator delete(void* p, size_t) noexcept { CountedFree(p); }
+void operator delete[](void* p) noexcept { CountedFree(p); }
+void operator delete[](void* p, size_t) noexcept { CountedFree(p); }
+
+//=====================================================================================
+static std::atomic<int64_t> g_received(0);
+
+void CallbackHandler(void* userData, int64_t timeOffset)
+{
+	g_received++;
+}
+
+/// @brief Wait until the server has received the specified number of offsets.
+static void WaitForReceived(int64_t count)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (g_received < count && std::chrono::steady_clock::now() < deadline) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	size_t count = 100000;
+	if (argc > 1) {
+		count = static_cast<size_t>(std::atoll(argv[1]));
+	}
+	uint16_t port = atl::TimeWarp::DefaultPort + 10;
+
+	atl::TimeWarp::TimeWarpServer svr(CallbackHandler, nullptr, port);
+	if (svr.GetErrorMessages().size()) {
+		std::cerr << "Error opening server" << std::endl;
+		return 1;
+	}
+	atl::TimeWarp::TimeWarpClient cli("localhost", port);
+	if (cli.GetErrorMessages().size()) {
+		std::cerr << "Error opening client" << std::endl;
+		return 2;
+	}
+
+	// Warm up the connection and the server.
+	for (int64_t i = 0; i < 1000; i++) {
+		cli.SetTimeOffset(i);
+	}
+	WaitForReceived(1000);
+	g_received = 0;
+
+	// Time each call separately, storing the results in a buffer that was
+	// allocated before we started counting.
+	std::vector<double> latencies(count);
+	size_t allocsBefore = g_allocations;
+	for (size_t i = 0; i < count; i++) {
+		auto start = std::chrono::steady_clock::now();
+		if (!cli.SetTimeOffset(static_cast<int64_t>(i))) {
+			std::cerr << "Error sending offset " << i << std::endl;
+			return 3;
+		}
+		latencies[i] = std::chrono::duration<double, std::micro>(
+			std::chrono::steady_clock::now() - start).count();
+	}
+	size_t allocs = g_allocations - allocsBefore;
+	WaitForReceived(static_cast<int64_t>(count));
+	g_received = 0;
+
+	std::sort(latencies.begin(), latencies.end());
+	std::cout << "SetTimeOffset calls: " << count << std::endl;
+	std::cout << "  allocations per call: " << static_cast<double>(allocs) / count << std::endl;
+	std::cout << "  p50 latency (us): " << latencies[count / 2] << std::endl;
+	std::cout << "  p99 latency (us): " << latencies[count * 99 / 100] << std::endl;
+
+	// Send the same number of offsets in batches and report the cost per offset.
+	const size_t batch = 64;
+	std::vector<int64_t> offsets(batch);
+	allocsBefore = g_allocations;
+	auto start = std::chrono::steady_clock::now();
+	size_t sent = 0;
+	while (sent < count) {
+		size_t n = std::min(batch, count - sent);
+		for (size_t i = 0; i < n; i++) {
+			offsets[i] = static_cast<int64_t>(sent + i);
+		}
+		if (!cli.SetTimeOffsets(offsets.data(), n)) {
+			std::cerr << "Error sending batch at " << sent << std::endl;
+			return 4;
+		}
+		sent += n;
+	}
+	double total = std::chrono::duration<double, std::micro>(
+		std::chrono::steady_clock::now() - start).count();
+	allocs = g_allocations - allocsBefore;
+	WaitForReceived(static_cast<int64_t>(count));
+
+	std::cout << "SetTimeOffsets batches of " << batch << ": " << (count + batch - 1) / batch << std::endl;
+	std::cout << "  allocations per call: " << static_cast<double>(allocs) / ((count + batch - 1) / batch) << std::endl;
+	std::cout << "  mean cost per offset (us): " << total / count << std::endl;
+
+	return 0;
+}
@@ -1,5 +1,9 @@
 /** @file
-	@brief Client time offset example code in C#.
+	@brief Client and server time offset example code in C#.
+
+	As a client, sends one offset, or with a COUNT sends that many offsets
+	in one batch call and then the same ones through the client's send queue.
+	As a server, prints each offset that arrives until Enter is pressed.
 
 	@copyright 2019 Aqueti
 
@@ -13,15 +17,39 @@ public class TimeWarp
     [DllImport("TimeWarp.dll", CallingConvention = CallingConvention.Cdecl)]
     public static extern int atl_TimeWarpClientCreate(string hostName, int port, string cardIP);
 
+    [DllImport("TimeWarp.dll", CallingConvention = CallingConvention.Cdecl)]
+    public static extern int atl_TimeWarpClientCreateAsync(string hostName, int port, string cardIP,
+        int queueSize);
+
     [DllImport("TimeWarp.dll")]
     public static extern bool atl_TimeWarpClientSetTimeOffset(int client, Int64 offset);
 
+    // Arrays of Int64 are blittable, so they are pinned and passed without
+    // being copied; wallTimes may be null.
+    [DllImport("TimeWarp.dll", CallingConvention = CallingConvention.Cdecl)]
+    public static extern bool atl_TimeWarpClientSetTimeOffsets(int client, Int64[] offsets,
+        Int64[] wallTimes, int count);
+
+    [DllImport("TimeWarp.dll", CallingConvention = CallingConvention.Cdecl)]
+    public static extern Int64 atl_TimeWarpClientSetTimeOffsetsAsync(int client, Int64[] offsets,
+        int count);
+
+    [DllImport("TimeWarp.dll", CallingConvention = CallingConvention.Cdecl)]
+    public static extern bool atl_TimeWarpClientFlush(int client, double timeoutSeconds);
+
     [DllImport("TimeWarp.dll")]
     public static extern bool atl_TimeWarpClientDestroy(int client);
 
-    public TimeWarp(string hostName, int port, string cardIP)
+    public TimeWarp(string hostName, int port, string cardIP, bool async = false)
     {
-        client = atl_TimeWarpClientCreate(hostName, port, cardIP);
+        if (async)
+        {
+            client = atl_TimeWarpClientCreateAsync(hostName, port, cardIP, -1);
+        }
+        else
+        {
+            client = atl_TimeWarpClientCreate(hostName, port, cardIP);
+        }
     }
 
     public bool SetTimeOffset(Int64 offset)
@@ -29,6 +57,29 @@ public class TimeWarp
         return atl_TimeWarpClientSetTimeOffset(client, offset);
     }
 
+    /// Send all of the offsets in one call, each applied at the matching
+    /// wall time (microseconds since the Unix epoch) if wallTimes is given.
+    public bool SetTimeOffsets(Int64[] offsets, Int64[] wallTimes = null)
+    {
+        if (wallTimes != null && wallTimes.Length != offsets.Length)
+        {
+            return false;
+        }
+        return atl_TimeWarpClientSetTimeOffsets(client, offsets, wallTimes, offsets.Length);
+    }
+
+    /// Queue the offsets to be sent without waiting for the network.
+    /// Only for objects constructed with async set.
+    public Int64 SetTimeOffsetsAsync(Int64[] offsets)
+    {
+        return atl_TimeWarpClientSetTimeOffsetsAsync(client, offsets, offsets.Length);
+    }
+
+    public bool Flush(double timeoutSeconds)
+    {
+        return atl_TimeWarpClientFlush(client, timeoutSeconds);
+    }
+
     ~TimeWarp()
     {
         atl_TimeWarpClientDestroy(client);
@@ -37,23 +88,117 @@ public class TimeWarp
     private int client = -1;
 }
 
+public class TimeWarpServer
+{
+    [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+    public delegate void Callback(IntPtr userData, Int64 offset);
+
+    [DllImport("TimeWarp.dll", CallingConvention = CallingConvention.Cdecl)]
+    public static extern int atl_TimeWarpServerCreate(int port, string cardIP, Callback callback,
+        IntPtr userData);
+
+    [DllImport("TimeWarp.dll", CallingConvention = CallingConvention.Cdecl)]
+    public static extern bool atl_TimeWarpServerGetTimeOffset(int server, out Int64 offset);
+
+    [DllImport("TimeWarp.dll", CallingConvention = CallingConvention.Cdecl)]
+    public static extern bool atl_TimeWarpServerDestroy(int server);
+
+    /// The handler is called on a thread belonging to the server.
+    public TimeWarpServer(int port, string cardIP, Action<Int64> handler)
+    {
+        // Keep the delegate in a field so that it is not collected while
+        // native code can still call it.
+        callback = (userData, offset) => handler(offset);
+        server = atl_TimeWarpServerCreate(port, cardIP, callback, IntPtr.Zero);
+    }
+
+    public bool IsOpen()
+    {
+        return server >= 0;
+    }
+
+    public bool GetTimeOffset(out Int64 offset)
+    {
+        return atl_TimeWarpServerGetTimeOffset(server, out offset);
+    }
+
+    ~TimeWarpServer()
+    {
+        atl_TimeWarpServerDestroy(server);
+    }
+
+    private Callback callback;
+    private int server = -1;
+}
+
 class main
 {
+    static int Usage()
+    {
+        System.Console.WriteLine("Usage: TimeWarp_client_example_CS HOST PORT OFFSET [COUNT]");
+        System.Console.WriteLine("       TimeWarp_client_example_CS --server PORT");
+        return 1;
+    }
+
+    static int Server(int port)
+    {
+        TimeWarpServer svr = new TimeWarpServer(port, "",
+            offset => System.Console.WriteLine("Offset: " + offset));
+        if (!svr.IsOpen())
+        {
+            System.Console.WriteLine("Could not open server");
+            return 2;
+        }
+        System.Console.WriteLine("Listening on port " + port + "; press Enter to quit");
+        System.Console.ReadLine();
+        GC.KeepAlive(svr);
+        return 0;
+    }
+
     static int Main(string[] args)
     {
-        if (args.Length != 3)
+        if (args.Length == 2 && args[0] == "--server")
+        {
+            return Server(Int32.Parse(args[1]));
+        }
+        if (args.Length != 3 && args.Length != 4)
         {
-            System.Console.WriteLine("Usage: TimeWarp_client_example_CS HOST PORT OFFSET");
-            return 1;
+            return Usage();
         }
         string host = args[0];
         int port = Int32.Parse(args[1]);
         Int64 offset = Int64.Parse(args[2]);
-        TimeWarp tw = new TimeWarp(host, port, "");
-        if (!tw.SetTimeOffset(offset))
+        if (args.Length == 3)
         {
-            System.Console.WriteLine("Could not set offset");
-            return 2;
+            TimeWarp tw = new TimeWarp(host, port, "");
+            if (!tw.SetTimeOffset(offset))
+            {
+                System.Console.WriteLine("Could not set offset");
+                return 2;
+            }
+            System.Console.WriteLine("Success!");
+            return 0;
+        }
+
+        // Send COUNT offsets leading up to OFFSET, first in one call and then
+        // through the send queue.
+        int count = Int32.Parse(args[3]);
+        Int64[] offsets = new Int64[count];
+        for (int i = 0; i < count; i++)
+        {
+            offsets[i] = offset - count + 1 + i;
+        }
+        TimeWarp batch = new TimeWarp(host, port, "");
+        if (!batch.SetTimeOffsets(offsets))
+        {
+            System.Console.WriteLine("Could not send batch of offsets");
+            return 3;
+        }
+        TimeWarp queued = new TimeWarp(host, port, "", true);
+        if (queued.SetTimeOffsetsAsync(offsets) < 0 || !queued.Flush(5.0))
+        {
+            System.Console.WriteLine("Could not send queued offsets");
+            return 4;
         }
 
         System.Console.WriteLine("Success!");
@@ -0,0 +1,103 @@
+/** @file
+	@brief Replays a TimeWarpServer journal against a server.
+
+	Reads the offsets recorded in a journal (see
+	TimeWarpServerOptions::journalPath) and sends them to a server in the
+	order they were recorded, so that its callback is driven just as the
+	original one was.  The offsets are sent with the same spacing that they
+	were recorded with, divided by the speed, or as fast as possible with a
+	speed of 0, which turns a journal into a load test.  Offsets that were
+	recorded for channels are sent to the same channels.
+
+	Usage: TimeWarp_journal_replay JOURNAL [--host localhost] [--port N]
+		[--speed 1]
+
+	@copyright 2019 Aqueti
+
+	@author ReliaSolve, working for Aqueti.
+*/
+
+#include <TimeWarp.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+int main(int argc, char* argv[])
+{
+	std::string journal;
+	std::string host = "localhost";
+	uint16_t port = atl::TimeWarp::DefaultPort;
+	double speed = 1;
+	for (int i = 1; i < argc; i++) {
+		if (0 == strcmp(argv[i], "--host") && i + 1 < argc) {
+			host = argv[++i];
+		} else if (0 == strcmp(argv[i], "--port") && i + 1 < argc) {
+			port = static_cast<uint16_t>(std::atoi(argv[++i]));
+		} else if (0 == strcmp(argv[i], "--speed") && i + 1 < argc) {
+			speed = std::atof(argv[++i]);
+		} else if (argv[i][0] != '-' && journal.empty()) {
+			journal = argv[i];
+		} else {
+			journal.clear();
+			break;
+		}
+	}
+	if (journal.empty() || speed < 0) {
+		std::cerr << "Usage: " << argv[0] << " JOURNAL [--host localhost] [--port N]"
+			<< " [--speed 1]" << std::endl;
+		return 1;
+	}
+
+	std::vector<atl::TimeWarp::TimeWarpJournalRecord> records;
+	std::string error;
+	if (!atl::TimeWarp::ReadTimeWarpJournal(journal, records, error)) {
+		std::cerr << error << std::endl;
+		return 2;
+	}
+	if (records.empty()) {
+		std::cout << "No offsets in " << journal << std::endl;
+		return 0;
+	}
+
+	atl::TimeWarp::TimeWarpClient cli(host, port);
+	if (cli.GetErrorMessages().size()) {
+		std::cerr << "Error opening client to " << host << ":" << port << std::endl;
+		return 3;
+	}
+
+	// Send each offset once it is due, together with any others that are
+	// due by then, up to a batch at a time.
+	const size_t BATCH = 1024;
+	std::vector<uint32_t> channels;
+	std::vector<int64_t> offsets;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < records.size(); ) {
+		if (speed > 0) {
+			std::chrono::duration<double, std::micro> due(
+				(records[i].wallTime - records[0].wallTime) / speed);
+			std::this_thread::sleep_until(start +
+				std::chrono::duration_cast<std::chrono::steady_clock::duration>(due));
+		}
+		double elapsed = std::chrono::duration<double, std::micro>(
+			std::chrono::steady_clock::now() - start).count();
+		channels.clear();
+		offsets.clear();
+		do {
+			channels.push_back(records[i].channel);
+			offsets.push_back(records[i].timeOffset);
+			i++;
+		} while (i < records.size() && channels.size() < BATCH &&
+			(speed == 0 || (records[i].wallTime - records[0].wallTime) / speed <= elapsed));
+		if (!cli.SetChannelOffsets(channels.data(), offsets.data(), channels.size())) {
+			std::cerr << "Error sending offsets to " << host << ":" << port << std::endl;
+			return 4;
+		}
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Replayed " << records.size() << " offsets in " << seconds << " s ("
+		<< records.size() / seconds << " per second)" << std::endl;
+	return 0;
+}
@@ -7,13 +7,37 @@
 */
 
 #include <TimeWarp.hpp>
+#include <CoreSocket.hpp>
+#include <atomic>
 #include <iostream>
 #include <thread>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
 
 struct STATE {
 	volatile int64_t timeOffset = 0;
 } g_state;
 
+static std::atomic<int64_t> g_subscribed(0);
+static std::atomic<int> g_subscribedCount(0);
+
+void SubscriberHandler(void* userData, int64_t timeOffset)
+{
+	g_subscribed = timeOffset;
+	g_subscribedCount++;
+}
+
 void CallbackHandler(void* userData, int64_t timeOffset)
 {
 	// Increment the count of messages received pointed to by userData
@@ -27,6 +51,55 @@ void CallbackHandler(void* userData, int64_t timeOffset)
 	std::cout << "Got time update: " << timeOffset << std::endl;
 }
 
+/// @brief Have a server's callback block on its first offset while a client
+///        sends a burst of 100 more, then let it go and record what it saw.
+/// @return False if the server or client could not be opened.
+static bool DeliverBlockedBurst(atl::TimeWarp::TimeWarpDelivery delivery, uint16_t port,
+	std::vector<int64_t>& seen, atl::TimeWarp::TimeWarpServerStats& stats)
+{
+	std::mutex lock;
+	std::condition_variable released;
+	bool open = false;
+	atl::TimeWarp::TimeWarpServerOptions opts;
+	opts.delivery = delivery;
+	atl::TimeWarp::TimeWarpServer svr([&](const atl::TimeWarp::TimeWarpUpdate& u) {
+		std::unique_lock<std::mutex> l(lock);
+		seen.push_back(u.timeOffset);
+		released.wait(l, [&]() { return open; });
+	}, opts, port);
+	atl::TimeWarp::TimeWarpClient cli("localhost", port);
+	if (svr.GetErrorMessages().size() || cli.GetErrorMessages().size()) {
+		return false;
+	}
+
+	// Wait for the callback to be holding on to the first offset, and then for
+	// the server to have read the whole burst.
+	cli.SetTimeOffset(0);
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+	while (std::chrono::steady_clock::now() < deadline) {
+		{
+			std::lock_guard<std::mutex> l(lock);
+			if (!seen.empty()) { break; }
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	for (int64_t to = 1; to <= 100; to++) {
+		cli.SetTimeOffset(to);
+	}
+	while (svr.GetStats().setTimeMessages < 101 && std::chrono::steady_clock::now() < deadline) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	stats = svr.GetStats();
+	{
+		std::lock_guard<std::mutex> l(lock);
+		open = true;
+	}
+	released.notify_all();
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	return true;
+}
+
 int main(int argc, char* argv[])
 {
 	// Start a server listening on the default port and make sure it
@@ -105,6 +178,749 @@ int main(int argc, char* argv[])
 	// Done with all of our objects!
 	delete cli;
 	delete svr;
+
+	// Start a server that multiplexes its connections onto event-loop threads
+	// and make sure that several clients can talk to it.
+	atl::TimeWarp::TimeWarpServerOptions loopOpts;
+	loopOpts.useEventLoop = true;
+	loopOpts.eventLoopThreads = 2;
+	uint16_t loopPort = atl::TimeWarp::DefaultPort + 1;
+	svr = new atl::TimeWarp::TimeWarpServer(CallbackHandler, &g_state, loopOpts, loopPort);
+	errs = svr->GetErrorMessages();
+	if (errs.size()) {
+		std::cerr << "Error(s) opening event-loop server:" << std::endl;
+		for (size_t i = 0; i < errs.size(); i++) {
+			std::cerr << "  " << errs[i] << std::endl;
+		}
+		return 9;
+	}
+	std::vector<atl::TimeWarp::TimeWarpClient*> clis;
+	for (size_t i = 0; i < 4; i++) {
+		clis.push_back(new atl::TimeWarp::TimeWarpClient("localhost", loopPort));
+		if (clis.back()->GetErrorMessages().size()) {
+			std::cerr << "Error opening client " << i << " to event-loop server" << std::endl;
+			return 10;
+		}
+	}
+	for (int64_t to = -1000; to <= 1000; to += 100) {
+		atl::TimeWarp::TimeWarpClient* c = clis[(to + 1000) / 100 % clis.size()];
+		if (!c->SetTimeOffset(to)) {
+			std::cerr << "Error updating time to " << to << " on event-loop server" << std::endl;
+			return 11;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		if (g_state.timeOffset != to) {
+			std::cerr << "Time mismatch after event-loop update: "
+				<< g_state.timeOffset << " != " << to << std::endl;
+			return 12;
+		}
+	}
+
+	// Send a schedule of offsets to be applied in the near future and make
+	// sure that they are applied when requested rather than when received.
+	{
+		int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+		std::vector<atl::TimeWarp::ScheduledTimeOffset> schedule;
+		for (int64_t i = 1; i <= 5; i++) {
+			atl::TimeWarp::ScheduledTimeOffset e;
+			e.wallTime = now + i * 20000;
+			e.timeOffset = 5000 + i;
+			schedule.push_back(e);
+		}
+		if (!clis[0]->SetTimeOffsetSchedule(schedule)) {
+			std::cerr << "Error sending schedule" << std::endl;
+			return 13;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		if (g_state.timeOffset == schedule.back().timeOffset) {
+			std::cerr << "Scheduled offset applied early" << std::endl;
+			return 14;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(150));
+		if (g_state.timeOffset != schedule.back().timeOffset) {
+			std::cerr << "Scheduled offset not applied: "
+				<< g_state.timeOffset << " != " << schedule.back().timeOffset << std::endl;
+			return 15;
+		}
+	}
+
+	for (size_t i = 0; i < clis.size(); i++) {
+		delete clis[i];
+	}
+	clis.clear();
+	delete svr;
+
+	// Make sure that servers in both modes shut down promptly while they
+	// have clients connected, rather than waiting for a polling loop to
+	// notice that they've been asked to quit.
+	for (int mode = 0; mode < 2; mode++) {
+		atl::TimeWarp::TimeWarpServerOptions opts;
+		opts.useEventLoop = (mode == 1);
+		svr = new atl::TimeWarp::TimeWarpServer(CallbackHandler, &g_state, opts, loopPort);
+		if (svr->GetErrorMessages().size()) {
+			std::cerr << "Error opening server for shutdown test" << std::endl;
+			return 16;
+		}
+		for (size_t i = 0; i < 16; i++) {
+			clis.push_back(new atl::TimeWarp::TimeWarpClient("localhost", loopPort));
+			if (clis.back()->GetErrorMessages().size()) {
+				std::cerr << "Error opening client " << i << " for shutdown test" << std::endl;
+				return 17;
+			}
+		}
+		// Let the server finish its handshakes and go idle.
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+		auto start = std::chrono::steady_clock::now();
+		delete svr;
+		double ms = std::chrono::duration<double, std::milli>(
+			std::chrono::steady_clock::now() - start).count();
+		std::cout << "Server destructor (" << (mode ? "event loop" : "threaded") << ", "
+			<< clis.size() << " clients) took " << ms << " ms" << std::endl;
+		if (ms > 50) {
+			std::cerr << "Server destructor took too long" << std::endl;
+			return 18;
+		}
+		for (size_t i = 0; i < clis.size(); i++) {
+			delete clis[i];
+		}
+		clis.clear();
+	}
+
+	// Queue a burst of offsets on an asynchronous client and make sure the
+	// last one arrives once the queue has been flushed.
+	{
+		svr = new atl::TimeWarp::TimeWarpServer(CallbackHandler, &g_state, loopPort);
+		atl::TimeWarp::TimeWarpClientOptions copts;
+		copts.asyncSend = true;
+		atl::TimeWarp::TimeWarpClient cli("localhost", copts, loopPort);
+		if (svr->GetErrorMessages().size() || cli.GetErrorMessages().size()) {
+			std::cerr << "Error opening async client and server" << std::endl;
+			return 19;
+		}
+		int64_t seq = 0;
+		for (int64_t i = 0; i < 100; i++) {
+			seq = cli.SetTimeOffsetAsync(7000 + i);
+		}
+		if (seq != 100 || !cli.Flush(1.0) || cli.GetStats().sentSequence != seq) {
+			std::cerr << "Async offsets were not sent" << std::endl;
+			return 20;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		if (g_state.timeOffset != 7099) {
+			std::cerr << "Last async offset not received: " << g_state.timeOffset << std::endl;
+			return 21;
+		}
+
+		// An acknowledged offset must have been applied by the time its
+		// acknowledgement arrives.
+		atl::TimeWarp::TimeWarpAck ack;
+		seq = cli.SetTimeOffsetAcked(8000);
+		if (seq != 1 || !cli.WaitForAck(seq, 1.0, &ack) || g_state.timeOffset != 8000) {
+			std::cerr << "Acknowledged offset failed" << std::endl;
+			return 22;
+		}
+		std::cout << "Acknowledged offset round trip " << ack.roundTripNs / 1000.0
+			<< " us, applied in " << ack.applyNs / 1000.0 << " us" << std::endl;
+		if (cli.GetStats().acksReceived != 1) {
+			std::cerr << "Acknowledgement not counted" << std::endl;
+			return 23;
+		}
+
+		// The server should have counted everything it was sent.  Using
+		// protocol version 2, that is the capabilities record, a four-byte
+		// first offset, three-byte deltas for the rest of the burst, and three
+		// and four bytes for the acknowledged one.
+		atl::TimeWarp::TimeWarpServerStats stats = svr->GetStats();
+		if (stats.activeConnections != 1 || stats.acceptedConnections != 1 ||
+				stats.setTimeMessages != 101 || stats.ackRequests != 1 ||
+				stats.compactConnections != 1 || cli.GetStats().protocolVersion != 2 ||
+				stats.callbacks != 101 || stats.bytesReceived != 16 + 4 + 99 * 3 + 3 + 4 ||
+				stats.callbackDuration.count != 101 || stats.errors != 0) {
+			std::cerr << "Unexpected server statistics" << std::endl;
+			return 24;
+		}
+		delete svr;
+	}
+
+	// Restart the server under a client that reconnects automatically and
+	// make sure that it catches the new server up with the latest offset.
+	// Clients sharing a connection should only open one.
+	{
+		atl::TimeWarp::TimeWarpClientOptions copts;
+		copts.autoReconnect = true;
+		copts.shareConnection = true;
+		svr = new atl::TimeWarp::TimeWarpServer(CallbackHandler, &g_state, loopPort);
+		atl::TimeWarp::TimeWarpClient cli("localhost", copts, loopPort);
+		atl::TimeWarp::TimeWarpClient shared("localhost", copts, loopPort);
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		if (!cli.GetStats().connected || svr->GetStats().acceptedConnections != 1) {
+			std::cerr << "Shared connection not opened once" << std::endl;
+			return 25;
+		}
+		delete svr;
+		if (!shared.SetTimeOffset(9000)) {
+			std::cerr << "Offset not accepted while reconnecting" << std::endl;
+			return 26;
+		}
+		svr = new atl::TimeWarp::TimeWarpServer(CallbackHandler, &g_state, loopPort);
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+		while (g_state.timeOffset != 9000 && std::chrono::steady_clock::now() < deadline) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		if (g_state.timeOffset != 9000 || cli.GetStats().reconnects != 1) {
+			std::cerr << "Latest offset not sent on reconnection" << std::endl;
+			return 27;
+		}
+		delete svr;
+	}
+
+	// Clients and servers that only speak protocol version 1 must still be
+	// understood, with either side falling back to it.
+	for (int mode = 0; mode < 2; mode++) {
+		atl::TimeWarp::TimeWarpServerOptions opts;
+		atl::TimeWarp::TimeWarpClientOptions copts;
+		if (mode == 0) {
+			opts.protocolVersion = 1;
+		} else {
+			copts.protocolVersion = 1;
+		}
+		svr = new atl::TimeWarp::TimeWarpServer(CallbackHandler, &g_state, opts, loopPort);
+		atl::TimeWarp::TimeWarpClient cli("localhost", copts, loopPort);
+		if (svr->GetErrorMessages().size() || cli.GetErrorMessages().size() ||
+				cli.GetStats().protocolVersion != 1) {
+			std::cerr << "Protocol version 1 not used" << std::endl;
+			return 28;
+		}
+		int64_t seq = cli.SetTimeOffsetAcked(10000 + mode);
+		if (!cli.WaitForAck(seq, 1.0) || g_state.timeOffset != 10000 + mode ||
+				cli.GetErrorMessages().size() || svr->GetStats().compactConnections != 0) {
+			std::cerr << "Protocol version 1 fallback failed" << std::endl;
+			return 29;
+		}
+		delete svr;
+	}
+
+	// A monitoring client should be able to ask the server for its current
+	// offset and to hear about each new one.
+	{
+		svr = new atl::TimeWarp::TimeWarpServer(CallbackHandler, &g_state, loopPort);
+		atl::TimeWarp::TimeWarpClient monitor("localhost", loopPort);
+		atl::TimeWarp::TimeWarpClient sender("localhost", loopPort);
+		int64_t offset;
+		if (monitor.QueryTimeOffset(offset) || svr->GetTimeOffset(offset) ||
+				!monitor.Subscribe(SubscriberHandler, nullptr)) {
+			std::cerr << "Unexpected offset before any were sent" << std::endl;
+			return 30;
+		}
+		for (int64_t to = 11000; to < 11005; to++) {
+			sender.SetTimeOffset(to);
+		}
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+		while (g_subscribed != 11004 && std::chrono::steady_clock::now() < deadline) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		if (g_subscribed != 11004 || g_subscribedCount != 5) {
+			std::cerr << "Subscriber saw " << g_subscribedCount << " offsets ending with "
+				<< g_subscribed << std::endl;
+			return 31;
+		}
+		if (!monitor.QueryTimeOffset(offset) || offset != 11004 ||
+				!svr->GetTimeOffset(offset) || offset != 11004) {
+			std::cerr << "Current offset not reported" << std::endl;
+			return 32;
+		}
+		atl::TimeWarp::TimeWarpServerStats stats = svr->GetStats();
+		if (stats.queries != 2 || stats.subscribers != 1 || !monitor.Unsubscribe()) {
+			std::cerr << "Unexpected query statistics" << std::endl;
+			return 33;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		if (svr->GetStats().subscribers != 0 || monitor.GetErrorMessages().size()) {
+			std::cerr << "Unsubscribe failed" << std::endl;
+			return 34;
+		}
+		delete svr;
+	}
+
+	// A ramp should pass through intermediate offsets and end exactly on
+	// its target.
+	{
+		atl::TimeWarp::TimeWarpServerOptions opts;
+		opts.rampUpdateRate = 1000;
+		svr = new atl::TimeWarp::TimeWarpServer(CallbackHandler, &g_state, opts, loopPort);
+		atl::TimeWarp::TimeWarpClient cli("localhost", loopPort);
+		cli.SetTimeOffset(0);
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		if (!cli.RampTimeOffset(100000, 0.1, atl::TimeWarp::TimeWarpRampCurve::EASE_IN_OUT)) {
+			std::cerr << "Error sending ramp" << std::endl;
+			return 35;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		int64_t middle = g_state.timeOffset;
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		atl::TimeWarp::TimeWarpServerStats stats = svr->GetStats();
+		std::cout << "Ramp reached " << middle << " half way with " << stats.rampUpdates
+			<< " updates" << std::endl;
+		if (middle <= 0 || middle >= 100000 || g_state.timeOffset != 100000 ||
+				stats.ramps != 1 || stats.rampUpdates < 10) {
+			std::cerr << "Ramp did not go smoothly" << std::endl;
+			return 36;
+		}
+		delete svr;
+	}
+
+	// A typed handler should hear where each offset came from and why.
+	{
+		std::mutex lock;
+		std::vector<atl::TimeWarp::TimeWarpUpdate> updates;
+		svr = new atl::TimeWarp::TimeWarpServer(
+			[&](const atl::TimeWarp::TimeWarpUpdate& u) {
+				std::lock_guard<std::mutex> l(lock);
+				updates.push_back(u);
+			}, atl::TimeWarp::TimeWarpServerOptions(), loopPort);
+		atl::TimeWarp::TimeWarpClient cli("localhost", loopPort);
+		cli.SetTimeOffset(7);
+		atl::TimeWarp::ScheduledTimeOffset e;
+		e.wallTime = 0;
+		e.timeOffset = 8;
+		cli.SetTimeOffsetSchedule({ e });
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		delete svr;
+		if (updates.size() != 2) {
+			std::cerr << "Handler saw " << updates.size() << " updates" << std::endl;
+			return 37;
+		}
+		if (updates[0].kind != atl::TimeWarp::TimeWarpUpdateKind::SET_TIME ||
+				updates[0].timeOffset != 7 ||
+				updates[1].kind != atl::TimeWarp::TimeWarpUpdateKind::SCHEDULED ||
+				updates[1].timeOffset != 8 ||
+				updates[0].connection != updates[1].connection ||
+				updates[1].sequence != updates[0].sequence + 1 ||
+				updates[1].receivedNs < updates[0].receivedNs) {
+			std::cerr << "Handler saw the wrong updates" << std::endl;
+			return 38;
+		}
+	}
+
+	// A peer that never finishes its handshake should not hold up others, and
+	// should be dropped once it runs out of time.  Clients connecting in the
+	// background should all get through.
+	{
+		atl::TimeWarp::TimeWarpServerOptions opts;
+		opts.handshakeTimeout = 0.1;
+		svr = new atl::TimeWarp::TimeWarpServer(CallbackHandler, &g_state, opts, loopPort);
+		atl::CoreSocket::SOCKET silent;
+		if (!atl::CoreSocket::connect_tcp_to("localhost", loopPort, nullptr, &silent)) {
+			std::cerr << "Could not open silent connection" << std::endl;
+			return 39;
+		}
+		atl::TimeWarp::TimeWarpClientOptions copts;
+		copts.connectAsync = true;
+		std::vector<std::unique_ptr<atl::TimeWarp::TimeWarpClient> > clients;
+		for (size_t i = 0; i < 50; i++) {
+			clients.emplace_back(new atl::TimeWarp::TimeWarpClient("localhost", copts, loopPort));
+		}
+		for (auto& c : clients) {
+			if (!c->WaitForConnection(2.0) || !c->SetTimeOffset(1)) {
+				std::cerr << "Client did not connect in the background" << std::endl;
+				return 40;
+			}
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		atl::TimeWarp::TimeWarpServerStats stats = svr->GetStats();
+		if (stats.handshakeFailures != 1 || stats.activeConnections != clients.size()) {
+			std::cerr << "Silent connection not dropped: " << stats.handshakeFailures
+				<< " failures, " << stats.activeConnections << " active" << std::endl;
+			return 41;
+		}
+		atl::CoreSocket::close_socket(silent);
+		clients.clear();
+		delete svr;
+	}
+
+	// Offsets for several channels sent in one batch should reach each
+	// channel's callback and leave the main timeline alone.
+	{
+		std::atomic<int64_t> seen[3];
+		for (auto& v : seen) { v = -1; }
+		svr = new atl::TimeWarp::TimeWarpServer(CallbackHandler, &g_state,
+			atl::TimeWarp::TimeWarpServerOptions(), loopPort);
+		for (uint32_t ch = 1; ch <= 2; ch++) {
+			svr->SetChannelCallback(ch, [](void* userData, uint32_t channel, int64_t timeOffset) {
+				static_cast<std::atomic<int64_t>*>(userData)[channel] = timeOffset;
+			}, seen);
+		}
+		atl::TimeWarp::TimeWarpClient cli("localhost", loopPort);
+		cli.SetTimeOffset(5);
+		const uint32_t channels[] = { 1, 2, 2, 3 };
+		const int64_t offsets[] = { 100, 200, 201, 300 };
+		if (!cli.SetChannelOffsets(channels, offsets, 4)) {
+			std::cerr << "Error sending channel offsets" << std::endl;
+			return 42;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		int64_t main = 0, third = 0;
+		bool ok = svr->GetTimeOffset(main) && svr->GetChannelOffset(3, third);
+		atl::TimeWarp::TimeWarpServerStats stats = svr->GetStats();
+		delete svr;
+		if (!ok || seen[1] != 100 || seen[2] != 201 || third != 300 || main != 5 ||
+				g_state.timeOffset != 5 || stats.channels != 3 || stats.channelMessages != 4) {
+			std::cerr << "Channel offsets not delivered: " << seen[1] << ", " << seen[2]
+				<< ", " << third << ", main " << main << std::endl;
+			return 43;
+		}
+	}
+
+	// Two servers told to apply an offset at the same instant on the client's
+	// clock should do so together, once each client has measured its server's
+	// clock.  On loopback the clocks are the same, so the estimate should be
+	// close to zero.
+	{
+		typedef std::chrono::system_clock clock;
+		std::atomic<int64_t> fired[2];
+		atl::TimeWarp::TimeWarpServer* svrs[2];
+		atl::TimeWarp::TimeWarpClient* syncClis[2];
+		for (size_t i = 0; i < 2; i++) {
+			fired[i] = 0;
+			std::atomic<int64_t>* when = &fired[i];
+			svrs[i] = new atl::TimeWarp::TimeWarpServer(
+				[when](const atl::TimeWarp::TimeWarpUpdate&) {
+					*when = std::chrono::duration_cast<std::chrono::microseconds>(
+						clock::now().time_since_epoch()).count();
+				}, atl::TimeWarp::TimeWarpServerOptions(), loopPort + 3 * i);
+			syncClis[i] = new atl::TimeWarp::TimeWarpClient("localhost", loopPort + 3 * i);
+		}
+		int64_t clockOffset[2], clockDelay[2];
+		for (size_t i = 0; i < 2; i++) {
+			if (!syncClis[i]->SyncClock() ||
+					!syncClis[i]->GetClockOffset(clockOffset[i], clockDelay[i]) ||
+					clockOffset[i] < -1000 || clockOffset[i] > 1000) {
+				std::cerr << "Could not estimate loopback clock offset" << std::endl;
+				return 44;
+			}
+		}
+		int64_t at = std::chrono::duration_cast<std::chrono::microseconds>(
+			clock::now().time_since_epoch()).count() + 100000;
+		for (size_t i = 0; i < 2; i++) {
+			syncClis[i]->SetTimeOffsetAt(1234, at);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		int64_t late[2] = { fired[0] - at, fired[1] - at };
+		std::cout << "Clock offsets " << clockOffset[0] << ", " << clockOffset[1]
+			<< " us (delays " << clockDelay[0] << ", " << clockDelay[1]
+			<< " us); applied " << late[0] << ", " << late[1] << " us late; residual skew "
+			<< std::abs(late[0] - late[1]) << " us" << std::endl;
+		for (size_t i = 0; i < 2; i++) {
+			delete syncClis[i];
+			delete svrs[i];
+		}
+		if (late[0] < -1000 || late[1] < -1000 || late[0] > 20000 || late[1] > 20000 ||
+				std::abs(late[0] - late[1]) > 5000) {
+			std::cerr << "Offsets not applied at the requested instant" << std::endl;
+			return 45;
+		}
+	}
+
+	// A client sending as fast as it can should be held to its rate, with
+	// its newest offset delivered in the end, and connections beyond the
+	// limit should be turned away.
+	{
+		atl::TimeWarp::TimeWarpServerOptions opts;
+		opts.maxOffsetsPerSecond = 100;
+		opts.rateLimitBurst = 5;
+		opts.maxConnections = 2;
+		svr = new atl::TimeWarp::TimeWarpServer(CallbackHandler, &g_state, opts, loopPort);
+		atl::TimeWarp::TimeWarpClient flood("localhost", loopPort);
+		for (int64_t to = 1; to <= 200; to++) {
+			flood.SetTimeOffset(to);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		atl::TimeWarp::TimeWarpServerStats stats = svr->GetStats();
+		if (g_state.timeOffset != 200 || stats.callbacks > 20 ||
+				stats.rateLimitCoalesced + stats.callbacks != 200) {
+			std::cerr << "Rate limit not applied: " << stats.callbacks << " callbacks, "
+				<< stats.rateLimitCoalesced << " coalesced, last " << g_state.timeOffset << std::endl;
+			return 46;
+		}
+		atl::TimeWarp::TimeWarpClient second("localhost", loopPort);
+		atl::TimeWarp::TimeWarpClient third("localhost", loopPort);
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		stats = svr->GetStats();
+		delete svr;
+		if (second.GetErrorMessages().size() || third.GetErrorMessages().empty() ||
+				stats.rejectedConnections != 1 || stats.activeConnections != 2) {
+			std::cerr << "Connection limit not applied: " << stats.rejectedConnections
+				<< " rejected, " << stats.activeConnections << " active" << std::endl;
+			return 47;
+		}
+	}
+
+#ifndef _WIN32
+	// A server keeping a journal should record every offset it delivers and
+	// start from the latest ones when it is opened again.
+	{
+		const char* path = "/tmp/timewarp_test.journal";
+		std::remove(path);
+		atl::TimeWarp::TimeWarpServerOptions opts;
+		opts.journalPath = path;
+		svr = new atl::TimeWarp::TimeWarpServer(CallbackHandler, &g_state, opts, loopPort);
+		{
+			atl::TimeWarp::TimeWarpClient cli("localhost", loopPort);
+			cli.SetTimeOffset(11);
+			cli.SetChannelOffset(2, 20);
+			cli.WaitForAck(cli.SetTimeOffsetAcked(12), 1.0);
+		}
+		delete svr;
+		std::vector<atl::TimeWarp::TimeWarpJournalRecord> records;
+		std::string error;
+		if (!atl::TimeWarp::ReadTimeWarpJournal(path, records, error) || records.size() != 3 ||
+				records[0].timeOffset != 11 || records[1].channel != 2 ||
+				records[1].timeOffset != 20 || records[2].timeOffset != 12 ||
+				records[2].wallTime < records[0].wallTime) {
+			std::cerr << "Journal not written: " << error << std::endl;
+			return 48;
+		}
+		svr = new atl::TimeWarp::TimeWarpServer(CallbackHandler, &g_state, opts, loopPort);
+		int64_t main = 0, channel = 0;
+		bool ok = svr->GetTimeOffset(main) && svr->GetChannelOffset(2, channel);
+		atl::TimeWarp::TimeWarpServerStats stats = svr->GetStats();
+		delete svr;
+		std::remove(path);
+		if (!ok || main != 12 || channel != 20 || stats.journalRecovered != 3) {
+			std::cerr << "Journal not recovered: " << main << ", " << channel << std::endl;
+			return 49;
+		}
+	}
+
+	// Talk to a server over a Unix-domain socket and a shared-memory segment
+	// selected by URI.
+	{
+		atl::TimeWarp::TimeWarpServerOptions opts;
+		opts.endpoints = { "unix:///tmp/timewarp_test.sock", "shm://timewarp_test" };
+		svr = new atl::TimeWarp::TimeWarpServer(CallbackHandler, &g_state, opts, loopPort);
+		errs = svr->GetErrorMessages();
+		if (errs.size()) {
+			std::cerr << "Error(s) opening local-transport server:" << std::endl;
+			for (size_t i = 0; i < errs.size(); i++) {
+				std::cerr << "  " << errs[i] << std::endl;
+			}
+			return 50;
+		}
+		const char* uris[] = { "unix:///tmp/timewarp_test.sock", "shm://timewarp_test" };
+		for (size_t u = 0; u < 2; u++) {
+			atl::TimeWarp::TimeWarpClient cli(uris[u]);
+			if (cli.GetErrorMessages().size()) {
+				std::cerr << "Error opening client on " << uris[u] << std::endl;
+				return 51;
+			}
+			for (int64_t to = -1000; to <= 1000; to += 500) {
+				if (!cli.SetTimeOffset(to)) {
+					std::cerr << "Error updating time over " << uris[u] << std::endl;
+					return 52;
+				}
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				if (g_state.timeOffset != to) {
+					std::cerr << "Time mismatch over " << uris[u] << ": "
+						<< g_state.timeOffset << " != " << to << std::endl;
+					return 53;
+				}
+			}
+		}
+		delete svr;
+	}
+#endif
+
+	// An offset from another connection that arrives part way through a ramp
+	// should stop it and be the last offset delivered, even though the two
+	// connections are served by different dispatchers.
+	{
+		atl::TimeWarp::TimeWarpServerOptions opts;
+		opts.rampUpdateRate = 1000;
+		opts.dispatchThreads = 2;
+		svr = new atl::TimeWarp::TimeWarpServer(CallbackHandler, &g_state, opts, loopPort);
+		atl::TimeWarp::TimeWarpClient ramper("localhost", loopPort);
+		atl::TimeWarp::TimeWarpClient jumper("localhost", loopPort);
+		ramper.SetTimeOffset(0);
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		if (!ramper.RampTimeOffset(100000, 0.1)) {
+			std::cerr << "Error sending ramp to be stopped" << std::endl;
+			return 54;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(30));
+		jumper.SetTimeOffset(-5);
+		std::this_thread::sleep_for(std::chrono::milliseconds(150));
+		atl::TimeWarp::TimeWarpServerStats stats = svr->GetStats();
+		delete svr;
+		if (g_state.timeOffset != -5 || stats.ramps != 1 || stats.rampUpdates >= 80) {
+			std::cerr << "Ramp not stopped by a direct offset: ended on " << g_state.timeOffset
+				<< " after " << stats.rampUpdates << " updates" << std::endl;
+			return 55;
+		}
+	}
+
+	// Clients sharing a connection should each have their own subscription,
+	// and one of them unsubscribing should not end the other's.
+	{
+		svr = new atl::TimeWarp::TimeWarpServer(CallbackHandler, &g_state, loopPort);
+		atl::TimeWarp::TimeWarpClientOptions copts;
+		copts.shareConnection = true;
+		atl::TimeWarp::TimeWarpClient first("localhost", copts, loopPort);
+		atl::TimeWarp::TimeWarpClient second("localhost", copts, loopPort);
+		atl::TimeWarp::TimeWarpClient sender("localhost", loopPort);
+		std::atomic<int64_t> heard[2];
+		for (auto& v : heard) { v = -1; }
+		atl::TimeWarp::TimeWarpSubscriberCallback record = [](void* userData, int64_t timeOffset) {
+			*static_cast<std::atomic<int64_t>*>(userData) = timeOffset;
+		};
+		if (!first.Subscribe(record, &heard[0]) || !second.Subscribe(record, &heard[1])) {
+			std::cerr << "Error subscribing on a shared connection" << std::endl;
+			return 56;
+		}
+		sender.SetTimeOffset(12000);
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		if (heard[0] != 12000 || heard[1] != 12000) {
+			std::cerr << "Shared subscribers heard " << heard[0] << " and " << heard[1] << std::endl;
+			return 57;
+		}
+		first.Unsubscribe();
+		sender.SetTimeOffset(12001);
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		atl::TimeWarp::TimeWarpServerStats stats = svr->GetStats();
+		delete svr;
+		if (heard[0] != 12000 || heard[1] != 12001 || stats.subscribers != 1) {
+			std::cerr << "Unsubscribing one shared client affected the other: heard "
+				<< heard[0] << " and " << heard[1] << std::endl;
+			return 58;
+		}
+	}
+
+	// A callback that falls behind should still see every offset, in order,
+	// with the whole burst having waited in the dispatcher's queue.
+	{
+		std::vector<int64_t> seen;
+		atl::TimeWarp::TimeWarpServerStats stats;
+		if (!DeliverBlockedBurst(atl::TimeWarp::TimeWarpDelivery::EVERY_OFFSET, loopPort,
+				seen, stats)) {
+			std::cerr << "Error opening server for blocked delivery" << std::endl;
+			return 59;
+		}
+		bool inOrder = seen.size() == 101;
+		for (size_t i = 0; inOrder && i < seen.size(); i++) {
+			inOrder = seen[i] == static_cast<int64_t>(i);
+		}
+		if (!inOrder || stats.dispatchQueueHighWater != 100 || stats.coalescedOffsets != 0) {
+			std::cerr << "Blocked callback saw " << seen.size() << " offsets, queue high water "
+				<< stats.dispatchQueueHighWater << std::endl;
+			return 60;
+		}
+	}
+
+	// In the LATEST modes, the callback should only see the newest offset of
+	// the burst, with the others counted as coalesced and only one entry ever
+	// waiting in the queue.
+	const atl::TimeWarp::TimeWarpDelivery latest[] = {
+		atl::TimeWarp::TimeWarpDelivery::LATEST_PER_CONNECTION,
+		atl::TimeWarp::TimeWarpDelivery::LATEST_GLOBAL };
+	for (size_t mode = 0; mode < 2; mode++) {
+		std::vector<int64_t> seen;
+		atl::TimeWarp::TimeWarpServerStats stats;
+		if (!DeliverBlockedBurst(latest[mode], loopPort, seen, stats)) {
+			std::cerr << "Error opening server for latest-offset delivery" << std::endl;
+			return 61;
+		}
+		if (seen.size() != 2 || seen[0] != 0 || seen[1] != 100 ||
+				stats.coalescedOffsets != 99 || stats.dispatchQueueHighWater != 1) {
+			std::cerr << "Latest-offset delivery saw " << seen.size() << " offsets, "
+				<< stats.coalescedOffsets << " coalesced, queue high water "
+				<< stats.dispatchQueueHighWater << std::endl;
+			return 62;
+		}
+	}
+
+#ifndef _WIN32
+	// Offsets published by multicast should reach a server that has joined the
+	// group, with a server that joins late catching up from the publisher.
+	// Everything stays on the loopback interface.
+	{
+		const char* group = "239.255.29.84";
+		const uint16_t recoveryPort = loopPort + 7;
+		atl::TimeWarp::TimeWarpClientOptions copts;
+		copts.multicast = true;
+		copts.multicastRecoveryPort = recoveryPort;
+		atl::TimeWarp::TimeWarpClient publisher(group, copts, loopPort, "127.0.0.1");
+		if (publisher.GetErrorMessages().size() || !publisher.SetTimeOffset(13000)) {
+			std::cerr << "Error opening multicast publisher" << std::endl;
+			return 63;
+		}
+		atl::TimeWarp::TimeWarpServerOptions opts;
+		opts.multicastGroup = group;
+		opts.multicastPublisherHost = "localhost";
+		opts.multicastPublisherPort = recoveryPort;
+		svr = new atl::TimeWarp::TimeWarpServer(CallbackHandler, &g_state, opts, loopPort, "127.0.0.1");
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		if (svr->GetErrorMessages().size() || g_state.timeOffset != 13000 ||
+				svr->GetStats().multicastRecovered != 1) {
+			std::cerr << "Late-joining multicast server did not catch up" << std::endl;
+			return 64;
+		}
+		for (int64_t to = 13001; to <= 13005; to++) {
+			publisher.SetTimeOffset(to);
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		if (g_state.timeOffset != 13005 || svr->GetStats().multicastGaps != 0) {
+			std::cerr << "Multicast offsets not received: " << g_state.timeOffset << std::endl;
+			return 65;
+		}
+
+		// Replay the publisher's second and sixth datagrams from another
+		// socket, which the server takes for a publisher whose third to fifth
+		// were lost.  It should fetch those from the real publisher's history
+		// and deliver them in order before the sixth.  The format is private
+		// to TimeWarp.cpp: a cookie, then sequence, op, offset and the port
+		// that recovery requests go to.
+		std::vector<int64_t> delivered;
+		std::mutex deliveredMutex;
+		delete svr;
+		svr = new atl::TimeWarp::TimeWarpServer(
+			[&](const atl::TimeWarp::TimeWarpUpdate& u) {
+				std::lock_guard<std::mutex> l(deliveredMutex);
+				delivered.push_back(u.timeOffset);
+			}, opts, loopPort, "127.0.0.1");
+		int s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		struct in_addr nic;
+		inet_pton(AF_INET, "127.0.0.1", &nic);
+		setsockopt(s, IPPROTO_IP, IP_MULTICAST_IF, &nic, sizeof(nic));
+		struct sockaddr_in to;
+		memset(&to, 0, sizeof(to));
+		to.sin_family = AF_INET;
+		to.sin_port = htons(loopPort);
+		inet_pton(AF_INET, group, &to.sin_addr);
+		const int64_t sent[2][2] = { { 2, 13001 }, { 6, 13005 } };
+		for (auto& d : sent) {
+			int64_t fields[5] = { atl::CoreSocket::hton(static_cast<int64_t>(0x54574D4300000001LL)),
+				atl::CoreSocket::hton(d[0]), atl::CoreSocket::hton(static_cast<int64_t>(1)),
+				atl::CoreSocket::hton(d[1]), atl::CoreSocket::hton(static_cast<int64_t>(recoveryPort)) };
+			sendto(s, fields, sizeof(fields), 0, reinterpret_cast<struct sockaddr*>(&to), sizeof(to));
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		}
+		close(s);
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		atl::TimeWarp::TimeWarpServerStats stats = svr->GetStats();
+		delete svr;
+		// The first offset is the late joiner's catch-up from the publisher.
+		const std::vector<int64_t> expected = { 13005, 13001, 13002, 13003, 13004, 13005 };
+		if (delivered != expected || stats.multicastGaps != 3 || stats.multicastRecovered != 4) {
+			std::cerr << "Missed multicast datagrams not recovered: " << delivered.size()
+				<< " delivered, " << stats.multicastGaps << " gaps, "
+				<< stats.multicastRecovered << " recovered" << std::endl;
+			return 66;
+		}
+	}
+#endif
+
 	std::cout << "Success!" << std::endl;
 	return 0;
 }
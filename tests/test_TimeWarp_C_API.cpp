@@ -0,0 +1,220 @@
+/** @file
+	@brief Multi-threaded stress test of the TimeWarp client C API.
+
+	Several threads send offsets through their own client handles while
+	another keeps creating and destroying clients and a third hammers handles
+	that are stale.  Clients are also destroyed while in use.  Every offset
+	sent on a live handle must arrive, and no call on a bad handle may
+	succeed.  Finally the batch, scheduled and queued sends are checked
+	against a server made through the C API.
+
+	@copyright 2019 Aqueti
+
+	@author ReliaSolve, working for Aqueti.
+*/
+
+#include <TimeWarp.hpp>
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <vector>
+
+static std::atomic<int64_t> g_received(0);
+
+void CallbackHandler(void* userData, int64_t timeOffset)
+{
+	g_received++;
+}
+
+static std::atomic<int64_t> g_cReceived(0);
+static std::atomic<int64_t> g_cSum(0);
+
+void CCallbackHandler(void* userData, int64_t timeOffset)
+{
+	g_cReceived++;
+	g_cSum += timeOffset;
+}
+
+/// @brief Wait until the C API server has received the specified number of offsets.
+static bool WaitForC(int64_t count)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (g_cReceived < count && std::chrono::steady_clock::now() < deadline) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return g_cReceived == count;
+}
+
+int main(int argc, char* argv[])
+{
+	const int port = atl::TimeWarp::DefaultPort + 3;
+	atl::TimeWarp::TimeWarpServer svr(CallbackHandler, nullptr, port);
+	if (svr.GetErrorMessages().size()) {
+		std::cerr << "Error opening server" << std::endl;
+		return 1;
+	}
+
+	// Handles that were never valid must be rejected.
+	if (atl_TimeWarpClientSetTimeOffset(-1, 0) || atl_TimeWarpClientSetTimeOffset(12345, 0) ||
+			atl_TimeWarpClientDestroy(-1) || atl_TimeWarpClientDestroy(12345)) {
+		std::cerr << "Bogus handle accepted" << std::endl;
+		return 2;
+	}
+
+	// A destroyed handle must stay invalid even once its slot is reused.
+	int first = atl_TimeWarpClientCreate("localhost", port, "");
+	if (first < 0 || !atl_TimeWarpClientDestroy(first)) {
+		std::cerr << "Could not create and destroy a client" << std::endl;
+		return 3;
+	}
+	int second = atl_TimeWarpClientCreate("localhost", port, "");
+	if (second < 0 || second == first || atl_TimeWarpClientSetTimeOffset(first, 0) ||
+			atl_TimeWarpClientDestroy(first) || !atl_TimeWarpClientDestroy(second)) {
+		std::cerr << "Stale handle accepted" << std::endl;
+		return 4;
+	}
+
+	// Destroy a client while another thread is using it; calls must start
+	// failing cleanly once it is gone.
+	int victim = atl_TimeWarpClientCreate("localhost", port, "");
+	std::atomic<int64_t> victimSent(0);
+	std::thread user([&]() {
+		while (atl_TimeWarpClientSetTimeOffset(victim, 0)) {
+			victimSent++;
+		}
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	if (victim < 0 || !atl_TimeWarpClientDestroy(victim)) {
+		std::cerr << "Could not destroy client in use" << std::endl;
+		return 6;
+	}
+	user.join();
+
+	const size_t senders = 8;
+	const int64_t perSender = 2000;
+	std::vector<int> handles;
+	for (size_t i = 0; i < senders; i++) {
+		handles.push_back(atl_TimeWarpClientCreate("localhost", port, ""));
+		if (handles.back() < 0) {
+			std::cerr << "Could not create client " << i << std::endl;
+			return 5;
+		}
+	}
+
+	std::atomic<bool> done(false);
+	std::atomic<int> failures(0);
+	std::vector<int> stale;
+
+	// Keep creating and destroying clients, remembering their handles.
+	std::thread churn([&]() {
+		for (int i = 0; i < 50; i++) {
+			int h = atl_TimeWarpClientCreate("localhost", port, "");
+			if (h < 0 || !atl_TimeWarpClientSetTimeOffset(h, 0) || !atl_TimeWarpClientDestroy(h)) {
+				failures++;
+			}
+			stale.push_back(h);
+		}
+	});
+
+	// Keep trying handles that are stale while the others work.
+	std::atomic<int64_t> badAccepted(0);
+	std::thread bad([&]() {
+		while (!done) {
+			if (atl_TimeWarpClientSetTimeOffset(first, 0) || atl_TimeWarpClientSetTimeOffset(second, 0)) {
+				badAccepted++;
+			}
+		}
+	});
+
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < senders; i++) {
+		int h = handles[i];
+		threads.emplace_back([&, h]() {
+			for (int64_t j = 0; j < perSender; j++) {
+				if (!atl_TimeWarpClientSetTimeOffset(h, j)) {
+					failures++;
+				}
+			}
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	churn.join();
+	done = true;
+	bad.join();
+
+	if (failures) {
+		std::cerr << failures << " calls on live handles failed" << std::endl;
+		return 7;
+	}
+	for (int h : stale) {
+		if (atl_TimeWarpClientSetTimeOffset(h, 0) || atl_TimeWarpClientDestroy(h)) {
+			badAccepted++;
+		}
+	}
+	if (badAccepted) {
+		std::cerr << badAccepted << " calls on destroyed handles succeeded" << std::endl;
+		return 8;
+	}
+
+	// Every offset sent on a live handle (plus one from each churned client) must arrive.
+	int64_t expected = senders * perSender + 50 + victimSent;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (g_received < expected && std::chrono::steady_clock::now() < deadline) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	if (g_received != expected) {
+		std::cerr << "Received " << g_received << " of " << expected << " offsets" << std::endl;
+		return 9;
+	}
+
+	for (int h : handles) {
+		if (!atl_TimeWarpClientDestroy(h)) {
+			std::cerr << "Could not destroy client" << std::endl;
+			return 10;
+		}
+	}
+
+	// Batches, schedules and queued sends through a server made by the C API.
+	const int cPort = atl::TimeWarp::DefaultPort + 5;
+	int server = atl_TimeWarpServerCreate(cPort, nullptr, CCallbackHandler, nullptr);
+	int batcher = atl_TimeWarpClientCreate("localhost", cPort, "");
+	if (server < 0 || batcher < 0) {
+		std::cerr << "Could not create C API server and client" << std::endl;
+		return 11;
+	}
+	std::vector<int64_t> offsets(100);
+	std::vector<int64_t> wallTimes(offsets.size());
+	int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+	for (size_t i = 0; i < offsets.size(); i++) {
+		offsets[i] = static_cast<int64_t>(i + 1);
+		wallTimes[i] = now + static_cast<int64_t>(i) * 100;
+	}
+	int64_t last = 0;
+	if (!atl_TimeWarpClientSetTimeOffsets(batcher, offsets.data(), nullptr, 0) ||
+			!atl_TimeWarpClientSetTimeOffsets(batcher, offsets.data(), wallTimes.data(), 0) ||
+			!atl_TimeWarpClientSetTimeOffsets(batcher, offsets.data(), nullptr, 100) ||
+			!WaitForC(100) || g_cSum != 5050 ||
+			!atl_TimeWarpClientSetTimeOffsets(batcher, offsets.data(), wallTimes.data(), 100) ||
+			!WaitForC(200) || g_cSum != 10100 ||
+			!atl_TimeWarpServerGetTimeOffset(server, &last) || last != 100 ||
+			atl_TimeWarpClientSetTimeOffsetsAsync(batcher, offsets.data(), 100) != -1) {
+		std::cerr << "Batch send failed: received " << g_cReceived << ", sum " << g_cSum << std::endl;
+		return 12;
+	}
+	int queued = atl_TimeWarpClientCreateAsync("localhost", cPort, "", 1000);
+	if (queued < 0 ||
+			atl_TimeWarpClientSetTimeOffsetsAsync(queued, offsets.data(), 100) != 100 ||
+			!atl_TimeWarpClientFlush(queued, 5) || !WaitForC(300) || g_cSum != 15150 ||
+			!atl_TimeWarpClientDestroy(queued) || !atl_TimeWarpClientDestroy(batcher) ||
+			!atl_TimeWarpServerDestroy(server) || atl_TimeWarpServerDestroy(server)) {
+		std::cerr << "Queued send failed: received " << g_cReceived << ", sum " << g_cSum << std::endl;
+		return 13;
+	}
+
+	std::cout << "Success!" << std::endl;
+	return 0;
+}